@@ -0,0 +1,122 @@
+/*
+ * Region allocator for the memory that lives as long as an extraction
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "rdrview.h"
+
+/* Usual size for the chunks, bigger allocations get a chunk of their own */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Alignment for every allocation */
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+/* A single block of memory for the arena, allocations are taken from its end */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size; /* Bytes available in the data field */
+	size_t used;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+/**
+ * Add a new chunk to the arena, with room for at least the given size
+ */
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	if (size < ARENA_CHUNK_SIZE)
+		size = ARENA_CHUNK_SIZE;
+	chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk)
+		fatal_errno();
+	chunk->size = size;
+	chunk->used = 0;
+
+	/* Keep the current chunk at the head if this one will be full anyway */
+	if (arena->chunks && size > ARENA_CHUNK_SIZE) {
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	return chunk;
+}
+
+/**
+ * Allocate memory from the arena; it gets released by free_arena() and never
+ * on its own
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size)
+		chunk = new_chunk(arena, size);
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+/**
+ * Like arena_alloc(), but the memory is set to zero
+ */
+void *arena_calloc(struct arena *arena, size_t size)
+{
+	return memset(arena_alloc(arena, size), 0, size);
+}
+
+/**
+ * Move all the memory from one arena to another, leaving the first one empty
+ */
+void arena_adopt(struct arena *arena, struct arena *other)
+{
+	struct arena_chunk *last;
+
+	if (!other->chunks)
+		return;
+	for (last = other->chunks; last->next; last = last->next);
+
+	/* The current chunk of the destination should remain the current one */
+	if (arena->chunks) {
+		last->next = arena->chunks->next;
+		arena->chunks->next = other->chunks;
+	} else {
+		arena->chunks = other->chunks;
+	}
+	other->chunks = NULL;
+}
+
+/**
+ * Release all the memory allocated from the arena, which can then be reused
+ */
+void free_arena(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+}
@@ -0,0 +1,255 @@
+/*
+ * On-disk cache for the downloaded webpages, revalidated on each fetch
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE /* For strndup() and strncasecmp() on older systems */
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "rdrview.h"
+
+/*
+ * Each entry is a file named after the hash of the url, starting with these
+ * lines: the magic string, the url, the etag and the last-modified date (the
+ * last two may be empty). The body of the response comes right after.
+ *
+ * The url is the one requested, not where the redirects ended: that's the only
+ * one known before the request, to send the validators with it.
+ */
+#define CACHE_MAGIC "rdrview cache 3"
+
+/**
+ * Get the 64-bit FNV-1a hash for a string, to name its entry
+ */
+static unsigned long long hash_url(const char *url)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	while (*url) {
+		hash ^= (unsigned char)*url++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Read a line from the header of an entry into a new string, without the
+ * newline; return NULL if it's not there
+ */
+static char *read_header_line(FILE *file)
+{
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+
+	len = getline(&line, &n, file);
+	if (len <= 0 || line[len - 1] != '\n') {
+		free(line);
+		return NULL;
+	}
+	line[len - 1] = '\0';
+	return line;
+}
+
+/**
+ * Return a copy of the string, or NULL if it's empty
+ */
+static char *nonempty_dup(const char *str, size_t len)
+{
+	char *dup;
+
+	if (!len)
+		return NULL;
+	dup = strndup(str, len);
+	if (!dup)
+		fatal_errno();
+	return dup;
+}
+
+/**
+ * Look up the entry for a url in the cache directory, which gets created if
+ * needed. The entry struct is always initialized; if the url was in the cache,
+ * its file is left open at the start of the body.
+ */
+void open_cache_entry(struct cache_entry *entry, const char *dir, const char *url)
+{
+	char *magic, *cached_url, *etag, *last_modified;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->url = url;
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return; /* Caching will just fail later, and get reported */
+
+	if (asprintf(&entry->path, "%s/%016llx", dir, hash_url(url)) < 0)
+		fatal_errno();
+	entry->file = fopen(entry->path, "r");
+	if (!entry->file)
+		return;
+
+	magic = read_header_line(entry->file);
+	cached_url = read_header_line(entry->file);
+	etag = read_header_line(entry->file);
+	last_modified = read_header_line(entry->file);
+	if (!last_modified || strcmp(magic, CACHE_MAGIC) != 0 || strcmp(cached_url, url) != 0) {
+		/* A broken entry, or a hash collision; it will be replaced */
+		fclose(entry->file);
+		entry->file = NULL;
+	} else {
+		entry->etag = nonempty_dup(etag, strlen(etag));
+		entry->last_modified = nonempty_dup(last_modified, strlen(last_modified));
+	}
+	free(magic);
+	free(cached_url);
+	free(etag);
+	free(last_modified);
+}
+
+/**
+ * Check if a header line has the given name; if so, return its trimmed value
+ * and length through the arguments
+ */
+static bool header_value(const char *line, size_t len, const char *name,
+			 const char **value, size_t *value_len)
+{
+	size_t namelen = strlen(name);
+
+	if (len <= namelen || strncasecmp(line, name, namelen) != 0 || line[namelen] != ':')
+		return false;
+	line += namelen + 1;
+	len -= namelen + 1;
+	while (len && isspace((unsigned char)*line)) {
+		++line;
+		--len;
+	}
+	while (len && isspace((unsigned char)line[len - 1]))
+		--len;
+	*value = line;
+	*value_len = len;
+	return true;
+}
+
+/**
+ * Take note of a header line from the response. Redirects and informational
+ * responses have their own headers, so start over on each status line.
+ */
+void cache_header_line(struct cache_entry *entry, const char *line, size_t len)
+{
+	const char *value;
+	size_t value_len;
+
+	if (len > 5 && strncmp(line, "HTTP/", 5) == 0) {
+		const char *code = memchr(line, ' ', len);
+
+		entry->status = code ? strtol(code + 1, NULL, 10) : 0;
+		free(entry->new_etag);
+		free(entry->new_last_modified);
+		entry->new_etag = NULL;
+		entry->new_last_modified = NULL;
+	} else if (header_value(line, len, "ETag", &value, &value_len)) {
+		free(entry->new_etag);
+		entry->new_etag = nonempty_dup(value, value_len);
+	} else if (header_value(line, len, "Last-Modified", &value, &value_len)) {
+		free(entry->new_last_modified);
+		entry->new_last_modified = nonempty_dup(value, value_len);
+	}
+}
+
+/**
+ * Start the file for a new entry, in the same directory so that it can be
+ * renamed over the old one at the end; return false on failure.
+ */
+static bool start_new_entry(struct cache_entry *entry)
+{
+	int fd;
+
+	if (!entry->path || strchr(entry->url, '\n'))
+		return false;
+	if (asprintf(&entry->new_path, "%s.XXXXXX", entry->path) < 0)
+		fatal_errno();
+	fd = mkstemp(entry->new_path);
+	if (fd < 0) {
+		free(entry->new_path);
+		entry->new_path = NULL;
+		return false;
+	}
+	entry->new_file = fdopen(fd, "w");
+	if (!entry->new_file)
+		fatal_errno();
+
+	fprintf(entry->new_file, "%s\n%s\n%s\n%s\n", CACHE_MAGIC, entry->url,
+		entry->new_etag ? entry->new_etag : "",
+		entry->new_last_modified ? entry->new_last_modified : "");
+	return true;
+}
+
+/**
+ * Save a chunk of the body of the response to a new entry, if the response is
+ * worth caching; that is, a full page that can later be revalidated.
+ */
+void cache_body_chunk(struct cache_entry *entry, const char *chunk, size_t len)
+{
+	if (entry->status != 200 || (!entry->new_etag && !entry->new_last_modified))
+		return;
+	if (!entry->new_file && !entry->failed && !start_new_entry(entry))
+		entry->failed = true;
+	if (entry->new_file && fwrite(chunk, 1, len, entry->new_file) != len)
+		entry->failed = true;
+}
+
+/**
+ * Make the new entry the current one if the transfer completed, or throw it
+ * away otherwise; return false if the entry couldn't be saved.
+ */
+bool finish_cache_entry(struct cache_entry *entry, bool complete)
+{
+	bool saved = false;
+
+	if (entry->new_file) {
+		if (fclose(entry->new_file))
+			entry->failed = true;
+		entry->new_file = NULL;
+		if (complete && !entry->failed)
+			saved = !rename(entry->new_path, entry->path);
+		if (!saved)
+			unlink(entry->new_path);
+	}
+	/* A page that can't be revalidated would only waste space */
+	if (complete && entry->status == 200 && !saved && entry->path)
+		unlink(entry->path);
+	return saved || !entry->failed;
+}
+
+/**
+ * Free all memory and close all files for the entry
+ */
+void close_cache_entry(struct cache_entry *entry)
+{
+	if (entry->file)
+		fclose(entry->file);
+	free(entry->path);
+	free(entry->etag);
+	free(entry->last_modified);
+	free(entry->new_etag);
+	free(entry->new_last_modified);
+	free(entry->new_path);
+	memset(entry, 0, sizeof(*entry));
+}
@@ -131,42 +131,172 @@ xmlChar *node_get_normalized_content(htmlNodePtr node)
 }
 
 /**
- * Get length of a node's text content, after stripping excess whitespace
+ * Like node_get_normalized_content(), but the returned string is allocated from
+ * the current arena, so it only needs to be released along with the context.
  */
-int text_normalized_content_length(htmlNodePtr node)
+const xmlChar *scratch_normalized_content(htmlNodePtr node)
 {
-	xmlChar *content = node_get_normalized_content(node);
-	int len, utf8len;
+	xmlChar *content;
+	xmlChar *stripped;
 
+	/* Text nodes can be normalized in place, without a copy */
+	if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+		if (!node->content)
+			return NULL;
+		stripped = arena_alloc(current_arena(), xmlStrlen(node->content) + 1);
+		strcpy_normalize(stripped, node->content);
+		return stripped;
+	}
+
+	content = xmlNodeGetContent(node);
 	if (!content)
-		return 0;
+		return NULL;
+	stripped = arena_alloc(current_arena(), xmlStrlen(content) + 1);
+	strcpy_normalize(stripped, content);
+	xmlFree(content);
+	return stripped;
+}
+
+/**
+ * Get the text statistics for a string, the same as strcpy_normalize() would
+ * leave it
+ */
+static void text_stats_from_str(struct text_stats *stats, const xmlChar *str)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!str)
+		return;
+
+	while (*str) {
+		if (isspace(*str) || memcmp(str, "\xc2\xa0", 2) == 0) {
+			if (!stats->length)
+				stats->leading_space = true;
+			if (!stats->trailing_space)
+				++stats->length;
+			stats->trailing_space = true;
+			str += isspace(*str) ? 1 : 2;
+			continue;
+		}
+
+		if (*str == ',')
+			++stats->commas;
+		if ((*str & 0xc0) != 0x80) /* Not a continuation byte */
+			++stats->length;
+		stats->trailing_space = false;
+		++str;
+	}
+}
+
+/**
+ * Update the statistics for a text with those of some text that follows it
+ */
+static void concat_text_stats(struct text_stats *stats, const struct text_stats *next)
+{
+	if (!next->length)
+		return;
+	if (!stats->length)
+		stats->leading_space = next->leading_space;
+
+	stats->length += next->length;
+	if (stats->trailing_space && next->leading_space)
+		--stats->length; /* The whitespace gets merged */
+	stats->trailing_space = next->trailing_space;
+	stats->commas += next->commas;
+}
 
-	/* Finding the length twice is ugly, could it be improved? */
-	len = xmlStrlen(content);
-	utf8len = xmlUTF8Strlen(content);
-	if (!len)
-		goto out;
+/**
+ * Get the length of the text from the statistics, without leading or trailing
+ * whitespace
+ */
+static int stripped_length(const struct text_stats *stats)
+{
+	int length = stats->length;
 
-	if (content[0] == ' ')
-		--utf8len;
-	if (len > 1 && content[len - 1] == ' ')
-		--utf8len;
+	if (stats->leading_space)
+		--length;
+	if (length && stats->trailing_space)
+		--length;
+	return length;
+}
 
-out:
+/**
+ * Get the text statistics for an element node. They are kept in the info
+ * struct, and only recalculated for the subtrees that changed since last time.
+ */
+const struct text_stats *get_text_stats(htmlNodePtr node)
+{
+	struct node_info *ni = allocate_node_info(node);
+	struct text_stats *stats = &ni->stats;
+	htmlNodePtr child;
+
+	assert(node->type == XML_ELEMENT_NODE);
+	if (ni->flags & NODE_TEXT_STATS)
+		return stats;
+
+	memset(stats, 0, sizeof(*stats));
+	for (child = node->children; child; child = child->next) {
+		const struct text_stats *child_stats;
+		struct text_stats text;
+
+		if (child->type == XML_ELEMENT_NODE) {
+			child_stats = get_text_stats(child);
+			stats->link_length += child_stats->link_length;
+			if (node_has_tag(child, TAG_A))
+				stats->link_length += stripped_length(child_stats);
+		} else if (child->type == XML_TEXT_NODE ||
+			   child->type == XML_CDATA_SECTION_NODE) {
+			text_stats_from_str(&text, child->content);
+			child_stats = &text;
+		} else {
+			continue;
+		}
+		concat_text_stats(stats, child_stats);
+	}
+
+	ni->flags |= NODE_TEXT_STATS;
+	return stats;
+}
+
+/**
+ * Get length of a node's text content, after stripping excess whitespace
+ */
+int text_normalized_content_length(htmlNodePtr node)
+{
+	struct text_stats stats;
+	xmlChar *content;
+
+	if (node->type == XML_ELEMENT_NODE)
+		return stripped_length(get_text_stats(node));
+	if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+		text_stats_from_str(&stats, node->content);
+		return stripped_length(&stats);
+	}
+
+	content = xmlNodeGetContent(node);
+	text_stats_from_str(&stats, content);
 	xmlFree(content);
-	return utf8len;
+	return stripped_length(&stats);
 }
 
 /**
- * Like node_get_normalized_content(), but respect whitespace for preformatted
- * text. This function must only be called for text nodes.
+ * Count the commas in the text content of a node
  */
-xmlChar *node_get_normalized_or_preformatted(htmlNodePtr node)
+int text_comma_count(htmlNodePtr node)
 {
-	assert(node->type == XML_TEXT_NODE);
-	if (has_ancestor_tag(node, "code") || has_ancestor_tag(node, "pre"))
-		return xmlNodeGetContent(node);
-	return node_get_normalized_content(node);
+	struct text_stats stats;
+	xmlChar *content;
+
+	if (node->type == XML_ELEMENT_NODE)
+		return get_text_stats(node)->commas;
+	if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+		text_stats_from_str(&stats, node->content);
+		return stats.commas;
+	}
+
+	content = xmlNodeGetContent(node);
+	text_stats_from_str(&stats, content);
+	xmlFree(content);
+	return stats.commas;
 }
 
 /**
@@ -224,34 +354,39 @@ int char_count(const char *str, char c)
 	return count;
 }
 
-/**
- * If the node is a link, return the length of its content; return 0 otherwise
- */
-static double length_if_link(htmlNodePtr node)
-{
-	return node_has_tag(node, "a") ? text_normalized_content_length(node) : 0;
-}
-
 /**
  * fx: Get the density of links as a percentage of the content. This is the
  * amount of text that is inside a link divided by the total text in the node.
  */
 double get_link_density(htmlNodePtr node)
 {
+	const struct text_stats *stats;
 	double textlen;
 
-	textlen = text_normalized_content_length(node);
+	if (node->type != XML_ELEMENT_NODE) /* No descendants, so no links */
+		return 0;
+
+	stats = get_text_stats(node);
+	textlen = stripped_length(stats);
 	if (!textlen)
 		return 0;
-	return total_for_descendants(node, length_if_link) / textlen;
+	return stats->link_length / textlen;
 }
 
-static const char * const PHRASING_ELEMS[] = {
-	"abbr", "audio", "b", "bdo", "br", "button", "cite", "code", "data",
-	"datalist", "dfn", "em", "embed", "i", "img", "input", "kbd", "label",
-	"mark", "math", "meter", "noscript", "object", "output", "progress", "q",
-	"ruby", "samp", "script", "select", "small", "span", "strong", "sub",
-	"sup", "textarea", "time", "var", "wbr",
+static const bool PHRASING_ELEMS[TAG_COUNT] = {
+	[TAG_ABBR] = true, [TAG_AUDIO] = true, [TAG_B] = true, [TAG_BDO] = true,
+	[TAG_BR] = true, [TAG_BUTTON] = true, [TAG_CITE] = true,
+	[TAG_CODE] = true, [TAG_DATA] = true, [TAG_DATALIST] = true,
+	[TAG_DFN] = true, [TAG_EM] = true, [TAG_EMBED] = true, [TAG_I] = true,
+	[TAG_IMG] = true, [TAG_INPUT] = true, [TAG_KBD] = true,
+	[TAG_LABEL] = true, [TAG_MARK] = true, [TAG_MATH] = true,
+	[TAG_METER] = true, [TAG_NOSCRIPT] = true, [TAG_OBJECT] = true,
+	[TAG_OUTPUT] = true, [TAG_PROGRESS] = true, [TAG_Q] = true,
+	[TAG_RUBY] = true, [TAG_SAMP] = true, [TAG_SCRIPT] = true,
+	[TAG_SELECT] = true, [TAG_SMALL] = true, [TAG_SPAN] = true,
+	[TAG_STRONG] = true, [TAG_SUB] = true, [TAG_SUP] = true,
+	[TAG_TEXTAREA] = true, [TAG_TIME] = true, [TAG_VAR] = true,
+	[TAG_WBR] = true,
 };
 
 /**
@@ -261,7 +396,7 @@ static bool is_definitely_phrasing_content(htmlNodePtr node)
 {
 	if (node->type == XML_TEXT_NODE)
 		return true;
-	return node_has_tag_array(node, ARRAY_SIZE(PHRASING_ELEMS), PHRASING_ELEMS);
+	return node_has_tag_in(node, PHRASING_ELEMS);
 }
 
 /**
@@ -270,7 +405,7 @@ static bool is_definitely_phrasing_content(htmlNodePtr node)
  */
 static bool is_conditional_phrasing_content(htmlNodePtr node)
 {
-	return node_has_tag(node, "a", "del", "ins");
+	return node_has_tag(node, TAG_A, TAG_DEL, TAG_INS);
 }
 
 /**
@@ -307,7 +442,7 @@ bool is_phrasing_content(htmlNodePtr node)
  *
  * Return the child element, or NULL if the check failed.
  */
-htmlNodePtr has_single_tag_inside(htmlNodePtr node, const char *tag)
+htmlNodePtr has_single_tag_inside(htmlNodePtr node, enum tag_id tag)
 {
 	htmlNodePtr child;
 	htmlNodePtr element_child = NULL;
@@ -319,14 +454,8 @@ htmlNodePtr has_single_tag_inside(htmlNodePtr node, const char *tag)
 				return NULL;
 			element_child = child;
 		} else if (child->type == XML_TEXT_NODE) {
-			xmlChar *content = xmlNodeGetContent(child);
-			bool has_content = false;
-
 			/* fx: And there should be no text nodes with real content */
-			if (regex_matches(&hascontent_re, content))
-				has_content = true;
-			xmlFree(content);
-			if (has_content)
+			if (regex_matches(&hascontent_re, child->content))
 				return NULL;
 		}
 	}
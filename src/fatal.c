@@ -0,0 +1,66 @@
+/*
+ * Error reporting for unrecoverable failures
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rdrview.h"
+
+/* Program name for the error messages; users of the library may change it */
+const char *progname = "rdrview";
+
+/**
+ * Get the exit status for a fatal error; running out of memory gets its own,
+ * because it's likely to be the fault of a memory limit set by the user
+ */
+static int fatal_status(void)
+{
+	return errno == ENOMEM ? STATUS_OUT_OF_MEMORY : 1;
+}
+
+/**
+ * Print the location of the issue and exit with an error code
+ */
+__attribute__((noreturn)) void fatal_with_loc(const char *fn, int line)
+{
+	char *FORMAT = "%s: fatal error in function %s(), line %d\n";
+	int status = fatal_status(); /* Before the print can touch errno */
+
+	fprintf(stderr, FORMAT, progname, fn, line);
+	exit(status);
+}
+
+/**
+ * Print a message and exit with an error code
+ */
+__attribute__((noreturn)) void fatal_msg(char *message)
+{
+	fprintf(stderr, "%s: %s\n", progname, message);
+	exit(1);
+}
+
+/**
+ * Print the message for the current errno value and exit with an error code
+ */
+__attribute__((noreturn)) void fatal_errno(void)
+{
+	int status = fatal_status();
+
+	perror(progname);
+	exit(status);
+}
@@ -22,6 +22,7 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include <libxml/tree.h>
 #include "rdrview.h"
 
@@ -64,7 +65,7 @@ htmlNodePtr remove_and_get_following(htmlNodePtr node)
 	htmlNodePtr following;
 
 	following = skip_node_descendants(node);
-	xmlUnlinkNode(node);
+	unlink_node(node);
 	free_node(node);
 	return following;
 }
@@ -87,6 +88,24 @@ void remove_descendants_if(htmlNodePtr node, condition_fn check)
 	}
 }
 
+/**
+ * Remove all descendants of a node that return true for the given condition.
+ * The data argument is passed to the check function.
+ */
+void remove_descendants_if_with_data(htmlNodePtr node, condition_fn2 check, const void *data)
+{
+	htmlNodePtr last, curr;
+
+	curr = following_node(node);
+	last = skip_node_descendants(node);
+	while (curr != last) {
+		if (check(curr, data))
+			curr = remove_and_get_following(curr);
+		else
+			curr = following_node(curr);
+	}
+}
+
 /**
  * Remove all nodes of a document that return true for the given condition.
  * The check may have a side effect as long as it only changes the node itself.
@@ -185,57 +204,55 @@ void *run_on_nodes(htmlDocPtr doc, action_fn act)
 }
 
 /**
- * Run a replacement function on all descendants of a node; that function must
- * return a pointer to the new node, so that the traversal can continue.
+ * Like run_on_nodes(), but the data argument is passed to the action
  */
-void change_descendants(htmlNodePtr node, replace_fn replace)
+void *run_on_nodes_with_data(htmlDocPtr doc, action_fn2 act, void *data)
 {
-	htmlNodePtr first, last, curr;
+	htmlNodePtr node;
+	void *ret = NULL;
 
-	first = following_node(node);
-	last = skip_node_descendants(node);
-	for (curr = first; curr != last; curr = following_node(curr))
-		curr = replace(curr);
+	for (node = first_node(doc); node; node = following_node(node)) {
+		void *tmp;
+
+		tmp = act(node, data);
+		if (tmp)
+			ret = tmp;
+	}
+	return ret;
 }
 
 /**
- * Run a calculation on all descendants of a node, return the sum of all
- * results.
+ * Run a replacement function on all descendants of a node; that function must
+ * return a pointer to the new node, so that the traversal can continue.
  */
-double total_for_descendants(htmlNodePtr node, calc_fn calc)
+void change_descendants(htmlNodePtr node, replace_fn replace)
 {
 	htmlNodePtr first, last, curr;
-	double total = 0;
 
 	first = following_node(node);
 	last = skip_node_descendants(node);
 	for (curr = first; curr != last; curr = following_node(curr))
-		total += calc(curr);
-	return total;
+		curr = replace(curr);
 }
 
 /**
- * Count all descendants of the node that satisfy the condition. The data
- * argument is passed to the check function.
+ * Like change_descendants(), but the data argument is passed to the replacement
+ * function
  */
-int count_such_descs(htmlNodePtr node, condition_fn2 check, const void *data)
+void change_descendants_with_data(htmlNodePtr node, replace_fn2 replace, void *data)
 {
 	htmlNodePtr first, last, curr;
-	int count = 0;
 
 	first = following_node(node);
 	last = skip_node_descendants(node);
-	for (curr = first; curr != last; curr = following_node(curr)) {
-		if (check(curr, data))
-			++count;
-	}
-	return count;
+	for (curr = first; curr != last; curr = following_node(curr))
+		curr = replace(curr, data);
 }
 
 /**
  * Return the first descendant that has a given tag, or NULL if none
  */
-htmlNodePtr first_descendant_with_tag(htmlNodePtr node, const char *tag)
+htmlNodePtr first_descendant_with_tag(htmlNodePtr node, enum tag_id tag)
 {
 	htmlNodePtr first, last, curr;
 
@@ -251,7 +268,7 @@ htmlNodePtr first_descendant_with_tag(htmlNodePtr node, const char *tag)
 /**
  * Return the first node in the document that has a given tag, or NULL if none
  */
-htmlNodePtr first_node_with_tag(htmlDocPtr doc, const char *tag)
+htmlNodePtr first_node_with_tag(htmlDocPtr doc, enum tag_id tag)
 {
 	return first_descendant_with_tag(xmlDocGetRootElement(doc), tag);
 }
@@ -302,7 +319,7 @@ static htmlNodePtr remove_and_get_previous(htmlNodePtr node)
 	htmlNodePtr previous;
 
 	previous = previous_node(node);
-	xmlUnlinkNode(node);
+	unlink_node(node);
 	free_node(node);
 	return previous;
 }
@@ -366,3 +383,64 @@ htmlNodePtr prev_element(htmlNodePtr node)
 	}
 	return NULL;
 }
+
+/**
+ * Add an entry for an element to the end of the index, and return its position
+ */
+static long add_index_entry(struct node_index *index, htmlNodePtr node, long parent)
+{
+	struct index_entry *entry;
+
+	if (index->count == index->size) {
+		size_t size = index->size ? 2 * index->size : 256;
+		struct index_entry *entries;
+
+		entries = realloc(index->entries, size * sizeof(*entries));
+		if (!entries)
+			fatal_errno();
+		index->entries = entries;
+		index->size = size;
+	}
+	entry = &index->entries[index->count];
+	entry->node = node;
+	entry->info = allocate_node_info(node);
+	entry->parent = parent;
+	return index->count++;
+}
+
+/**
+ * List all the elements of a document in preorder, starting from the root, so
+ * that later passes can go over them without chasing the pointers in the tree.
+ * An index that was used before gets its memory reused.
+ */
+void build_node_index(struct node_index *index, htmlDocPtr doc)
+{
+	htmlNodePtr node = xmlDocGetRootElement(doc);
+	long curr, parent = -1;
+
+	index->count = 0;
+	while (node) {
+		curr = add_index_entry(index, node, parent);
+		node = xmlFirstElementChild(node);
+		if (node) {
+			parent = curr;
+			continue;
+		}
+
+		/* Go up until some ancestor has a following sibling, if any */
+		while (curr > 0 && !node) {
+			node = xmlNextElementSibling(index->entries[curr].node);
+			parent = index->entries[curr].parent;
+			curr = parent;
+		}
+	}
+}
+
+/**
+ * Free the memory for an index
+ */
+void free_node_index(struct node_index *index)
+{
+	free(index->entries);
+	memset(index, 0, sizeof(*index));
+}
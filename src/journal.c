@@ -0,0 +1,242 @@
+/*
+ * Reversible changes to a document, so that it can be reused between the
+ * extraction attempts instead of copied for each of them
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <libxml/tree.h>
+#include "rdrview.h"
+
+/* Types of journal entries */
+#define JOURNAL_UNLINK 0 /* The node was unlinked from parent, after prev */
+#define JOURNAL_LINK 1 /* The node was linked somewhere */
+#define JOURNAL_CREATE 2 /* The node was created */
+#define JOURNAL_RENAME 3 /* The node had the old name */
+#define JOURNAL_CONTENT 4 /* The text node had the old content */
+
+/**
+ * Link a node in the given location, right after prev or as the first child of
+ * parent if prev is NULL. Don't use xmlAddChild() and friends for this, so that
+ * text nodes never get merged.
+ */
+static void link_after(htmlNodePtr parent, htmlNodePtr prev, htmlNodePtr node)
+{
+	invalidate_cached_stats(parent);
+	node->parent = parent;
+	node->prev = prev;
+	node->next = prev ? prev->next : parent->children;
+	if (prev)
+		prev->next = node;
+	else
+		parent->children = node;
+	if (node->next)
+		node->next->prev = node;
+	else
+		parent->last = node;
+}
+
+/**
+ * Append a new entry to the journal and return it
+ */
+static struct journal_entry *new_entry(struct journal *jnl, int type, htmlNodePtr node)
+{
+	struct journal_entry *entry;
+
+	if (jnl->count == jnl->size) {
+		size_t size = jnl->size ? 2 * jnl->size : 256;
+
+		entry = realloc(jnl->entries, size * sizeof(*entry));
+		if (!entry)
+			fatal_errno();
+		jnl->entries = entry;
+		jnl->size = size;
+	}
+
+	entry = &jnl->entries[jnl->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->type = type;
+	entry->node = node;
+	return entry;
+}
+
+/**
+ * Create a new element node for the document, to be freed when the journal
+ * is undone
+ */
+htmlNodePtr journal_new_node(struct journal *jnl, htmlDocPtr doc, const char *name)
+{
+	htmlNodePtr node;
+
+	node = xmlNewDocNode(doc, NULL, (xmlChar *)name, NULL);
+	if (!node)
+		fatal();
+	new_entry(jnl, JOURNAL_CREATE, node);
+	return node;
+}
+
+/**
+ * Unlink a node from the tree, remembering its location
+ */
+void journal_unlink(struct journal *jnl, htmlNodePtr node)
+{
+	struct journal_entry *entry;
+
+	entry = new_entry(jnl, JOURNAL_UNLINK, node);
+	entry->parent = node->parent;
+	entry->prev = node->prev;
+	unlink_node(node);
+}
+
+/**
+ * Remove a node from the tree. The node is only freed right away if there is
+ * no journal, otherwise it's kept around in case the change gets undone.
+ */
+void journal_remove(struct journal *jnl, htmlNodePtr node)
+{
+	if (jnl) {
+		journal_unlink(jnl, node);
+	} else {
+		unlink_node(node);
+		free_node(node);
+	}
+}
+
+/**
+ * Like remove_and_get_following(), but the removal is logged to the journal
+ */
+htmlNodePtr journal_remove_and_get_following(struct journal *jnl, htmlNodePtr node)
+{
+	htmlNodePtr following;
+
+	following = skip_node_descendants(node);
+	journal_remove(jnl, node);
+	return following;
+}
+
+/**
+ * Like xmlAddChild() for a node that is not linked anywhere. If both the node
+ * and the last child are text, libxml2 would merge and free the node, so do
+ * the merge ourselves and keep the node for the undo.
+ */
+void journal_add_child(struct journal *jnl, htmlNodePtr parent, htmlNodePtr node)
+{
+	htmlNodePtr last = parent->last;
+
+	if (node->type == XML_TEXT_NODE && last && last->type == XML_TEXT_NODE &&
+	    node->name == last->name) {
+		struct journal_entry *entry;
+		xmlChar *content;
+
+		content = xmlStrncatNew(last->content, node->content, -1);
+		if (!content)
+			fatal();
+		entry = new_entry(jnl, JOURNAL_CONTENT, last);
+		entry->old = last->content;
+		last->content = content;
+		invalidate_cached_stats(parent);
+		return;
+	}
+
+	append_child(parent, node);
+	new_entry(jnl, JOURNAL_LINK, node);
+}
+
+/**
+ * Like xmlAddPrevSibling() for an element node that is not linked anywhere
+ */
+void journal_add_prev_sibling(struct journal *jnl, htmlNodePtr next, htmlNodePtr node)
+{
+	assert(node->type == XML_ELEMENT_NODE); /* No text merges to worry about */
+	add_prev_sibling(next, node);
+	new_entry(jnl, JOURNAL_LINK, node);
+}
+
+/**
+ * Like xmlReplaceNode(), but the old node is kept for the undo
+ */
+void journal_replace(struct journal *jnl, htmlNodePtr old, htmlNodePtr new)
+{
+	htmlNodePtr parent, prev;
+
+	if (new->parent)
+		journal_unlink(jnl, new);
+	parent = old->parent;
+	prev = old->prev;
+	journal_unlink(jnl, old);
+
+	link_after(parent, prev, new);
+	new_entry(jnl, JOURNAL_LINK, new);
+}
+
+/**
+ * Like xmlNodeSetName(), but the old name is kept for the undo
+ */
+void journal_set_name(struct journal *jnl, htmlNodePtr node, const char *name)
+{
+	struct journal_entry *entry;
+	xmlChar *new;
+
+	/* Our documents have no dictionary, so the names are always allocated */
+	assert(!node->doc || !node->doc->dict);
+
+	new = xmlStrdup((xmlChar *)name);
+	if (!new)
+		fatal();
+	entry = new_entry(jnl, JOURNAL_RENAME, node);
+	entry->old = (xmlChar *)node->name;
+	forget_tag_id(node);
+	node->name = new;
+	invalidate_cached_stats(node->parent);
+}
+
+/**
+ * Undo all changes in the journal, newest first, and empty it. The info
+ * structs attached to the nodes in the meantime are not touched.
+ */
+void undo_journal(struct journal *jnl)
+{
+	while (jnl->count) {
+		struct journal_entry *entry = &jnl->entries[--jnl->count];
+		htmlNodePtr node = entry->node;
+
+		switch (entry->type) {
+		case JOURNAL_UNLINK:
+			if (entry->parent)
+				link_after(entry->parent, entry->prev, node);
+			break;
+		case JOURNAL_LINK:
+			unlink_node(node);
+			break;
+		case JOURNAL_CREATE:
+			free_node(node);
+			break;
+		case JOURNAL_RENAME:
+			xmlFree((xmlChar *)node->name);
+			forget_tag_id(node);
+			node->name = entry->old;
+			invalidate_cached_stats(node->parent);
+			break;
+		case JOURNAL_CONTENT:
+			xmlFree(node->content);
+			node->content = entry->old;
+			invalidate_cached_stats(node->parent);
+			break;
+		}
+	}
+	free(jnl->entries);
+	memset(jnl, 0, sizeof(*jnl));
+}
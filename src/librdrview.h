@@ -0,0 +1,128 @@
+/*
+ * Public header file for the rdrview extraction library
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Based on Mozilla's Readability.js, available at:
+ * https://github.com/mozilla/readability/
+ * Original copyright notice:
+ *
+ * Copyright (c) 2010 Arc90 Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Give each document its own context with init_context(), run parse() on it,
+ * and then release the context with clean_context(), the article with
+ * xmlFreeNode() and the document with xmlFreeDoc(). Separate contexts can be
+ * used from different threads at the same time.
+ *
+ * There is no sandbox, so only feed the library documents that you would let
+ * libxml2 parse anyway. Errors that the library can't recover from, like
+ * running out of memory, print a message to stderr and exit() the whole
+ * process, with status 7 if memory ran out and 1 otherwise.
+ */
+
+#ifndef LIBRDRVIEW_H
+#define LIBRDRVIEW_H
+
+#include <stdbool.h>
+#include <libxml/HTMLtree.h>
+
+/* The library is built with hidden visibility, except for these functions */
+#define RDR_API __attribute__((visibility("default")))
+
+/*
+ * Flags for the extraction, as given to init_context(). Readability.js starts
+ * with OPT_STRIP_UNLIKELY, OPT_WEIGHT_CLASSES and OPT_CLEAN_CONDITIONALLY, and
+ * drops them one by one if the later attempts need it.
+ */
+#define OPT_URL_OVERRIDE (1 << 4) /* Override the base url */
+#define OPT_STRIP_UNLIKELY (1 << 5) /* Remove unlikely nodes early */
+#define OPT_WEIGHT_CLASSES (1 << 6) /* Consider classes for node score */
+#define OPT_CLEAN_CONDITIONALLY (1 << 7) /* Remove fishy nodes on prep */
+#define OPT_PRESERVE_CLASSES (1 << 8) /* Preserve class attributes */
+#define OPT_PARALLEL_ATTEMPTS (1 << 9) /* Run all extraction attempts at once */
+
+/* Metadata extracted from the article */
+struct metadata {
+	char *title;
+	char *byline;
+	char *excerpt;
+	char *site_name;
+	char *direction;
+};
+
+/*
+ * fx: The number of top candidates to consider when analysing how tight the
+ * competition is among candidates. TODO: override through cli option?
+ */
+#define DEFAULT_N_TOP_CANDIDATES 5
+
+/* A previous attempt to get the content */
+struct attempt {
+	htmlNodePtr article;
+	int length;
+};
+
+/* Memory released all at once, see arena.c */
+struct arena {
+	struct arena_chunk *chunks; /* The current one goes first */
+};
+
+struct class_cache;
+struct rdr_stats;
+
+/*
+ * All the state for the extraction of a single document. Separate contexts can
+ * be used to work on several documents at the same time. Only the metadata and
+ * the budgets are meant for the caller, the rest is private.
+ */
+struct rdr_context {
+	unsigned int flags; /* OPT_* flags for the extraction */
+	const char *base_url; /* Base for all relative URLs */
+	char *doc_base_url; /* Base URL set by the document itself, if any */
+	struct metadata metadata;
+	struct attempt attempts[4];
+	htmlNodePtr tops[DEFAULT_N_TOP_CANDIDATES]; /* Top candidate nodes */
+
+	/* Position of the best name found so far for each metadata field */
+	unsigned int best_title_i;
+	unsigned int best_byline_i;
+	unsigned int best_excerpt_i;
+
+	bool found_byline; /* Has the byline node already been found? */
+	bool class_weights_used; /* Did the class weights affect any score? */
+
+	struct class_cache *class_cache; /* Patterns matched by each class and id */
+	struct arena arena; /* Node info structs and scratch strings */
+	struct rdr_stats *stats; /* Only for rdrview itself, NULL by default */
+
+	/* Budgets set by the caller if wanted, zero by default */
+	double deadline; /* CLOCK_MONOTONIC time to stop starting new attempts */
+	unsigned long max_nodes; /* Refuse documents with more nodes than this */
+	bool out_of_time; /* The deadline passed before the last attempt */
+	bool too_many_nodes; /* The document was refused for its node count */
+};
+
+/* readability.c */
+extern RDR_API void init_context(struct rdr_context *ctx, unsigned int flags, const char *base_url);
+extern RDR_API void clean_context(struct rdr_context *ctx);
+extern RDR_API void get_article_metadata(struct rdr_context *ctx, htmlDocPtr doc);
+extern RDR_API htmlNodePtr parse(struct rdr_context *ctx, htmlDocPtr doc);
+
+/* readerable.c */
+extern RDR_API bool is_probably_readerable(htmlDocPtr doc);
+
+#endif /* LIBRDRVIEW_H */
@@ -25,6 +25,34 @@
 #include <string.h>
 #include "rdrview.h"
 
+/* Arena for the info structs allocated by this thread */
+static _Thread_local struct arena *node_arena;
+
+/* Number of info structs allocated by this thread, for the stats */
+static _Thread_local unsigned long node_info_count;
+
+/**
+ * Allocate all info structs and scratch strings for this thread from the given
+ * arena, from now on; return the arena that was used before.
+ */
+struct arena *use_arena(struct arena *arena)
+{
+	struct arena *prev = node_arena;
+
+	node_arena = arena;
+	return prev;
+}
+
+/**
+ * Get the arena in use by this thread
+ */
+struct arena *current_arena(void)
+{
+	if (!node_arena) /* Only the extraction code should need this */
+		fatal();
+	return node_arena;
+}
+
 /**
  * If the node has no info struct, allocate and attach one; return the struct.
  */
@@ -32,64 +60,280 @@ struct node_info *allocate_node_info(htmlNodePtr node)
 {
 	if (node->_private) /* This node already has an info struct */
 		return node->_private;
-	node->_private = calloc(1, sizeof(struct node_info));
-	if (!node->_private)
-		fatal_errno();
+	node->_private = arena_calloc(current_arena(), sizeof(struct node_info));
+	++node_info_count;
 	return node->_private;
 }
 
 /**
- * Free the info struct for the node (if any) and clear its field.
+ * Get the number of info structs allocated so far by this thread
+ */
+unsigned long node_infos_allocated(void)
+{
+	return node_info_count;
+}
+
+/**
+ * Detach the info struct from the node, if any. The attribute info stays,
+ * because it can't change between extraction attempts.
  */
-static htmlNodePtr free_node_info(htmlNodePtr node)
+static htmlNodePtr clear_node_info(htmlNodePtr node)
 {
-	free(node->_private);
-	node->_private = NULL;
+	struct node_info *ni = node->_private;
+	struct node_attrs attrs;
+
+	if (!ni || !(ni->flags & NODE_ATTRS)) {
+		node->_private = NULL;
+		return node;
+	}
+	attrs = ni->attrs;
+	memset(ni, 0, sizeof(*ni));
+	ni->flags = NODE_ATTRS;
+	ni->attrs = attrs;
 	return node;
 }
 
 /**
- * Like xmlFreeNode(), but also free the info struct for each node.
+ * Detach the info structs from the node and all its descendants, so that they
+ * can be worked out again from scratch
+ */
+void clear_tree_info(htmlNodePtr node)
+{
+	clear_node_info(node);
+	change_descendants(node, clear_node_info);
+}
+
+/**
+ * Like xmlFreeNode(). The info structs belong to the arena, so they are left
+ * alone.
  */
 void free_node(htmlNodePtr node)
 {
 	if (!node)
 		return;
-	free_node_info(node);
-	change_descendants(node, free_node_info);
 	xmlFreeNode(node);
 }
 
 /**
- * Like xmlFreeDoc(), but also free the info struct for each node.
+ * Like xmlFreeDoc(). The info structs belong to the arena, so they are left
+ * alone.
  */
 void free_doc(htmlDocPtr doc)
 {
-	htmlNodePtr root = xmlDocGetRootElement(doc);
+	xmlFreeDoc(doc);
+}
+
+/**
+ * The content of this node has changed, so discard the cached statistics for
+ * it and all its ancestors
+ */
+void invalidate_cached_stats(htmlNodePtr node)
+{
+	static const unsigned char cached = NODE_TEXT_STATS | NODE_PROFILE;
+
+	for (; node && node->type == XML_ELEMENT_NODE; node = node->parent) {
+		struct node_info *ni = node->_private;
 
-	if (root) {
-		free_node_info(root);
-		change_descendants(root, free_node_info);
+		/* The statistics for an ancestor can't be valid if these aren't */
+		if (!ni || !(ni->flags & cached))
+			return;
+		ni->flags &= ~cached;
 	}
-	xmlFreeDoc(doc);
 }
 
+/*
+ * All changes to the tree should go through the following wrappers, so that
+ * the cached statistics for the affected nodes get discarded.
+ */
+
 /**
- * Check if a node has one of the (lowercase) tag names in the array
- *
- * It's usually cleaner to call this function through the node_has_tag() macro
- * wrapper, so that the tag count argument is not required.
+ * Like xmlUnlinkNode()
  */
-bool node_has_tag_array(htmlNodePtr node, int tagc, const char * const tagv[])
+void unlink_node(htmlNodePtr node)
 {
-	if (!node || !node->name)
-		return false;
+	invalidate_cached_stats(node->parent);
+	xmlUnlinkNode(node);
+}
+
+/**
+ * Like xmlAddChild(), but the node must not be linked anywhere
+ */
+void append_child(htmlNodePtr parent, htmlNodePtr node)
+{
+	assert(!node->parent);
+	if (!xmlAddChild(parent, node))
+		fatal();
+	invalidate_cached_stats(parent);
+}
+
+/**
+ * Like xmlAddPrevSibling(), but the node must not be linked anywhere
+ */
+void add_prev_sibling(htmlNodePtr next, htmlNodePtr node)
+{
+	assert(!node->parent);
+	if (!xmlAddPrevSibling(next, node))
+		fatal();
+	invalidate_cached_stats(next->parent);
+}
+
+/**
+ * Like xmlReplaceNode()
+ */
+void replace_node(htmlNodePtr old, htmlNodePtr new)
+{
+	invalidate_cached_stats(new->parent);
+	invalidate_cached_stats(old->parent);
+	xmlReplaceNode(old, new);
+}
+
+/**
+ * Like xmlNodeSetName()
+ */
+void set_node_name(htmlNodePtr node, const char *name)
+{
+	invalidate_cached_stats(node->parent); /* The node may become a link */
+	forget_tag_id(node);
+	xmlNodeSetName(node, (xmlChar *)name);
+}
+
+/**
+ * Like xmlNodeSetContent()
+ */
+void set_node_content(htmlNodePtr node, const char *content)
+{
+	invalidate_cached_stats(node);
+	invalidate_cached_stats(node->parent);
+	xmlNodeSetContent(node, (xmlChar *)content);
+}
 
-	while (tagc--) {
-		if (xmlStrcasecmp(node->name, (xmlChar *)*tagv++) == 0)
-			return true;
+/* Names for all tags with an id, indexed by the id */
+static const char * const TAG_NAMES[TAG_COUNT] = {
+	[TAG_A] = "a",
+	[TAG_ABBR] = "abbr",
+	[TAG_ADDRESS] = "address",
+	[TAG_ARTICLE] = "article",
+	[TAG_ASIDE] = "aside",
+	[TAG_AUDIO] = "audio",
+	[TAG_B] = "b",
+	[TAG_BASE] = "base",
+	[TAG_BDO] = "bdo",
+	[TAG_BLOCKQUOTE] = "blockquote",
+	[TAG_BODY] = "body",
+	[TAG_BR] = "br",
+	[TAG_BUTTON] = "button",
+	[TAG_CAPTION] = "caption",
+	[TAG_CITE] = "cite",
+	[TAG_CODE] = "code",
+	[TAG_COL] = "col",
+	[TAG_COLGROUP] = "colgroup",
+	[TAG_DATA] = "data",
+	[TAG_DATALIST] = "datalist",
+	[TAG_DD] = "dd",
+	[TAG_DEL] = "del",
+	[TAG_DETAILS] = "details",
+	[TAG_DFN] = "dfn",
+	[TAG_DIV] = "div",
+	[TAG_DL] = "dl",
+	[TAG_DT] = "dt",
+	[TAG_EM] = "em",
+	[TAG_EMBED] = "embed",
+	[TAG_FIELDSET] = "fieldset",
+	[TAG_FIGCAPTION] = "figcaption",
+	[TAG_FIGURE] = "figure",
+	[TAG_FONT] = "font",
+	[TAG_FOOTER] = "footer",
+	[TAG_FORM] = "form",
+	[TAG_H1] = "h1",
+	[TAG_H2] = "h2",
+	[TAG_H3] = "h3",
+	[TAG_H4] = "h4",
+	[TAG_H5] = "h5",
+	[TAG_H6] = "h6",
+	[TAG_HEADER] = "header",
+	[TAG_HR] = "hr",
+	[TAG_I] = "i",
+	[TAG_IFRAME] = "iframe",
+	[TAG_IMG] = "img",
+	[TAG_INPUT] = "input",
+	[TAG_INS] = "ins",
+	[TAG_KBD] = "kbd",
+	[TAG_LABEL] = "label",
+	[TAG_LI] = "li",
+	[TAG_LINK] = "link",
+	[TAG_MAIN] = "main",
+	[TAG_MARK] = "mark",
+	[TAG_MATH] = "math",
+	[TAG_META] = "meta",
+	[TAG_METER] = "meter",
+	[TAG_NAV] = "nav",
+	[TAG_NOSCRIPT] = "noscript",
+	[TAG_OBJECT] = "object",
+	[TAG_OL] = "ol",
+	[TAG_OUTPUT] = "output",
+	[TAG_P] = "p",
+	[TAG_PICTURE] = "picture",
+	[TAG_PRE] = "pre",
+	[TAG_PROGRESS] = "progress",
+	[TAG_Q] = "q",
+	[TAG_RUBY] = "ruby",
+	[TAG_SAMP] = "samp",
+	[TAG_SCRIPT] = "script",
+	[TAG_SECTION] = "section",
+	[TAG_SELECT] = "select",
+	[TAG_SMALL] = "small",
+	[TAG_SOURCE] = "source",
+	[TAG_SPAN] = "span",
+	[TAG_STRONG] = "strong",
+	[TAG_STYLE] = "style",
+	[TAG_SUB] = "sub",
+	[TAG_SUMMARY] = "summary",
+	[TAG_SUP] = "sup",
+	[TAG_SVG] = "svg",
+	[TAG_TABLE] = "table",
+	[TAG_TBODY] = "tbody",
+	[TAG_TD] = "td",
+	[TAG_TEMPLATE] = "template",
+	[TAG_TEXTAREA] = "textarea",
+	[TAG_TFOOT] = "tfoot",
+	[TAG_TH] = "th",
+	[TAG_THEAD] = "thead",
+	[TAG_TIME] = "time",
+	[TAG_TITLE] = "title",
+	[TAG_TR] = "tr",
+	[TAG_UL] = "ul",
+	[TAG_VAR] = "var",
+	[TAG_VIDEO] = "video",
+	[TAG_WBR] = "wbr",
+};
+
+/**
+ * Look up the tag id for an element node by its name, and save it in the extra
+ * field of the node for next time. Call this through get_tag_id().
+ */
+enum tag_id resolve_tag_id(htmlNodePtr node)
+{
+	int first = TAG_UNKNOWN + 1;
+	int last = TAG_COUNT - 1;
+
+	if (!node || node->type != XML_ELEMENT_NODE || !node->name)
+		return TAG_UNKNOWN;
+
+	while (first <= last) {
+		int mid = (first + last) / 2;
+		int cmp = xmlStrcasecmp(node->name, (xmlChar *)TAG_NAMES[mid]);
+
+		if (cmp == 0) {
+			node->extra = TAG_ID_KNOWN | mid;
+			return mid;
+		}
+		if (cmp < 0)
+			last = mid - 1;
+		else
+			first = mid + 1;
 	}
-	return false;
+	node->extra = TAG_ID_KNOWN | TAG_UNKNOWN;
+	return TAG_UNKNOWN;
 }
 
 /**
@@ -98,7 +342,7 @@ bool node_has_tag_array(htmlNodePtr node, int tagc, const char * const tagv[])
  *
  * Return the closest ancestor (including the node itself), or NULL if none.
  */
-htmlNodePtr has_ancestor_tag(htmlNodePtr node, const char *tag)
+htmlNodePtr has_ancestor_tag(htmlNodePtr node, enum tag_id tag)
 {
 	for (; node; node = node->parent) {
 		if (node_has_tag(node, tag))
@@ -127,98 +371,199 @@ static bool is_display_none(const xmlChar *style)
 	return strcasecmp(value, "none") == 0;
 }
 
-bool is_node_visible(htmlNodePtr node)
+/**
+ * Get the value of an attribute. The copy is only made if the value is not a
+ * single text node; it's returned in the second argument, to be freed by the
+ * caller.
+ */
+static const xmlChar *get_attr_value(xmlAttrPtr attr, xmlChar **copy)
 {
-	xmlChar *style = xmlGetProp(node, (xmlChar *)"style");
-	xmlChar *hidden = xmlGetProp(node, (xmlChar *)"hidden");
-	xmlChar *aria_hidden = xmlGetProp(node, (xmlChar *)"aria-hidden");
-	xmlChar *class = xmlGetProp(node, (xmlChar *)"class");
-	bool is_visible;
+	*copy = NULL;
+	if (!attr->children)
+		return (xmlChar *)"";
+	if (attr->children->type == XML_TEXT_NODE && !attr->children->next)
+		return attr->children->content;
+	*copy = xmlNodeListGetString(attr->doc, attr->children, 1);
+	return *copy ? *copy : (xmlChar *)"";
+}
 
-	/*
-	 * fx: Have to null-check node.style and node.className.indexOf to deal
-	 * with SVG and MathML nodes.
-	 */
-	is_visible = false;
-	if (style && is_display_none(style))
-		goto out;
-	if (hidden)
-		goto out;
+/**
+ * Go over the attributes of a node a single time, and save what they say about
+ * it. The cache may be NULL.
+ */
+static void scan_attributes(struct class_cache *cache, htmlNodePtr node, struct node_attrs *attrs)
+{
+	xmlAttrPtr attr;
+	bool aria_hidden = false, fallback_image = false;
 
-	/*
-	 * fx: check for "fallback-image" so that wikimedia math images are
-	 * displayed
-	 */
-	is_visible = true;
-	if (!aria_hidden || strcmp((char *)aria_hidden, "true") != 0)
-		goto out;
-	if (class && strstr((char *)class, "fallback-image"))
-		goto out;
+	memset(attrs, 0, sizeof(*attrs));
+	if (node->type != XML_ELEMENT_NODE)
+		return;
 
-	is_visible = false;
-out:
-	xmlFree(style);
-	xmlFree(hidden);
-	xmlFree(aria_hidden);
-	xmlFree(class);
-	return is_visible;
+	for (attr = node->properties; attr; attr = attr->next) {
+		const char *name = (char *)attr->name;
+		const char *value;
+		xmlChar *copy;
+
+		value = (char *)get_attr_value(attr, &copy);
+		if (strcmp(name, "class") == 0) {
+			attrs->class_flags = classify_class_id(cache, (xmlChar *)value);
+			/*
+			 * fx: check for "fallback-image" so that wikimedia math
+			 * images are displayed
+			 */
+			fallback_image = strstr(value, "fallback-image");
+		} else if (strcmp(name, "id") == 0) {
+			attrs->id_flags = classify_class_id(cache, (xmlChar *)value);
+		} else if (strcmp(name, "style") == 0) {
+			if (is_display_none((xmlChar *)value))
+				attrs->flags |= ATTR_HIDDEN;
+		} else if (strcmp(name, "hidden") == 0) {
+			attrs->flags |= ATTR_HIDDEN;
+		} else if (strcmp(name, "aria-hidden") == 0) {
+			aria_hidden = strcmp(value, "true") == 0;
+		} else if (strcmp(name, "rel") == 0) {
+			if (strcmp(value, "author") == 0)
+				attrs->flags |= ATTR_AUTHOR;
+		} else if (strcmp(name, "itemprop") == 0) {
+			if (strstr(value, "author"))
+				attrs->flags |= ATTR_AUTHOR;
+		} else if (strcmp(name, "role") == 0) {
+			if (strcmp(value, "complementary") == 0)
+				attrs->flags |= ATTR_COMPLEMENTARY;
+		}
+		xmlFree(copy);
+	}
+	if (aria_hidden && !fallback_image)
+		attrs->flags |= ATTR_HIDDEN;
 }
 
 /**
- * Considering only the node's class and id, is it unlikely to be readable?
+ * Get what the attributes say about a node. If the document wasn't scanned in
+ * advance, or the node is new, the attributes are looked at now and the info
+ * is saved in the provided buffer. The cache may be NULL.
+ */
+const struct node_attrs *get_node_attrs(struct class_cache *cache, htmlNodePtr node,
+					struct node_attrs *buf)
+{
+	const struct node_info *ni = node->_private;
+
+	if (ni && (ni->flags & NODE_ATTRS))
+		return &ni->attrs;
+	scan_attributes(cache, node, buf);
+	return buf;
+}
+
+/**
+ * Get the element that follows this one in the document, skipping all other
+ * types of nodes
+ */
+static htmlNodePtr following_element(htmlNodePtr node)
+{
+	htmlNodePtr next = xmlFirstElementChild(node);
+
+	for (; !next && node && node->type == XML_ELEMENT_NODE; node = node->parent)
+		next = xmlNextElementSibling(node);
+	return next;
+}
+
+/**
+ * Save what the attributes say about every element of the document in their
+ * info structs, so that the extraction attempts don't need to look at them
+ * again. The classes and ids all go to the cache as well.
+ */
+void scan_document_attrs(struct class_cache *cache, htmlDocPtr doc)
+{
+	htmlNodePtr node;
+
+	for (node = xmlDocGetRootElement(doc); node; node = following_element(node)) {
+		struct node_info *ni = allocate_node_info(node);
+
+		scan_attributes(cache, node, &ni->attrs);
+		ni->flags |= NODE_ATTRS;
+	}
+}
+
+/**
+ * Give the elements of a copy of the document the attribute info from their
+ * originals, so that it doesn't need to be worked out again
+ */
+void copy_document_attrs(htmlDocPtr copy, htmlDocPtr doc)
+{
+	htmlNodePtr src = xmlDocGetRootElement(doc);
+	htmlNodePtr dest = xmlDocGetRootElement(copy);
+
+	for (; src && dest; src = following_element(src), dest = following_element(dest)) {
+		const struct node_info *orig = src->_private;
+		struct node_info *ni;
+
+		if (!orig || !(orig->flags & NODE_ATTRS))
+			continue;
+		ni = allocate_node_info(dest);
+		ni->attrs = orig->attrs;
+		ni->flags |= NODE_ATTRS;
+	}
+}
+
+/**
+ * Is the node visible, going by its attributes? The cache may be NULL.
+ */
+bool is_node_visible(struct class_cache *cache, htmlNodePtr node)
+{
+	struct node_attrs buf;
+
+	return !(get_node_attrs(cache, node, &buf)->flags & ATTR_HIDDEN);
+}
+
+/**
+ * Get the CLASS_* flags for the patterns matched by either the class or the id
+ * of the node. The cache may be NULL.
  */
-bool node_has_unlikely_class_id(htmlNodePtr node)
+unsigned int get_class_id_flags(struct class_cache *cache, htmlNodePtr node)
 {
-	xmlChar *class, *id;
-	bool is_unlikely = false;
+	const struct node_attrs *attrs;
+	struct node_attrs buf;
 
-	class = xmlGetProp(node, (xmlChar *)"class");
-	id = xmlGetProp(node, (xmlChar *)"id");
+	attrs = get_node_attrs(cache, node, &buf);
+	return attrs->class_flags | attrs->id_flags;
+}
 
-	/* For the node to be unlikely, the class or the id must be on that list */
-	if (!regex_matches(&unlikely_re, class) && !regex_matches(&unlikely_re, id))
-		goto out;
-	/* Also, neither the class nor the id can be on the candidate list */
-	if (regex_matches(&candidate_re, class) || regex_matches(&candidate_re, id))
-		goto out;
-	is_unlikely = true;
+/**
+ * Considering only the node's class and id, is it unlikely to be readable?
+ * The cache may be NULL.
+ */
+bool node_has_unlikely_class_id(struct class_cache *cache, htmlNodePtr node)
+{
+	struct node_attrs buf;
 
-out:
-	xmlFree(class);
-	xmlFree(id);
-	return is_unlikely;
+	return has_unlikely_class_id(get_node_attrs(cache, node, &buf));
 }
 
 /**
  * fx: Get an elements class/id weight. Uses regular expressions to tell if
  * this element looks good or bad.
  */
-int get_class_weight(htmlNodePtr node)
+int get_class_weight(const struct rdr_context *ctx, htmlNodePtr node)
 {
-	xmlChar *class, *id;
+	const struct node_attrs *attrs;
+	struct node_attrs buf;
 	int weight = 0;
 
-	if (!(options.flags & OPT_WEIGHT_CLASSES))
+	if (!(ctx->flags & OPT_WEIGHT_CLASSES))
+		return 0;
+	if (node->type != XML_ELEMENT_NODE)
 		return 0;
 
-	class = xmlGetProp(node, (xmlChar *)"class");
-	if (class) {
-		if (regex_matches(&negative_re, class))
-			weight -= 25;
-		if (regex_matches(&positive_re, class))
-			weight += 25;
-	}
-
-	id = xmlGetProp(node, (xmlChar *)"id");
-	if (id) {
-		if (regex_matches(&negative_re, id))
-			weight -= 25;
-		if (regex_matches(&positive_re, id))
-			weight += 25;
-	}
+	attrs = get_node_attrs(ctx->class_cache, node, &buf);
+	if (attrs->class_flags & CLASS_NEGATIVE)
+		weight -= 25;
+	if (attrs->class_flags & CLASS_POSITIVE)
+		weight += 25;
+	if (attrs->id_flags & CLASS_NEGATIVE)
+		weight -= 25;
+	if (attrs->id_flags & CLASS_POSITIVE)
+		weight += 25;
 
-	xmlFree(class);
-	xmlFree(id);
 	return weight;
 }
 
@@ -0,0 +1,717 @@
+/*
+ * Serialization of the extracted article
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <libxml/HTMLtree.h>
+#include <libxml/tree.h>
+#include <libxml/xmlIO.h>
+#include "rdrview.h"
+
+/* Initial size for the buffer of a serialized article */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Write the markup for a node to an output buffer, in the same format as
+ * xmlShellPrintNode(), with a newline at the end. Unlike that function, this
+ * one is safe to use from several threads at once.
+ */
+void node_to_output_buffer(xmlOutputBufferPtr out, htmlNodePtr node)
+{
+	if (node->doc && node->doc->type == XML_HTML_DOCUMENT_NODE)
+		htmlNodeDumpOutput(out, node->doc, node, NULL /* encoding */);
+	else
+		xmlNodeDumpOutput(out, node->doc, node, 0 /* level */, 1 /* format */, NULL);
+	xmlOutputBufferWrite(out, 1, "\n");
+}
+
+/**
+ * Serialize a node to memory; return the null-terminated markup, which must be
+ * freed by the caller, and save its length to the len argument
+ */
+char *node_to_string(htmlNodePtr node, size_t *len)
+{
+	xmlBufferPtr buffer;
+	xmlOutputBufferPtr out;
+	xmlChar *str;
+
+	buffer = xmlBufferCreateSize(OUTPUT_BUFFER_SIZE);
+	if (!buffer)
+		fatal();
+	out = xmlOutputBufferCreateBuffer(buffer, NULL /* encoder */);
+	if (!out)
+		fatal();
+
+	node_to_output_buffer(out, node);
+	if (xmlOutputBufferClose(out) < 0)
+		fatal();
+
+	*len = xmlBufferLength(buffer);
+	str = xmlBufferDetach(buffer);
+	xmlBufferFree(buffer);
+	if (!str)
+		fatal();
+	return (char *)str;
+}
+
+/* State for rendering an article as plain text or markdown */
+struct text_renderer {
+	bool markdown;
+	char *buf; /* The text so far */
+	size_t len;
+	size_t size; /* Allocated for the buffer */
+	char *prefix; /* Start of each line, for quotes and list items */
+	size_t prefix_len;
+	size_t prefix_size;
+	char *opening; /* Markup for inline elements still with no text inside */
+	size_t opening_len;
+	size_t opening_size;
+	int breaks; /* Line breaks owed before the next text */
+	bool space; /* A space is owed before the next text */
+	bool line_start; /* The line has no text after the prefix and marker */
+	int pre_depth; /* Preformatted text, with whitespace respected */
+	int code_depth; /* Same, but it may be inline */
+	int link_depth;
+	int strong_depth; /* Nested emphasis of the same style gets no markup */
+	int em_depth;
+	bool heading; /* Line breaks are not allowed */
+	bool ordered; /* Is the innermost list numbered? */
+	int item; /* Number for the next item of that list */
+	int list_depth;
+	int cell; /* Cells so far in the current table row */
+};
+
+/* Elements that are never rendered */
+static const bool SKIPPED_TAGS[TAG_COUNT] = {
+	[TAG_SCRIPT] = true, [TAG_STYLE] = true, [TAG_NOSCRIPT] = true,
+	[TAG_TEMPLATE] = true, [TAG_TITLE] = true, [TAG_SVG] = true,
+	[TAG_MATH] = true, [TAG_SELECT] = true, [TAG_TEXTAREA] = true,
+};
+
+/* Elements separated from what's around by a blank line */
+static const bool PARAGRAPH_TAGS[TAG_COUNT] = {
+	[TAG_P] = true, [TAG_TABLE] = true, [TAG_FIGURE] = true, [TAG_DL] = true,
+	[TAG_ADDRESS] = true, [TAG_ASIDE] = true, [TAG_DETAILS] = true,
+};
+
+/* Elements that start a new line */
+static const bool BLOCK_TAGS[TAG_COUNT] = {
+	[TAG_DIV] = true, [TAG_SECTION] = true, [TAG_ARTICLE] = true,
+	[TAG_HEADER] = true, [TAG_FOOTER] = true, [TAG_MAIN] = true,
+	[TAG_NAV] = true, [TAG_FIGCAPTION] = true, [TAG_CAPTION] = true,
+	[TAG_SUMMARY] = true, [TAG_DT] = true, [TAG_DD] = true,
+	[TAG_FORM] = true, [TAG_FIELDSET] = true,
+};
+
+/* Markdown for each level of heading, from <h1> to <h6> */
+static const char * const HEADING_MARKUP[] = {
+	"# ", "## ", "### ", "#### ", "##### ", "###### ",
+};
+
+/* Characters that need a backslash anywhere in markdown text */
+#define MARKDOWN_SPECIAL "\\`*_[]<>&"
+
+/* Characters that need a backslash at the start of a markdown line */
+#define MARKDOWN_LINE_SPECIAL "#+-=|"
+
+/**
+ * Append bytes to a growable buffer, keeping it null-terminated
+ */
+static void append(char **buf, size_t *len, size_t *size, const char *str, size_t n)
+{
+	if (*len + n + 1 > *size) {
+		size_t new_size = *size ? 2 * *size : 256;
+		char *new;
+
+		while (*len + n + 1 > new_size)
+			new_size *= 2;
+		new = realloc(*buf, new_size);
+		if (!new)
+			fatal_errno();
+		*buf = new;
+		*size = new_size;
+	}
+	if (n)
+		memcpy(*buf + *len, str, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+}
+
+/**
+ * Append text to the rendered output, as is
+ */
+static void put(struct text_renderer *r, const char *str, size_t n)
+{
+	append(&r->buf, &r->len, &r->size, str, n);
+}
+
+/**
+ * Start a new line with the current prefix; for a blank line, don't include
+ * the trailing whitespace of the prefix
+ */
+static void put_newline(struct text_renderer *r, bool blank)
+{
+	size_t len = r->prefix_len;
+
+	put(r, "\n", 1);
+	while (blank && len && r->prefix[len - 1] == ' ')
+		--len;
+	put(r, r->prefix, len);
+}
+
+/**
+ * Ask for at least some line breaks before the next text
+ */
+static void add_breaks(struct text_renderer *r, int breaks)
+{
+	if (!r->line_start)
+		r->breaks = MAX(r->breaks, breaks);
+}
+
+/**
+ * Get ready to write some text: start the lines owed, separate the text from
+ * the previous word if needed, and open the pending inline elements
+ */
+static void begin_text(struct text_renderer *r)
+{
+	if (!r->len) {
+		put(r, r->prefix, r->prefix_len);
+	} else if (r->breaks) {
+		while (--r->breaks)
+			put_newline(r, true);
+		put_newline(r, false);
+	} else if (r->space && !r->line_start) {
+		put(r, " ", 1);
+	}
+	r->breaks = 0;
+	r->space = false;
+	r->line_start = false;
+
+	put(r, r->opening, r->opening_len);
+	r->opening_len = 0;
+}
+
+/**
+ * Add to the line prefix; return the old length, to restore it later
+ */
+static size_t push_prefix(struct text_renderer *r, const char *str)
+{
+	size_t old_len = r->prefix_len;
+
+	/* Any blank lines owed come before the new prefix applies */
+	while (r->len && r->breaks > 1) {
+		put_newline(r, true);
+		--r->breaks;
+	}
+	append(&r->prefix, &r->prefix_len, &r->prefix_size, str, strlen(str));
+	r->line_start = true; /* No blank line at the start of a quote */
+	return old_len;
+}
+
+/**
+ * Remember the opening markup for an inline element, to write it along with
+ * its first text
+ */
+static void open_inline(struct text_renderer *r, const char *markup)
+{
+	append(&r->opening, &r->opening_len, &r->opening_size, markup, strlen(markup));
+}
+
+/**
+ * Drop the opening markup for an inline element if it had no text inside;
+ * return true in that case, false if the element must be closed
+ */
+static bool cancel_inline(struct text_renderer *r, const char *markup)
+{
+	size_t n = strlen(markup);
+
+	if (r->opening_len < n || memcmp(r->opening + r->opening_len - n, markup, n) != 0)
+		return false;
+	r->opening_len -= n;
+	return true;
+}
+
+/**
+ * Write a single word of normal text, escaped for markdown if needed
+ */
+static void put_word(struct text_renderer *r, const char *word, size_t n)
+{
+	/* Markup at the start of a line is only special if it's the first thing */
+	bool line_head = (!r->len || r->breaks || r->line_start) && !r->opening_len;
+	size_t i;
+
+	begin_text(r);
+	if (!r->markdown || r->code_depth) {
+		put(r, word, n);
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (strchr(MARKDOWN_SPECIAL, word[i]))
+			put(r, "\\", 1);
+		else if (line_head && !i && strchr(MARKDOWN_LINE_SPECIAL, word[i]))
+			put(r, "\\", 1);
+		else if (line_head && i && i == strspn(word, "0123456789") && strchr(".)", word[i]))
+			put(r, "\\", 1); /* Don't let it look like a numbered item */
+		put(r, &word[i], 1);
+	}
+}
+
+/**
+ * Length of the whitespace at the start of a string, counting non-breaking
+ * spaces as well
+ */
+static size_t whitespace_len(const char *str)
+{
+	const char *start = str;
+
+	while (*str) {
+		if (isspace((unsigned char)*str))
+			++str;
+		else if (memcmp(str, "\xc2\xa0", 2) == 0)
+			str += 2;
+		else
+			break;
+	}
+	return str - start;
+}
+
+/**
+ * Render the content of a text node; the whitespace is collapsed, except for
+ * preformatted text where it's all respected
+ */
+static void render_text(struct text_renderer *r, const char *str)
+{
+	if (!str)
+		return;
+
+	while (*str) {
+		size_t n;
+
+		if (r->pre_depth || r->code_depth) {
+			if (*str == '\n') {
+				++r->breaks;
+				++str;
+				continue;
+			}
+			n = strcspn(str, "\n");
+			begin_text(r);
+			put(r, str, n);
+			str += n;
+			continue;
+		}
+
+		n = whitespace_len(str);
+		if (n) {
+			r->space = true;
+			str += n;
+			continue;
+		}
+		for (n = 0; str[n] && !whitespace_len(&str[n]); ++n)
+			;
+		put_word(r, str, n);
+		str += n;
+	}
+}
+
+/**
+ * Write the destination for a markdown link or image, with the characters
+ * that would end it escaped
+ */
+static void put_link_destination(struct text_renderer *r, const char *url)
+{
+	for (; *url; ++url) {
+		char escaped[4];
+
+		if (strchr(" ()<>", *url)) {
+			snprintf(escaped, sizeof(escaped), "%%%02X", (unsigned char)*url);
+			put(r, escaped, 3);
+		} else {
+			put(r, url, 1);
+		}
+	}
+}
+
+/**
+ * Render an image for markdown, using the alternative text as its label
+ */
+static void render_image(struct text_renderer *r, htmlNodePtr node)
+{
+	xmlChar *src = xmlGetProp(node, (xmlChar *)"src");
+	xmlChar *alt = xmlGetProp(node, (xmlChar *)"alt");
+	const char *pos;
+
+	if (!src)
+		goto out;
+
+	begin_text(r);
+	put(r, "![", 2);
+	for (pos = (char *)alt; pos && *pos; ++pos) {
+		if (strchr("\\[]", *pos))
+			put(r, "\\", 1);
+		put(r, isspace((unsigned char)*pos) ? " " : pos, 1);
+	}
+	put(r, "](", 2);
+	put_link_destination(r, (char *)src);
+	put(r, ")", 1);
+out:
+	xmlFree(src);
+	xmlFree(alt);
+}
+
+/**
+ * Render the start of a list item, with its marker
+ */
+static void start_list_item(struct text_renderer *r)
+{
+	char marker[16];
+	size_t i;
+
+	if (r->len)
+		r->breaks = MAX(r->breaks, 1); /* Even if the last item was empty */
+	begin_text(r);
+	if (r->ordered)
+		snprintf(marker, sizeof(marker), "%d. ", r->item++);
+	else
+		strcpy(marker, "- ");
+	put(r, marker, strlen(marker));
+	r->line_start = true;
+
+	/* The rest of the lines for the item are aligned after the marker */
+	for (i = 0; marker[i]; ++i)
+		marker[i] = ' ';
+	push_prefix(r, marker);
+}
+
+/**
+ * Render the markup for the start of an element; the caller takes care of
+ * restoring the line prefix and the list state afterwards
+ */
+static void start_element(struct text_renderer *r, htmlNodePtr node)
+{
+	enum tag_id tag = get_tag_id(node);
+	bool markup = r->markdown && !r->pre_depth && !r->code_depth;
+	xmlChar *attr;
+
+	if (node_has_tag_in(node, PARAGRAPH_TAGS)) {
+		add_breaks(r, 2);
+		return;
+	} else if (node_has_tag_in(node, BLOCK_TAGS)) {
+		add_breaks(r, 1);
+		return;
+	}
+
+	switch (tag) {
+	case TAG_BR:
+		if (r->pre_depth || r->code_depth) {
+			++r->breaks;
+		} else if (r->heading) {
+			r->space = true;
+		} else {
+			if (r->markdown && r->len && !r->breaks && !r->line_start)
+				put(r, "\\", 1); /* Hard line break */
+			r->breaks = MAX(r->breaks, 1);
+		}
+		break;
+	case TAG_HR:
+		add_breaks(r, 2);
+		begin_text(r);
+		put(r, "---", 3);
+		add_breaks(r, 2);
+		break;
+	case TAG_IMG:
+		if (r->markdown)
+			render_image(r, node);
+		break;
+	case TAG_H1: case TAG_H2: case TAG_H3:
+	case TAG_H4: case TAG_H5: case TAG_H6:
+		add_breaks(r, 2);
+		if (r->markdown)
+			open_inline(r, HEADING_MARKUP[tag - TAG_H1]);
+		r->heading = true;
+		break;
+	case TAG_PRE:
+		add_breaks(r, 2);
+		if (r->markdown) {
+			begin_text(r);
+			put(r, "```", 3);
+			r->breaks = 1;
+		}
+		++r->pre_depth;
+		break;
+	case TAG_CODE:
+		if (markup)
+			open_inline(r, "`");
+		++r->code_depth;
+		break;
+	case TAG_B: case TAG_STRONG:
+		if (markup && !r->strong_depth)
+			open_inline(r, "**");
+		++r->strong_depth;
+		break;
+	case TAG_I: case TAG_EM:
+		if (markup && !r->em_depth)
+			open_inline(r, "*");
+		++r->em_depth;
+		break;
+	case TAG_A:
+		if (markup && !r->link_depth)
+			open_inline(r, "[");
+		++r->link_depth;
+		break;
+	case TAG_BLOCKQUOTE:
+		add_breaks(r, 2);
+		push_prefix(r, "> ");
+		break;
+	case TAG_UL:
+	case TAG_OL:
+		r->ordered = tag == TAG_OL;
+		r->item = 1;
+		attr = xmlGetProp(node, (xmlChar *)"start");
+		if (attr && r->ordered)
+			r->item = atoi((char *)attr);
+		xmlFree(attr);
+		/* In markdown, a list that starts at another number can't interrupt a paragraph */
+		add_breaks(r, r->list_depth && (!r->markdown || r->item == 1) ? 1 : 2);
+		++r->list_depth;
+		break;
+	case TAG_LI:
+		start_list_item(r);
+		break;
+	case TAG_TR:
+		add_breaks(r, 1);
+		r->cell = 0;
+		break;
+	case TAG_TD:
+	case TAG_TH:
+		if (r->cell++) {
+			open_inline(r, "| ");
+			r->space = true;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Render the markup for the end of an element
+ */
+static void end_element(struct text_renderer *r, htmlNodePtr node)
+{
+	enum tag_id tag = get_tag_id(node);
+	bool markup;
+	xmlChar *href;
+
+	if (node_has_tag_in(node, PARAGRAPH_TAGS)) {
+		add_breaks(r, 2);
+		return;
+	} else if (node_has_tag_in(node, BLOCK_TAGS)) {
+		add_breaks(r, 1);
+		return;
+	}
+
+	switch (tag) {
+	case TAG_H1: case TAG_H2: case TAG_H3:
+	case TAG_H4: case TAG_H5: case TAG_H6:
+		if (r->markdown)
+			cancel_inline(r, HEADING_MARKUP[tag - TAG_H1]);
+		r->heading = false;
+		add_breaks(r, 2);
+		break;
+	case TAG_PRE:
+		--r->pre_depth;
+		/* The trailing newlines are dropped */
+		r->breaks = 0;
+		if (r->markdown) {
+			r->breaks = 1;
+			begin_text(r);
+			put(r, "```", 3);
+		}
+		add_breaks(r, 2);
+		break;
+	case TAG_CODE:
+		--r->code_depth;
+		if (r->markdown && !r->pre_depth && !r->code_depth && !cancel_inline(r, "`"))
+			put(r, "`", 1);
+		break;
+	case TAG_B: case TAG_STRONG:
+		--r->strong_depth;
+		markup = r->markdown && !r->pre_depth && !r->code_depth;
+		if (markup && !r->strong_depth && !cancel_inline(r, "**"))
+			put(r, "**", 2);
+		break;
+	case TAG_I: case TAG_EM:
+		--r->em_depth;
+		markup = r->markdown && !r->pre_depth && !r->code_depth;
+		if (markup && !r->em_depth && !cancel_inline(r, "*"))
+			put(r, "*", 1);
+		break;
+	case TAG_A:
+		--r->link_depth;
+		markup = r->markdown && !r->pre_depth && !r->code_depth;
+		if (!markup || r->link_depth || cancel_inline(r, "["))
+			break;
+		href = xmlGetProp(node, (xmlChar *)"href");
+		put(r, "](", 2);
+		if (href)
+			put_link_destination(r, (char *)href);
+		put(r, ")", 1);
+		xmlFree(href);
+		break;
+	case TAG_BLOCKQUOTE:
+		add_breaks(r, 2);
+		break;
+	case TAG_UL:
+	case TAG_OL:
+		--r->list_depth;
+		add_breaks(r, r->list_depth ? 1 : 2);
+		break;
+	case TAG_LI:
+		add_breaks(r, 1);
+		break;
+	case TAG_TR:
+		r->opening_len = 0; /* Separators for empty cells at the end */
+		add_breaks(r, 1);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Render a node and all of its descendants
+ */
+static void render_node(struct text_renderer *r, htmlNodePtr node)
+{
+	htmlNodePtr child;
+	size_t prefix_len = r->prefix_len;
+	bool ordered = r->ordered;
+	int item = r->item;
+	int cell = r->cell;
+
+	if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+		render_text(r, (char *)node->content);
+		return;
+	}
+	if (node->type != XML_ELEMENT_NODE || node_has_tag_in(node, SKIPPED_TAGS))
+		return;
+
+	start_element(r, node);
+	for (child = node->children; child; child = child->next)
+		render_node(r, child);
+	end_element(r, node);
+
+	/* Items and cells are counted for the parent, so only lists and rows reset */
+	r->prefix_len = prefix_len;
+	if (node_has_tag(node, TAG_UL, TAG_OL)) {
+		r->ordered = ordered;
+		r->item = item;
+	} else if (node_has_tag(node, TAG_TR)) {
+		r->cell = cell;
+	}
+}
+
+/**
+ * Render a node as plain text, or as markdown if requested. Return the
+ * null-terminated text, which must be freed by the caller, and save its
+ * length to the len argument.
+ */
+char *node_to_text(htmlNodePtr node, bool markdown, size_t *len)
+{
+	struct text_renderer r = {0};
+
+	r.markdown = markdown;
+	r.line_start = true;
+	render_node(&r, node);
+	put(&r, "\n", r.len ? 1 : 0);
+
+	free(r.prefix);
+	free(r.opening);
+	*len = r.len;
+	return r.buf;
+}
+
+/**
+ * Return the length of the utf8 sequence at the start of the string, or zero
+ * if it's not valid: overlong, a surrogate, out of range or cut short.
+ */
+static size_t utf8_sequence_len(const unsigned char *str)
+{
+	unsigned long cp;
+	size_t len, i;
+
+	if (str[0] < 0x80)
+		return 1;
+	if (str[0] >= 0xc2 && str[0] <= 0xdf) {
+		len = 2;
+		cp = str[0] & 0x1f;
+	} else if ((str[0] & 0xf0) == 0xe0) {
+		len = 3;
+		cp = str[0] & 0x0f;
+	} else if (str[0] >= 0xf0 && str[0] <= 0xf4) {
+		len = 4;
+		cp = str[0] & 0x07;
+	} else {
+		return 0;
+	}
+	for (i = 1; i < len; ++i) {
+		if ((str[i] & 0xc0) != 0x80) /* Also stops at the null termination */
+			return 0;
+		cp = (cp << 6) | (str[i] & 0x3f);
+	}
+	if ((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+		return 0;
+	if (cp >= 0xd800 && cp <= 0xdfff)
+		return 0;
+	return len;
+}
+
+/**
+ * Print a string to the stream as a JSON value, or null if it's NULL. JSON
+ * must be valid utf8, so any bytes that are not get replaced with U+FFFD.
+ */
+void print_json_string(FILE *out, const char *str)
+{
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+
+	putc('"', out);
+	while (*str) {
+		unsigned char c = *str;
+		size_t len = utf8_sequence_len((const unsigned char *)str);
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", out);
+		else if (c == '\t')
+			fputs("\\t", out);
+		else if (c < 0x20 || c == 0x7f)
+			fprintf(out, "\\u%04x", c);
+		else if (!len)
+			fputs("\\ufffd", out);
+		else
+			fwrite(str, 1, len, out);
+		str += len ? len : 1;
+	}
+	putc('"', out);
+}
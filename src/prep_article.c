@@ -46,7 +46,7 @@ static unsigned int attr_num(htmlNodePtr node, const char *attrname)
  */
 static bool is_table_caption(htmlNodePtr node)
 {
-	return node_has_tag(node, "caption") && node->children;
+	return node_has_tag(node, TAG_CAPTION) && node->children;
 }
 
 /**
@@ -54,11 +54,12 @@ static bool is_table_caption(htmlNodePtr node)
  */
 static bool is_table_data(htmlNodePtr node)
 {
-	static const char * const tags[] = {
-		"col", "colgroup", "tfoot", "thead", "th"
+	static const bool tags[TAG_COUNT] = {
+		[TAG_COL] = true, [TAG_COLGROUP] = true, [TAG_TFOOT] = true,
+		[TAG_THEAD] = true, [TAG_TH] = true,
 	};
 
-	return node_has_tag_array(node, ARRAY_SIZE(tags), tags);
+	return node_has_tag_in(node, tags);
 }
 
 /**
@@ -66,20 +67,7 @@ static bool is_table_data(htmlNodePtr node)
  */
 static bool is_table(htmlNodePtr node)
 {
-	return node_has_tag(node, "table");
-}
-
-/**
- * Count the number of times a given character appears in a node's content
- */
-static int content_char_count(htmlNodePtr node, char c)
-{
-	xmlChar *text = xmlNodeGetContent(node);
-	int count;
-
-	count = char_count((char *)text, c);
-	xmlFree(text);
-	return count;
+	return node_has_tag(node, TAG_TABLE);
 }
 
 static const char * const PRESENTATIONAL_ATTRS[] = {
@@ -87,8 +75,9 @@ static const char * const PRESENTATIONAL_ATTRS[] = {
 	"frame", "hspace", "rules", "style", "valign", "vspace",
 };
 
-static const char * const DEPRECATED_SIZE_ELEMS[] = {
-	"table", "th", "td", "hr", "pre",
+static const bool DEPRECATED_SIZE_ELEMS[TAG_COUNT] = {
+	[TAG_TABLE] = true, [TAG_TH] = true, [TAG_TD] = true, [TAG_HR] = true,
+	[TAG_PRE] = true,
 };
 
 /**
@@ -107,7 +96,7 @@ static void clean_styles(htmlNodePtr node)
 	while (curr != last) {
 		int i, len;
 
-		if (curr->type != XML_ELEMENT_NODE || node_has_tag(curr, "svg")) {
+		if (curr->type != XML_ELEMENT_NODE || node_has_tag(curr, TAG_SVG)) {
 			curr = skip_node_descendants(curr);
 			continue;
 		}
@@ -116,8 +105,7 @@ static void clean_styles(htmlNodePtr node)
 		for (i = 0; i < len; ++i)
 			xmlRemoveProp(xmlHasProp(curr, (xmlChar *)PRESENTATIONAL_ATTRS[i]));
 
-		len = ARRAY_SIZE(DEPRECATED_SIZE_ELEMS);
-		if (node_has_tag_array(curr, len, DEPRECATED_SIZE_ELEMS)) {
+		if (node_has_tag_in(curr, DEPRECATED_SIZE_ELEMS)) {
 			xmlRemoveProp(xmlHasProp(curr, (xmlChar *)"width"));
 			xmlRemoveProp(xmlHasProp(curr, (xmlChar *)"height"));
 		}
@@ -146,7 +134,7 @@ static struct table_size get_table_size(htmlNodePtr table)
 		unsigned int cols_in_row = 0;
 		htmlNodePtr child;
 
-		if (!node_has_tag(curr, "tr")) {
+		if (!node_has_tag(curr, TAG_TR)) {
 			curr = following_node(curr);
 			continue;
 		}
@@ -157,7 +145,7 @@ static struct table_size get_table_size(htmlNodePtr table)
 		for (child = curr->children; child; child = child->next) {
 			unsigned int colspan;
 
-			if (!node_has_tag(child, "td"))
+			if (!node_has_tag(child, TAG_TD))
 				continue;
 			colspan = attr_num(curr, "colspan");
 			cols_in_row += colspan ? colspan : 1;
@@ -179,7 +167,7 @@ static htmlNodePtr mark_if_data_table(htmlNodePtr node)
 {
 	struct table_size ts;
 
-	if (node->type != XML_ELEMENT_NODE || !node_has_tag(node, "table"))
+	if (node->type != XML_ELEMENT_NODE || !node_has_tag(node, TAG_TABLE))
 		return node;
 
 	/* If not a data table, do nothing: the flag is unset by default */
@@ -294,15 +282,15 @@ static bool is_image_lazy(htmlNodePtr img)
  */
 static bool has_either_tag(htmlNodePtr node, const void *data)
 {
-	return node_has_tag_array(node, 2, (const char **)data);
+	return node_has_tag_array(node, 2, data);
 }
 
 /**
  * Does this node have a descendant with one of the two given tags?
  */
-static bool has_descendant_tag(htmlNodePtr node, const char *t1, const char *t2)
+static bool has_descendant_tag(htmlNodePtr node, enum tag_id t1, enum tag_id t2)
 {
-	const char *tags[] = {t1, t2};
+	const enum tag_id tags[] = {t1, t2};
 
 	return such_desc_exists(node, has_either_tag, tags);
 }
@@ -335,9 +323,9 @@ static void fix_lazy_image(htmlNodePtr img)
 			continue;
 
 		/* fx: if this is an img or picture, set the attribute directly */
-		if (node_has_tag(img, "img", "picture")) {
+		if (node_has_tag(img, TAG_IMG, TAG_PICTURE)) {
 			xmlSetProp(img, (xmlChar *)dest, value);
-		} else if (!has_descendant_tag(img, "img", "picture")) {
+		} else if (!has_descendant_tag(img, TAG_IMG, TAG_PICTURE)) {
 			htmlNodePtr new;
 
 			/*
@@ -346,8 +334,9 @@ static void fix_lazy_image(htmlNodePtr img)
 			 * nytimes-3 testcase for an example
 			 */
 			new = xmlNewNode(NULL, (xmlChar *)"img");
-			if (!new || !xmlAddChild(img, new))
+			if (!new)
 				fatal();
+			append_child(img, new);
 			xmlSetProp(new, (xmlChar *)dest, value);
 		}
 	}
@@ -360,7 +349,7 @@ static void fix_lazy_image(htmlNodePtr img)
  */
 static htmlNodePtr fix_if_lazy_image(htmlNodePtr node)
 {
-	if (node_has_tag(node, "img", "picture", "figure") && is_image_lazy(node))
+	if (node_has_tag(node, TAG_IMG, TAG_PICTURE, TAG_FIGURE) && is_image_lazy(node))
 		fix_lazy_image(node);
 	return node;
 }
@@ -370,33 +359,17 @@ static htmlNodePtr fix_if_lazy_image(htmlNodePtr node)
  */
 static bool inside_data_table(htmlNodePtr node)
 {
-	htmlNodePtr table_ancestor = has_ancestor_tag(node, "table");
+	htmlNodePtr table_ancestor = has_ancestor_tag(node, TAG_TABLE);
 
 	return table_ancestor && is_data_table(table_ancestor);
 }
 
-/**
- * Wrapper to use node_has_tag() as a condition_fn2 (for one tag only)
- */
-static bool has_this_tag(htmlNodePtr node, const void *data)
-{
-	return node_has_tag(node, data);
-}
-
-/**
- * Count the number of descendants with a given tag
- */
-static int tag_count(htmlNodePtr node, const char *tag)
-{
-	return count_such_descs(node, has_this_tag, tag);
-}
-
 /**
  * Is this node an embed?
  */
 static inline bool is_embed(htmlNodePtr node)
 {
-	return node_has_tag(node, "object", "embed", "iframe");
+	return node_has_tag(node, TAG_OBJECT, TAG_EMBED, TAG_IFRAME);
 }
 
 /**
@@ -426,7 +399,7 @@ static bool is_embed_with_video(htmlNodePtr node)
 		return true;
 
 	/* fx: For embed with <object> tag, check inner HTML as well */
-	if (!node_has_tag(node, "object"))
+	if (!node_has_tag(node, TAG_OBJECT))
 		return false;
 
 	buffer = xmlBufferCreate();
@@ -439,43 +412,70 @@ static bool is_embed_with_video(htmlNodePtr node)
 }
 
 /**
- * Go through all embeds inside a node to check if they can be removed. If the
- * answer is yes, return the embed count as well.
+ * Get the profile for an element node. It's kept in the info struct, and built
+ * from the profiles of the children, so that nested elements share the work.
  */
-static bool check_embeds_for_removal(htmlNodePtr node, int *count)
+static const struct node_profile *get_node_profile(htmlNodePtr node)
 {
-	htmlNodePtr first, last, curr;
-	int tmpcount = 0;
+	struct node_info *ni = allocate_node_info(node);
+	struct node_profile *prof = &ni->profile;
+	htmlNodePtr child;
 
-	first = following_node(node);
-	last = skip_node_descendants(node);
-	for (curr = first; curr != last; curr = following_node(curr)) {
-		if (is_embed_with_video(curr))
-			return false;
-		tmpcount += is_embed(curr) ? 1 : 0;
+	if (ni->flags & NODE_PROFILE)
+		return prof;
+
+	memset(prof, 0, sizeof(*prof));
+	for (child = node->children; child; child = child->next) {
+		const struct node_profile *child_prof;
+
+		if (child->type != XML_ELEMENT_NODE)
+			continue;
+
+		child_prof = get_node_profile(child);
+		prof->p_count += child_prof->p_count;
+		prof->img_count += child_prof->img_count;
+		prof->li_count += child_prof->li_count;
+		prof->input_count += child_prof->input_count;
+		prof->embed_count += child_prof->embed_count;
+		prof->has_video |= child_prof->has_video;
+
+		if (node_has_tag(child, TAG_P))
+			++prof->p_count;
+		else if (node_has_tag(child, TAG_IMG))
+			++prof->img_count;
+		else if (node_has_tag(child, TAG_LI))
+			++prof->li_count;
+		else if (node_has_tag(child, TAG_INPUT))
+			++prof->input_count;
+		else if (is_embed(child))
+			++prof->embed_count;
+		if (is_embed_with_video(child))
+			prof->has_video = true;
 	}
-	*count = tmpcount;
-	return true;
+
+	ni->flags |= NODE_PROFILE;
+	return prof;
 }
 
 /**
  * Check if the node looks "fishy", for the sake of clean_conditionally()
  */
-static bool node_looks_fishy(htmlNodePtr node)
+static bool node_looks_fishy(const struct rdr_context *ctx, htmlNodePtr node)
 {
+	const struct node_profile *prof;
 	int content_length, weight, p_count, img_count, li_count, input_count;
-	int embed_count = 0;
+	int embed_count;
 	double link_density;
 	bool is_list;
 
 	if (inside_data_table(node))
 		return false;
 
-	weight = get_class_weight(node);
+	weight = get_class_weight(ctx, node);
 	if (weight < 0)
 		return true;
 
-	if (content_char_count(node, ',') >= 10)
+	if (text_comma_count(node) >= 10)
 		return false;
 
 	/*
@@ -483,19 +483,21 @@ static bool node_looks_fishy(htmlNodePtr node)
 	 * elements is more than paragraphs or other ominous signs, remove the
 	 * element.
 	 */
-	p_count = tag_count(node, "p");
-	img_count = tag_count(node, "img");
-	li_count = tag_count(node, "li") - 100; /* No idea what this is about */
-	input_count = tag_count(node, "input");
+	prof = get_node_profile(node);
+	p_count = prof->p_count;
+	img_count = prof->img_count;
+	li_count = prof->li_count - 100; /* No idea what this is about */
+	input_count = prof->input_count;
 
-	if (!check_embeds_for_removal(node, &embed_count))
+	if (prof->has_video)
 		return false;
+	embed_count = prof->embed_count;
 	link_density = get_link_density(node);
 	content_length = text_normalized_content_length(node);
 
-	is_list = node_has_tag(node, "ul", "ol");
+	is_list = node_has_tag(node, TAG_UL, TAG_OL);
 
-	if (!has_ancestor_tag(node, "figure")) {
+	if (!has_ancestor_tag(node, TAG_FIGURE)) {
 		if (img_count > 1 && p_count < img_count / 2.0)
 			return true;
 		if (!is_list && content_length < 25 && (!img_count || img_count > 2))
@@ -514,12 +516,20 @@ static bool node_looks_fishy(htmlNodePtr node)
 	return false;
 }
 
+/* Arguments for is_fishy_with_tag() */
+struct fishy_check {
+	const struct rdr_context *ctx;
+	enum tag_id tag;
+};
+
 /**
- * Is this node a fishy-looking element with the given tag?
+ * Is this node a fishy-looking element with the tag from the fishy_check?
  */
-static bool is_fishy_with_tag(htmlNodePtr node, const void *tag)
+static bool is_fishy_with_tag(htmlNodePtr node, const void *data)
 {
-	return node_has_tag(node, tag) && node_looks_fishy(node);
+	const struct fishy_check *check = data;
+
+	return node_has_tag(node, check->tag) && node_looks_fishy(check->ctx, node);
 }
 
 /**
@@ -527,14 +537,17 @@ static bool is_fishy_with_tag(htmlNodePtr node, const void *tag)
  * is an algorithm based on content length, classnames, link density, number
  * of images & embeds, etc.
  */
-static void clean_conditionally(htmlNodePtr article, const char *tag)
+static void clean_conditionally(const struct rdr_context *ctx, htmlNodePtr article,
+				enum tag_id tag)
 {
+	struct fishy_check check = {.ctx = ctx, .tag = tag};
+
 	/*
 	 * Traversal direction is important here, because deleting fishy children
 	 * may affect the parent's fishiness.
 	 */
-	if (options.flags & OPT_CLEAN_CONDITIONALLY)
-		bw_remove_descendants_if(article, is_fishy_with_tag, tag);
+	if (ctx->flags & OPT_CLEAN_CONDITIONALLY)
+		bw_remove_descendants_if(article, is_fishy_with_tag, &check);
 }
 
 /**
@@ -542,16 +555,16 @@ static void clean_conditionally(htmlNodePtr article, const char *tag)
  */
 static bool has_tag_not_video_embed(htmlNodePtr node, const void *tag)
 {
-	return node_has_tag(node, tag) && !is_embed_with_video(node);
+	return node_has_tag(node, *(const enum tag_id *)tag) && !is_embed_with_video(node);
 }
 
 /**
  * fx: Clean a node of all elements of type "tag". (Unless it's a youtube/vimeo
  * video. People love movies.)
  */
-static void clean_all(htmlNodePtr article, const char *tag)
+static void clean_all(htmlNodePtr article, enum tag_id tag)
 {
-	bw_remove_descendants_if(article, has_tag_not_video_embed, tag);
+	bw_remove_descendants_if(article, has_tag_not_video_embed, &tag);
 }
 
 /**
@@ -590,7 +603,7 @@ static htmlNodePtr has_single_h2(htmlNodePtr article)
 	first = following_node(article);
 	last = skip_node_descendants(article);
 	for (curr = first; curr != last; curr = following_node(curr)) {
-		if (node_has_tag(curr, "h2")) {
+		if (node_has_tag(curr, TAG_H2)) {
 			if (h2)
 				return NULL;
 			h2 = curr;
@@ -604,15 +617,16 @@ static htmlNodePtr has_single_h2(htmlNodePtr article)
  * article title, they are probably using it as a header and not a subheader,
  * so remove it since we already extract the title separately.
  */
-static void remove_title(htmlNodePtr article)
+static void remove_title(const struct rdr_context *ctx, htmlNodePtr article)
 {
+	const char *title = ctx->metadata.title;
 	htmlNodePtr h2;
 	char *h2_text;
 	double title_len, h2_len, diff;
 	bool is_match = false;
 
 	/* Do nothing if we have no title, to avoid division by zero */
-	if (!metadata.title || !*metadata.title)
+	if (!title || !*title)
 		return;
 
 	h2 = has_single_h2(article);
@@ -622,20 +636,20 @@ static void remove_title(htmlNodePtr article)
 	if (!h2_text) /* This should never happen, ignore it */
 		return;
 
-	title_len = strlen(metadata.title);
+	title_len = strlen(title);
 	h2_len = strlen(h2_text);
 	diff = (h2_len - title_len) / title_len;
 
 	if (fabs(diff) < 0.5) {
 		if (diff > 0)
-			is_match = strstr(h2_text, metadata.title);
+			is_match = strstr(h2_text, title);
 		else
-			is_match = strstr(metadata.title, h2_text);
+			is_match = strstr(title, h2_text);
 	}
 
 	xmlFree((xmlChar *)h2_text);
 	if (is_match) {
-		xmlUnlinkNode(h2);
+		unlink_node(h2);
 		free_node(h2);
 	}
 }
@@ -644,9 +658,9 @@ static void remove_title(htmlNodePtr article)
  * Is this node a spurious header?
  * fx: Checks things like classnames and link density.
  */
-static bool is_spurious_header(htmlNodePtr node)
+static bool is_spurious_header(htmlNodePtr node, const void *ctx)
 {
-	return node_has_tag(node, "h1", "h2") && get_class_weight(node) < 0;
+	return node_has_tag(node, TAG_H1, TAG_H2) && get_class_weight(ctx, node) < 0;
 }
 
 /**
@@ -654,15 +668,15 @@ static bool is_spurious_header(htmlNodePtr node)
  */
 static bool is_extra_paragraph(htmlNodePtr node)
 {
-	if (!node_has_tag(node, "p"))
+	if (!node_has_tag(node, TAG_P))
 		return false;
-	if (has_descendant_tag(node, "img", "embed"))
+	if (has_descendant_tag(node, TAG_IMG, TAG_EMBED))
 		return false;
 	/*
 	 * fx: At this point, nasty iframes have been removed, only remain embedded
 	 * video ones.
 	 */
-	if (has_descendant_tag(node, "object", "iframe"))
+	if (has_descendant_tag(node, TAG_OBJECT, TAG_IFRAME))
 		return false;
 	return text_content_length(node) == 0;
 }
@@ -672,7 +686,7 @@ static bool is_extra_paragraph(htmlNodePtr node)
  */
 static bool is_line_break_before_paragraph(htmlNodePtr node)
 {
-	return node_has_tag(node, "br") && node_has_tag(next_element(node), "p");
+	return node_has_tag(node, TAG_BR) && node_has_tag(next_element(node), TAG_P);
 }
 
 /**
@@ -683,25 +697,25 @@ static htmlNodePtr unwrap_if_single_cell_table(htmlNodePtr node)
 {
 	htmlNodePtr tbody, row, cell;
 
-	if (!node_has_tag(node, "table"))
+	if (!node_has_tag(node, TAG_TABLE))
 		return node;
 
-	tbody = has_single_tag_inside(node, "tbody");
+	tbody = has_single_tag_inside(node, TAG_TBODY);
 	if (!tbody)
 		tbody = node;
-	row = has_single_tag_inside(tbody, "tr");
+	row = has_single_tag_inside(tbody, TAG_TR);
 	if (!row)
 		return node;
-	cell = has_single_tag_inside(row, "td");
+	cell = has_single_tag_inside(row, TAG_TD);
 	if (!cell)
 		return node;
 
 	if (forall_descendants(cell, is_phrasing_content))
-		xmlNodeSetName(cell, (xmlChar *)"p");
+		set_node_name(cell, "p");
 	else
-		xmlNodeSetName(cell, (xmlChar *)"div");
+		set_node_name(cell, "div");
 
-	xmlReplaceNode(node, cell);
+	replace_node(node, cell);
 	free_node(node);
 	return cell;
 }
@@ -710,7 +724,7 @@ static htmlNodePtr unwrap_if_single_cell_table(htmlNodePtr node)
  * fx: Prepare the article node for display. Clean out any inline styles,
  * iframes, forms, strip extraneous <p> tags, etc.
  */
-void prep_article(htmlNodePtr article)
+void prep_article(const struct rdr_context *ctx, htmlNodePtr article)
 {
 	clean_styles(article);
 
@@ -724,29 +738,29 @@ void prep_article(htmlNodePtr article)
 	change_descendants(article, fix_if_lazy_image);
 
 	/* fx: Clean out junk from the article content */
-	clean_conditionally(article, "form");
-	clean_conditionally(article, "fieldset");
-	clean_all(article, "object");
-	clean_all(article, "embed");
-	clean_all(article, "h1");
-	clean_all(article, "footer");
-	clean_all(article, "link");
-	clean_all(article, "aside");
+	clean_conditionally(ctx, article, TAG_FORM);
+	clean_conditionally(ctx, article, TAG_FIELDSET);
+	clean_all(article, TAG_OBJECT);
+	clean_all(article, TAG_EMBED);
+	clean_all(article, TAG_H1);
+	clean_all(article, TAG_FOOTER);
+	clean_all(article, TAG_LINK);
+	clean_all(article, TAG_ASIDE);
 	remove_descendants_if(article, is_small_share_node);
-	remove_title(article);
-	clean_all(article, "iframe");
-	clean_all(article, "input");
-	clean_all(article, "textarea");
-	clean_all(article, "select");
-	clean_all(article, "button");
-	remove_descendants_if(article, is_spurious_header);
+	remove_title(ctx, article);
+	clean_all(article, TAG_IFRAME);
+	clean_all(article, TAG_INPUT);
+	clean_all(article, TAG_TEXTAREA);
+	clean_all(article, TAG_SELECT);
+	clean_all(article, TAG_BUTTON);
+	remove_descendants_if_with_data(article, is_spurious_header, ctx);
 	/*
 	 * fx: Do these last as the previous stuff may have removed junk that will
 	 * affect these.
 	 */
-	clean_conditionally(article, "table");
-	clean_conditionally(article, "ul");
-	clean_conditionally(article, "div");
+	clean_conditionally(ctx, article, TAG_TABLE);
+	clean_conditionally(ctx, article, TAG_UL);
+	clean_conditionally(ctx, article, TAG_DIV);
 
 	/* fx: Remove extra paragraphs */
 	remove_descendants_if(article, is_extra_paragraph);
@@ -22,6 +22,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE /* For memfd_create() */
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,66 +30,121 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <signal.h>
 #include <iconv.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <curl/curl.h>
 #include <libxml/tree.h>
 #include <libxml/HTMLparser.h>
+#include <libxml/parserInternals.h>
 #include <libxml/encoding.h>
 #include <libxml/uri.h>
 #include "version.h"
 #include "rdrview.h"
 
-/* Program name */
-static char *progname;
-
 /*
  * Full path name for the temporary files; these must be static so that we
  * can do cleanup from the signal handler on abnormal process termination.
  */
 static char *tmpdir;
-static char *inputfile;
 static char *outputfile;
 
 #define MAX_ENC_LEN 31 /* Arbitrary length limit for character encodings */
-struct options options = {0};
 
-/* Use STR() for macro stringification */
-#define STR_INNER(X) #X
-#define STR(X) STR_INNER(X)
+/* A sandboxed subprocess that extracts the content of many batch documents */
+struct worker {
+	pid_t pid; /* Zero if not started yet */
+	int sock; /* Socket to send jobs and receive exit statuses */
+	char *inputfile;
+	char *outputfile;
+	FILE *input_fp;
+	FILE *output_fp;
+	struct job *job; /* Current job, or NULL if idle */
+	struct timespec start; /* When the current job was sent */
+};
+static struct worker *workers; /* Array of options.workers structs */
+
+/* Stages of a batch job before it gets to a worker */
+enum job_state {
+	JOB_QUEUED, /* Waits for its turn to download the webpage */
+	JOB_FETCHING, /* Downloading the webpage */
+	JOB_READY, /* Waits for an idle worker */
+	JOB_DISPATCHED, /* Sent to a worker, or already done */
+};
+
+/* A document in the batch, along with its results once they are ready */
+struct job {
+	char *input; /* The path or url as provided by the user */
+	char *url; /* Set only after an html redirect */
+	enum job_state state;
+	struct fetch *fetch; /* Download in progress, or NULL */
+	char *body; /* Webpage downloaded ahead of time */
+	size_t body_len;
+	size_t body_size; /* Size of the allocation for the body */
+	bool prefetched; /* The body is ready to be sent, even if empty */
+	bool too_big; /* The download went over --max-size, so it was stopped */
+	char *output;
+	size_t output_len;
+	int status;
+	bool done;
+	struct rdr_stats stats; /* Only used with --stats */
+	struct result_key key; /* Only valid with a result cache */
+	double start; /* Monotonic time when the job went to a worker, for the deadline */
+};
 
-/**
- * Print the location of the issue and exit with an error code
+/* Seconds before a worker gets killed for taking too long with a document */
+#define WORKER_TIMEOUT 60
+
+/*
+ * With a deadline, the subprocesses get killed at this multiple of it instead,
+ * plus one second so that tiny deadlines still give them a chance
  */
-__attribute__((noreturn)) void fatal_with_loc(const char *fn, int line)
-{
-	char *FORMAT = "%s: fatal error in function %s(), line %d\n";
+#define DEADLINE_KILL_FACTOR 2
 
-	fprintf(stderr, FORMAT, progname, fn, line);
-	exit(1);
-}
+/* Default limits for the concurrent downloads in batch mode */
+#define DEFAULT_FETCHES 16
+#define DEFAULT_FETCHES_PER_HOST 4
 
-/**
- * Print a message and exit with an error code
+/* List of inputs for batch mode, or NULL if they came as arguments */
+static FILE *batch_list;
+
+/*
+ * Instrumentation for the current document, or NULL without --stats. In batch
+ * mode the parent uses it to add up the stats for all documents.
  */
-__attribute__((noreturn)) void fatal_msg(char *message)
-{
-	fprintf(stderr, "%s: %s\n", progname, message);
-	exit(1);
-}
+static struct rdr_stats *stats;
+
+/* Results for the documents already seen in the batch, or NULL */
+static struct result_cache *results;
+
+/* Downloads for batch mode, run ahead of the workers; NULL if disabled */
+static CURLM *multi;
+static int active_fetches;
+
+/*
+ * Monotonic time to stop starting new extraction attempts, or zero. It's set
+ * before the download, so the whole request counts against the deadline.
+ */
+static double deadline;
+
+struct options options = {0};
 
 /**
- * Print the message for the current errno value and exit with an error code
+ * Print a message for an error that only affects the current input document
  */
-__attribute__((noreturn)) void fatal_errno(void)
+static void error_msg(char *message)
 {
-	perror(progname);
-	exit(1);
+	fprintf(stderr, "%s: %s\n", progname, message);
 }
 
 /**
@@ -96,9 +152,11 @@ __attribute__((noreturn)) void fatal_errno(void)
  */
 static void usage(void)
 {
-	char *args = "[-v] [-u base-url] [-E encoding] [-A user-agent] [-T template] [-P] [-c|-H|-M|-B browser] [path|url]";
+	char *args = "[-v] [-u base-url] [-E encoding] [-A user-agent] [-T template] [-P] [-c|-H|-M|--fast-meta|--text|--markdown|-B browser] [--json] [--stats] [--cache-dir=dir] [--max-size=MiB] [--max-nodes=count] [--deadline=seconds] [--parallel-attempts] [--max-memory=MiB] [path|url]";
+	char *batch_args = "-b[listfile] [-v] [-u base-url] [-E encoding] [-A user-agent] [-T template] [-P] [--workers=count] [--result-cache=MiB] [--fetches=count] [--fetches-per-host=count] [--stats] [--cache-dir=dir] [--max-size=MiB] [--max-nodes=count] [--deadline=seconds] [--parallel-attempts] [--max-memory=MiB] -c|-H|-M|--fast-meta|--text|--markdown|--json [path|url]...";
 
 	fprintf(stderr, "usage: %s %s\n", progname, args);
+	fprintf(stderr, "       %s %s\n", progname, batch_args);
 	exit(1);
 }
 
@@ -151,42 +209,78 @@ static char *get_temp_filepath(const char *filename)
 	return mkstring("%s/%s", tmpdir, filename);
 }
 
-#if 0
 /**
- * Get the encoding for the html document from the headers of the HTTP response
- *
- * TODO: this is commented out for now because it's dangerous and outside the
- * sandbox. It doesn't matter much because most websites provide the encoding
- * inside the html as well.
+ * Create a temporary file and return its stream. The path is only reserved if
+ * requested, or if the system can't provide an anonymous file in memory, as
+ * TMPDIR may be on slow storage; otherwise it's set to NULL.
  */
-static void set_encoding_from_response(CURL *curl)
+static FILE *new_temp_file(const char *filename, char **path, bool need_path)
 {
-	const char *type = NULL;
-	const char *charset = NULL;
-
-	/* Just ignore failures, we can guess the encoding or get it elsewhere */
-	if (curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &type) || !type)
-		return;
-	charset = strcasestr(type, "charset="); /* TODO: whitespace? */
-	if (!charset)
-		return;
-
-	if (!options.encoding) {
-		options.encoding = malloc(MAX_ENC_LEN + 1);
-		if (!options.encoding)
-			fatal();
-		*options.encoding = '\0';
+	FILE *file;
+
+#ifdef MFD_CLOEXEC
+	if (!need_path) {
+		int fd = memfd_create(filename, MFD_CLOEXEC);
+
+		if (fd >= 0) {
+			file = fdopen(fd, "w+");
+			if (!file)
+				fatal_errno();
+			*path = NULL;
+			return file;
+		}
+		if (errno != ENOSYS) /* Kernels before 3.17 don't have it */
+			fatal_errno();
 	}
+#else
+	(void)need_path;
+#endif
 
-	/* Even if the user requested an encoding, obey the HTTP headers */
-	sscanf(charset, "%*[^=]=%" STR(MAX_ENC_LEN) "s", options.encoding);
+	*path = get_temp_filepath(filename);
+	file = fopen(*path, "w+");
+	if (!file)
+		fatal_msg("failed to create the temporary files");
+	return file;
 }
-#else
-static void set_encoding_from_response(CURL *curl)
+
+/**
+ * Is this the name of a character encoding that we can handle?
+ */
+static bool is_known_encoding(const char *enc)
 {
-	(void)curl;
+	if (xmlParseCharEncoding(enc) > 0) /* Known to libxml2 */
+		return true;
+	if (strcasecmp(enc, "gb2312") == 0) /* Prepared for iconv */
+		return true;
+	return false;
+}
+
+/**
+ * Copy the charset parameter from the content of a meta tag to a buffer of
+ * size MAX_ENC_LEN + 1. Be strict: the copy is left empty unless the name is
+ * short and made of the usual characters, and it's an encoding that we know.
+ */
+static void parse_charset(const char *type, char *charset)
+{
+	const char *name;
+	size_t len = 0;
+
+	*charset = '\0';
+	name = strcasestr(type, "charset=");
+	if (!name)
+		return;
+	name += strlen("charset=");
+	if (*name == '"')
+		++name;
+	while (isalnum((unsigned char)name[len]) || (name[len] && strchr("-_.:", name[len])))
+		++len;
+	if (!len || len > MAX_ENC_LEN)
+		return;
+	memcpy(charset, name, len);
+	charset[len] = '\0';
+	if (!is_known_encoding(charset))
+		*charset = '\0';
 }
-#endif
 
 /**
  * Copy the content of one file into another
@@ -213,6 +307,16 @@ static void copy_file(FILE *dest, FILE *src)
 	free(buf);
 }
 
+/**
+ * Throw away the contents of a stream that was only partially written
+ */
+static void clear_stream(FILE *file)
+{
+	if (fflush(file) || ftruncate(fileno(file), 0))
+		fatal_errno();
+	rewind(file);
+}
+
 /**
  * Save stdin to a temporary file
  */
@@ -221,25 +325,264 @@ static void stdin_to_file(FILE *file)
 	copy_file(file, stdin);
 }
 
+/* Destination for the body of the webpage, when it also goes to the cache */
+struct fetch_dest {
+	curl_write_callback write_fn; /* NULL to save it to the stream instead */
+	void *data;
+	struct cache_entry *cache;
+	size_t delivered; /* Bytes handed over to the destination */
+};
+
+/**
+ * Hand a chunk of the webpage over to the destination; return the number of
+ * bytes it took, as a libcurl write callback would.
+ */
+static size_t deliver_chunk(struct fetch_dest *dest, char *chunk, size_t len)
+{
+	size_t ret;
+
+	if (dest->write_fn)
+		ret = dest->write_fn(chunk, 1, len, dest->data);
+	else
+		ret = fwrite(chunk, 1, len, dest->data);
+	dest->delivered += ret;
+	return ret;
+}
+
+/**
+ * Write callback for libcurl, to save the webpage to the cache on its way to
+ * the destination
+ */
+static size_t write_and_cache(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct fetch_dest *dest = data;
+
+	cache_body_chunk(dest->cache, ptr, size * nmemb);
+	return deliver_chunk(dest, ptr, size * nmemb);
+}
+
+/**
+ * Header callback for libcurl, to get the validators for the cache
+ */
+static size_t cache_header(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct fetch_dest *dest = data;
+
+	cache_header_line(dest->cache, ptr, size * nmemb);
+	return size * nmemb;
+}
+
+/**
+ * The server says the cached webpage is still fresh, so hand it over to the
+ * destination; return false if the destination stopped taking it.
+ */
+static bool deliver_cached_page(struct fetch_dest *dest)
+{
+	FILE *file = dest->cache->file;
+	char *buf;
+	bool ret = true;
+
+	buf = malloc(64 * 1024);
+	if (!buf)
+		fatal_errno();
+	while (!feof(file)) {
+		size_t len = fread(buf, 1, 64 * 1024, file);
+
+		if (ferror(file))
+			fatal_msg("I/O error");
+		if (deliver_chunk(dest, buf, len) != len) {
+			ret = false;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+/**
+ * Is this the url for a webpage served over HTTP(S)?
+ */
+static bool is_http_url(const char *url)
+{
+	return strncasecmp(url, "http://", 7) == 0 || strncasecmp(url, "https://", 8) == 0;
+}
+
+/**
+ * Should the webpage for a url go through the cache?
+ */
+static bool use_cache(const char *url)
+{
+	return options.cache_dir && is_http_url(url);
+}
+
+/**
+ * Set up the request for revalidation of the cached webpage, if there is one;
+ * return the list of headers, to free after the transfer.
+ */
+static struct curl_slist *set_cache_validators(CURL *curl, struct fetch_dest *dest)
+{
+	struct cache_entry *entry = dest->cache;
+	struct curl_slist *headers = NULL;
+	char *header;
+
+	if (curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, cache_header))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_HEADERDATA, dest))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_and_cache))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, dest))
+		fatal();
+	if (!entry->file)
+		return NULL;
+
+	if (entry->etag) {
+		header = mkstring("If-None-Match: %s", entry->etag);
+		headers = curl_slist_append(headers, header);
+		free(header);
+		if (!headers)
+			fatal();
+	}
+	if (entry->last_modified) {
+		header = mkstring("If-Modified-Since: %s", entry->last_modified);
+		headers = curl_slist_append(headers, header);
+		free(header);
+		if (!headers)
+			fatal();
+	}
+	if (curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers))
+		fatal();
+	return headers;
+}
+
+/* Shared by all transfers, so that html redirects and batch inputs reuse them */
+static CURLSH *curl_share;
+
+/* Sockets opened by libcurl, kept in the pool after the transfers are done */
+static curl_socket_t *curl_sockets;
+static size_t curl_socket_count;
+
+/**
+ * Socket open callback for libcurl, to keep track of the sockets in the pool
+ */
+static curl_socket_t open_curl_socket(void *data, curlsocktype purpose, struct curl_sockaddr *addr)
+{
+	curl_socket_t sock;
+	(void)data;
+	(void)purpose;
+
+	sock = socket(addr->family, addr->socktype, addr->protocol);
+	if (sock == CURL_SOCKET_BAD)
+		return sock;
+	curl_sockets = realloc(curl_sockets, (curl_socket_count + 1) * sizeof(*curl_sockets));
+	if (!curl_sockets)
+		fatal_errno();
+	curl_sockets[curl_socket_count++] = sock;
+	return sock;
+}
+
+/**
+ * Socket close callback for libcurl, to forget the sockets that leave the pool
+ */
+static int close_curl_socket(void *data, curl_socket_t sock)
+{
+	size_t i;
+	(void)data;
+
+	for (i = 0; i < curl_socket_count; ++i) {
+		if (curl_sockets[i] == sock) {
+			curl_sockets[i] = curl_sockets[--curl_socket_count];
+			break;
+		}
+	}
+	return close(sock);
+}
+
+/**
+ * The sandbox still allows writes to any open descriptor, so a subprocess must
+ * close all the connections it inherits from the pool. They are shared with the
+ * parent, so this doesn't go through libcurl.
+ */
+static void close_curl_sockets(void)
+{
+	size_t i;
+
+	for (i = 0; i < curl_socket_count; ++i)
+		close(curl_sockets[i]);
+	free(curl_sockets);
+	curl_sockets = NULL;
+	curl_socket_count = 0;
+}
+
 /**
- * Fetch the webpage and save it to a temporary file; exit on failure
+ * Get the share for the DNS cache, TLS sessions and connection pool that are
+ * kept for the life of the process. All transfers happen on the main thread,
+ * so there is no need for locking.
  */
-static void url_to_file(FILE *file)
+static CURLSH *get_curl_share(void)
 {
+	if (curl_share)
+		return curl_share;
+
+	curl_share = curl_share_init();
+	if (!curl_share)
+		fatal_msg("libcurl could not be initialized");
+	if (curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS))
+		fatal();
+	if (curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION))
+		fatal();
+	if (curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT))
+		fatal();
+	return curl_share;
+}
+
+/* A transfer for a single webpage, done at once or along with others */
+struct fetch {
 	CURL *curl;
-	CURLcode res;
 	char errbuf[CURL_ERROR_SIZE];
-	size_t errlen;
+	struct cache_entry entry;
+	struct fetch_dest dest;
+	struct curl_slist *headers;
+	bool cache;
+};
+
+/**
+ * Set up the transfer for a webpage, to pass its content to the write function;
+ * if this is NULL, the data argument must be a stream to save it to. The share
+ * may be NULL for transfers that don't need one.
+ *
+ * If there is a cache, the webpage gets saved there on its way, and if the
+ * server confirms that the cached copy is still fresh, that gets passed on
+ * instead.
+ */
+static void start_fetch(struct fetch *fetch, CURLSH *share, const char *url,
+			curl_write_callback write_fn, void *data)
+{
+	CURL *curl;
 	long protocols;
 
-	curl = curl_easy_init();
+	memset(fetch, 0, sizeof(*fetch));
+	fetch->dest.write_fn = write_fn;
+	fetch->dest.data = data;
+	fetch->dest.cache = &fetch->entry;
+	fetch->cache = use_cache(url);
+
+	curl = fetch->curl = curl_easy_init();
 	if (!curl)
 		fatal_msg("libcurl could not be initialized");
-	if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf))
+	if (share && curl_easy_setopt(curl, CURLOPT_SHARE, share))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, open_curl_socket))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, close_curl_socket))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, fetch->errbuf))
+		fatal();
+	if (curl_easy_setopt(curl, CURLOPT_URL, url))
 		fatal();
-	if (curl_easy_setopt(curl, CURLOPT_URL, options.url))
+	if (write_fn && curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_fn))
 		fatal();
-	if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, file))
+	if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, data))
 		fatal();
 
 	/* I don't expect any other protocols, so be safe */
@@ -251,6 +594,10 @@ static void url_to_file(FILE *file)
 	if (curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, ""))
 		fatal();
 
+	/* SIGALRM belongs to the deadline, libcurl must not touch it */
+	if (curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L))
+		fatal();
+
 	if (curl_easy_setopt(curl, CURLOPT_USERAGENT, options.agent))
 		fatal();
 
@@ -260,144 +607,478 @@ static void url_to_file(FILE *file)
 	if (curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50))
 		fatal();
 
-	res = curl_easy_perform(curl);
+	if (fetch->cache) {
+		open_cache_entry(&fetch->entry, options.cache_dir, url);
+		fetch->headers = set_cache_validators(curl, &fetch->dest);
+	}
+}
+
+/**
+ * Clean up after a transfer, given its result code; return false on failure,
+ * and don't report the error if the write function asked to stop.
+ */
+static bool finish_fetch(struct fetch *fetch, CURLcode res, const bool *stopped)
+{
+	struct cache_entry *entry = &fetch->entry;
+	long code = 0;
+	bool ret = true;
+
+	curl_slist_free_all(fetch->headers);
+	fetch->headers = NULL;
 	if (res) {
-		errlen = strlen(errbuf);
-		fprintf(stderr, "%s: couldn't fetch the webpage (%s)\n", progname, curl_easy_strerror(res));
-		if (errlen)
-			fprintf(stderr, "%s%s", errbuf, (errbuf[errlen - 1] != '\n') ? "\n" : "");
-		exit(1);
+		size_t errlen = strlen(fetch->errbuf);
+
+		if (!stopped || !*stopped) {
+			fprintf(stderr, "%s: couldn't fetch the webpage (%s)\n", progname, curl_easy_strerror(res));
+			if (errlen)
+				fprintf(stderr, "%s%s", fetch->errbuf, (fetch->errbuf[errlen - 1] != '\n') ? "\n" : "");
+		}
+		if (fetch->cache)
+			finish_cache_entry(entry, false);
+		ret = false;
+		goto out;
 	}
 
-	if (fflush(file))
-		fatal_errno();
+	if (fetch->cache) {
+		if (curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &code))
+			fatal();
+		if (!finish_cache_entry(entry, true))
+			error_msg("failed to save the webpage to the cache");
+		/* A 304 response has no body, the cached one is passed on instead */
+		if (code == 304 && entry->file && !fetch->dest.delivered)
+			ret = deliver_cached_page(&fetch->dest);
+	}
 
-	set_encoding_from_response(curl);
-	curl_easy_cleanup(curl);
+out:
+	if (fetch->cache)
+		close_cache_entry(entry);
+	curl_easy_cleanup(fetch->curl);
+	fetch->curl = NULL;
+	return ret;
 }
 
 /**
- * Map a whole file to memory; return the length of the mapping
+ * Fetch the webpage and save it to a temporary file; return false on failure
+ *
+ * TODO: the encoding from the HTTP headers is ignored for now, because it's
+ * dangerous to parse them outside the sandbox. It doesn't matter much because
+ * most websites provide the encoding inside the html as well.
  */
-static size_t map_file(int fd, char **map)
+static bool url_to_file(FILE *file)
 {
-	struct stat statbuf;
-	size_t size;
+	struct fetch fetch;
 
-	if (fstat(fd, &statbuf))
+	start_fetch(&fetch, get_curl_share(), options.url, NULL, file);
+	if (!finish_fetch(&fetch, curl_easy_perform(fetch.curl), NULL)) {
+		clear_stream(file);
+		return false;
+	}
+	if (fflush(file))
 		fatal_errno();
-	size = statbuf.st_size;
-	if (!size)
-		fatal_msg("the document is empty");
+	return true;
+}
 
-	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*map == MAP_FAILED)
-		fatal_errno();
-	return size;
+/**
+ * Error handler for libxml2 that does nothing
+ */
+static void ignore_xml_error(void *ctx, const char *msg, ...)
+{
+	(void)ctx;
+	(void)msg;
 }
 
+/* Bytes at the start of a document to search for the meta tag with its encoding */
+#define META_PRESCAN_SIZE 1024
+
 /**
- * Overwrite text between script tags with X's; this gets rid of any closing
- * tags, which would terminate the CDATA section and cause libxml2 to choke.
- *
- * We search through the text as ascii, which will fail for some encodings,
- * but is not likely to corrupt the page because the "<script" ascii string
- * would have to randomly show up somewhere.
+ * Copy the encoding declared by a meta tag at the start of a document to a
+ * buffer of size MAX_ENC_LEN + 1; leave it empty if there is none that we know.
+ * This is a rough take on the prescan from the HTML standard. Since 2.13,
+ * libxml2 decodes everything before the meta tag as latin1, so the encoding
+ * must be known before the parse even starts.
  */
-static void invalidate_script_cdata(char *map, size_t size)
+static void find_meta_charset(const char *buf, size_t len, char *charset)
 {
-	char lastchar;
-	const char *opentag;
+	char tag[256];
+	size_t i;
 
-	if (!size)
-		fatal();
+	*charset = '\0';
+	len = MIN(len, META_PRESCAN_SIZE);
 
-	/* Work with the file as a string, and restore the last character later */
-	lastchar = map[size - 1];
-	map[size - 1] = '\0';
+	/* A byte order mark beats any meta tag, and libxml2 handles it already */
+	if (len >= 2 && (!memcmp(buf, "\xfe\xff", 2) || !memcmp(buf, "\xff\xfe", 2)))
+		return;
+	if (len >= 3 && !memcmp(buf, "\xef\xbb\xbf", 3))
+		return;
 
-	opentag = (char *)xmlStrcasestr(BAD_CAST map, BAD_CAST "<script");
-	while (opentag) {
-		char *gt;
-		const char *closetag;
+	for (i = 0; i + strlen("<meta") <= len; ++i) {
+		const char *end;
+		size_t taglen;
 
-		gt = strchr(opentag, '>');
-		if (!gt)
-			break; /* Malformed html, just ignore it for now and move on */
-		if (*(gt - 1) == '/') { /* No closing tag for this node */
-			opentag = (char *)xmlStrcasestr(BAD_CAST gt, BAD_CAST "<script");
+		if (strncasecmp(buf + i, "<meta", strlen("<meta")) != 0)
 			continue;
-		}
-		closetag = (char *)xmlStrcasestr(BAD_CAST gt, BAD_CAST "</script>");
-		if (!closetag)
-			break; /* Malformed html, just ignore it for now and move on */
-		memset(gt + 1, 'X', closetag - (gt + 1));
-		opentag = (char *)xmlStrcasestr(BAD_CAST closetag, BAD_CAST "<script");
+		end = memchr(buf + i, '>', len - i);
+		if (!end)
+			return;
+		taglen = MIN((size_t)(end - (buf + i)), sizeof(tag) - 1);
+		memcpy(tag, buf + i, taglen);
+		tag[taglen] = '\0';
+		/* Both <meta charset> and <meta http-equiv> look the same from here */
+		parse_charset(tag, charset);
+		if (*charset)
+			return;
+		i = end - buf;
 	}
-
-	map[size - 1] = lastchar;
 }
 
 /**
- * Parse the html in the mapped file and return its htmlDocPtr; exit on failure
+ * Create a parser for html that will be received in chunks, given the start of
+ * the document to look for its encoding. If a readerability check or a head
+ * check is given, it runs during the parse.
  */
-static htmlDocPtr parse_mapped_file(char *map, size_t mapsize)
+static htmlParserCtxtPtr new_push_parser(const char *buf, size_t len, struct readerable_check *check,
+					 struct head_check *head)
 {
-	htmlDocPtr doc;
+	htmlParserCtxtPtr parser;
 	int flags = HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING;
+	char meta_charset[MAX_ENC_LEN + 1];
+	const char *enc = options.enc;
 
-	invalidate_script_cdata(map, mapsize);
-	doc = htmlReadMemory(map, mapsize, options.base_url, options.enc, flags);
-	if (!doc)
-		fatal_msg("libxml2 couldn't parse the document as HTML");
-	return doc;
+	parser = htmlCreatePushParserCtxt(NULL, NULL, NULL, 0, options.base_url,
+					  XML_CHAR_ENCODING_NONE);
+	if (!parser)
+		fatal();
+	/*
+	 * Like htmlReadMemory(), assume utf8 until the document says otherwise,
+	 * and fall back to latin1 if it turns out to be invalid. Otherwise older
+	 * versions of libxml2 decode any undeclared document as latin1, and they
+	 * may miss the meta tags as well.
+	 */
+	parser->charset = XML_CHAR_ENCODING_UTF8;
+	if (!enc) {
+		find_meta_charset(buf, len, meta_charset);
+		if (*meta_charset)
+			enc = meta_charset;
+	}
+	if (enc) {
+		xmlCharEncodingHandlerPtr handler = xmlFindCharEncodingHandler(enc);
+
+		/*
+		 * Like htmlReadMemory(), ignore the encoding if it's not found,
+		 * and otherwise don't let the meta tags override it
+		 */
+		if (handler) {
+			if (xmlSwitchToEncoding(parser, handler))
+				fatal();
+			flags |= HTML_PARSE_IGNORE_ENC;
+		}
+	}
+	htmlCtxtUseOptions(parser, flags);
+	if (check)
+		start_readerable_check(check, parser);
+	if (head)
+		start_head_check(head, parser);
+	return parser;
 }
 
 /**
- * Abort if the character encoding is unrecognized
+ * Has any of the checks that run during the parse stopped it already?
  */
-static void check_known_encoding(const char *enc)
+static bool parse_stopped(const struct readerable_check *check, const struct head_check *head)
 {
-	if (xmlParseCharEncoding(enc) > 0) /* Known to libxml2 */
-		return;
-	if (strcasecmp(enc, "gb2312") == 0) /* Prepared for iconv */
-		return;
-	fatal_msg("unrecognized encoding");
+	return (check && readerable_check_passed(check)) || (head && head->passed);
 }
 
-static const char *OPTSTRING = "cu:vB:E:A:HMT:P";
-#define DISABLE_SANDBOX 256 /* No short version of this option */
-static const struct option LONGOPTS[] = {
-	{"check", no_argument, NULL, 'c'},
-	{"base", required_argument, NULL, 'u'},
-	{"version", no_argument, NULL, 'v'},
-	{"browser", required_argument, NULL, 'B'},
-	{"encoding", required_argument, NULL, 'E'},
-	{"agent", required_argument, NULL, 'A'},
-	{"html", no_argument, NULL, 'H'},
-	{"meta", no_argument, NULL, 'M'},
-	{"template", required_argument, NULL, 'T'},
-	{"preserve-classes", no_argument, NULL, 'P'},
-	{"disable-sandbox", no_argument, NULL, DISABLE_SANDBOX},
-	{0}
-};
-
 /**
- * Parse the command line arguments and set the global options structure
+ * Pass a chunk of html on to the push parser
  */
-static void parse_arguments(int argc, char *argv[])
+static void push_to_parser(void *data, const char *chunk, size_t len)
 {
-	int output_opts = 0; /* Only one of these options can be set */
+	htmlParserCtxtPtr parser = data;
+	struct phase_time start;
 
-	/* TODO: add flags to override this? */
-	options.flags |= OPT_STRIP_UNLIKELY;
-	options.flags |= OPT_WEIGHT_CLASSES;
-	options.flags |= OPT_CLEAN_CONDITIONALLY;
+	/* Errors are ignored, the same as for htmlReadMemory() */
+	start_phase(stats, &start);
+	htmlParseChunk(parser, chunk, len, 0 /* terminate */);
+	end_phase(stats, PHASE_PARSE, &start);
+}
 
-	if (argc == 0)
-		exit(1);
+/**
+ * Tell the push parser that the document is over, and free it; return the
+ * htmlDocPtr, or exit on failure
+ */
+static htmlDocPtr finish_push_parser(htmlParserCtxtPtr parser)
+{
+	struct phase_time start;
+	htmlDocPtr doc;
 
-	progname = argv[0];
+	start_phase(stats, &start);
+	htmlParseChunk(parser, NULL, 0, 1 /* terminate */);
+	end_phase(stats, PHASE_PARSE, &start);
+	doc = parser->myDoc;
+	parser->myDoc = NULL;
+	htmlFreeParserCtxt(parser);
+	if (!doc)
+		fatal_msg("libxml2 couldn't parse the document as HTML");
+	return doc;
+}
+
+/**
+ * Read exactly the requested number of bytes; return false on end of file
+ */
+static bool read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, pos, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			fatal_errno();
+		if (!ret)
+			return false;
+		pos += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/**
+ * Read whatever is available from the socket, up to the requested number of
+ * bytes; return the count, or zero on end of file
+ */
+static size_t read_chunk(int sock, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(sock, buf, len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		fatal_errno();
+	return ret;
+}
+
+/**
+ * Parse the html in the mapped file and return its htmlDocPtr; exit on failure.
+ * If a readerability check or a head check is given, the parse stops once it
+ * passes.
+ */
+static htmlDocPtr parse_mapped_file(char *map, size_t mapsize, struct readerable_check *check,
+				    struct head_check *head)
+{
+	htmlParserCtxtPtr parser;
+	htmlDocPtr doc;
+	int flags = HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING;
+	struct phase_time start;
+	size_t pos, len;
+
+	start_phase(stats, &start);
+	invalidate_script_cdata(map, mapsize);
+	end_phase(stats, PHASE_SCRUB, &start);
+	if (!check && !head) {
+		char meta_charset[MAX_ENC_LEN + 1];
+		const char *enc = options.enc;
+
+		if (!enc) {
+			find_meta_charset(map, mapsize, meta_charset);
+			if (*meta_charset)
+				enc = meta_charset;
+		}
+		start_phase(stats, &start);
+		doc = htmlReadMemory(map, mapsize, options.base_url, enc, flags);
+		end_phase(stats, PHASE_PARSE, &start);
+		if (!doc)
+			fatal_msg("libxml2 couldn't parse the document as HTML");
+		return doc;
+	}
+
+	parser = new_push_parser(map, mapsize, check, head);
+	for (pos = 0; pos < mapsize && !parse_stopped(check, head); pos += len) {
+		len = mapsize - pos < STREAM_CHUNK_SIZE ? mapsize - pos : STREAM_CHUNK_SIZE;
+		push_to_parser(parser, map + pos, len);
+	}
+	return finish_push_parser(parser);
+}
+
+/**
+ * Parse the html as it's received through the socket, so that the work can
+ * overlap with the download; return its htmlDocPtr, or exit on failure. If a
+ * readerability check or a head check is given, stop reading once it passes.
+ * Return NULL if the document turns out to be larger than --max-size.
+ */
+static htmlDocPtr parse_stream(int sock, struct readerable_check *check, struct head_check *head)
+{
+	struct script_scrubber scrub;
+	htmlParserCtxtPtr parser;
+	struct phase_time start;
+	htmlDocPtr doc;
+	char *buf;
+	size_t len = 0;
+	size_t total = 0;
+	bool too_big = false;
+
+	buf = malloc(STREAM_CHUNK_SIZE);
+	if (!buf)
+		fatal_errno();
+
+	/* Wait for enough of the document to find its encoding */
+	while (len < META_PRESCAN_SIZE) {
+		size_t ret = read_chunk(sock, buf + len, STREAM_CHUNK_SIZE - len);
+
+		if (!ret)
+			break;
+		len += ret;
+	}
+	parser = new_push_parser(buf, len, check, head);
+	init_scrubber(&scrub, push_to_parser, parser);
+	while (len && !parse_stopped(check, head)) {
+		start_phase(stats, &start);
+		scrub_chunk(&scrub, buf, len);
+		end_phase(stats, PHASE_SCRUB, &start);
+		total += len;
+		if (options.max_size && total > options.max_size) {
+			too_big = true;
+			break;
+		}
+		len = read_chunk(sock, buf, STREAM_CHUNK_SIZE);
+	}
+	free(buf);
+	if (!total)
+		fatal_msg("the document is empty");
+
+	/* Let the parent know right away if we don't need the rest */
+	close(sock);
+
+	start_phase(stats, &start);
+	finish_scrubber(&scrub);
+	end_phase(stats, PHASE_SCRUB, &start);
+	if (stats) {
+		/* The scrubber hands each chunk to the parser, so that got counted too */
+		stats->phases[PHASE_SCRUB].wall -= stats->phases[PHASE_PARSE].wall;
+		stats->phases[PHASE_SCRUB].cpu -= stats->phases[PHASE_PARSE].cpu;
+	}
+	doc = finish_push_parser(parser);
+	if (too_big) {
+		free_doc(doc);
+		return NULL;
+	}
+	return doc;
+}
+
+/**
+ * Abort if the character encoding is unrecognized
+ */
+static void check_known_encoding(const char *enc)
+{
+	if (!is_known_encoding(enc))
+		fatal_msg("unrecognized encoding");
+}
+
+static const char *OPTSTRING = "cu:vB:E:A:HMT:Pb::";
+#define DISABLE_SANDBOX 256 /* No short version of this option */
+#define WORKERS 257 /* Same for this one */
+#define PARALLEL_ATTEMPTS 258 /* And this one */
+#define TEXT 259 /* And so on */
+#define MARKDOWN 260
+#define JSON 261
+#define STATS 262
+#define CACHE_DIR 263
+#define RESULT_CACHE 264
+#define FETCHES 265
+#define FETCHES_PER_HOST 266
+#define FAST_METADATA 267
+#define MAX_SIZE 268
+#define MAX_NODES 269
+#define DEADLINE 270
+#define MAX_MEMORY 271
+static const struct option LONGOPTS[] = {
+	{"check", no_argument, NULL, 'c'},
+	{"base", required_argument, NULL, 'u'},
+	{"version", no_argument, NULL, 'v'},
+	{"browser", required_argument, NULL, 'B'},
+	{"encoding", required_argument, NULL, 'E'},
+	{"agent", required_argument, NULL, 'A'},
+	{"html", no_argument, NULL, 'H'},
+	{"meta", no_argument, NULL, 'M'},
+	{"template", required_argument, NULL, 'T'},
+	{"preserve-classes", no_argument, NULL, 'P'},
+	{"batch", optional_argument, NULL, 'b'},
+	{"workers", required_argument, NULL, WORKERS},
+	{"parallel-attempts", no_argument, NULL, PARALLEL_ATTEMPTS},
+	{"text", no_argument, NULL, TEXT},
+	{"markdown", no_argument, NULL, MARKDOWN},
+	{"json", no_argument, NULL, JSON},
+	{"stats", no_argument, NULL, STATS},
+	{"cache-dir", required_argument, NULL, CACHE_DIR},
+	{"result-cache", required_argument, NULL, RESULT_CACHE},
+	{"fetches", required_argument, NULL, FETCHES},
+	{"fetches-per-host", required_argument, NULL, FETCHES_PER_HOST},
+	{"fast-meta", no_argument, NULL, FAST_METADATA},
+	{"max-size", required_argument, NULL, MAX_SIZE},
+	{"max-nodes", required_argument, NULL, MAX_NODES},
+	{"deadline", required_argument, NULL, DEADLINE},
+	{"max-memory", required_argument, NULL, MAX_MEMORY},
+	{"disable-sandbox", no_argument, NULL, DISABLE_SANDBOX},
+	{0}
+};
+
+/* Base url requested by the user, if any; it applies to all batch inputs */
+static const char *user_base_url;
+
+/**
+ * Set the url (or local path) for the next document to process; a NULL input
+ * stands for standard input.
+ */
+static void set_input(const char *input)
+{
+	free(options.url);
+	options.url = NULL;
+	if (options.localfile)
+		fclose(options.localfile);
+	options.localfile = NULL;
+
+	if (input) {
+		options.url = strdup(input);
+		if (!options.url)
+			fatal_errno();
+		options.localfile = fopen(options.url, "r"); /* Often NULL of course */
+	}
+
+	options.base_url = user_base_url;
+	if (!options.base_url) {
+		if (options.localfile)
+			options.base_url = "none://local.file";
+		else if (!options.url)
+			options.base_url = "none://standard.input";
+		else
+			options.base_url = options.url;
+	}
+}
+
+/**
+ * Parse the command line arguments and set the global options structure;
+ * return the index of the first positional argument.
+ */
+static int parse_arguments(int argc, char *argv[])
+{
+	int output_opts = 0; /* Only one of these options can be set */
+	long size;
+
+	/* TODO: add flags to override this? */
+	options.flags |= OPT_STRIP_UNLIKELY;
+	options.flags |= OPT_WEIGHT_CLASSES;
+	options.flags |= OPT_CLEAN_CONDITIONALLY;
+
+	options.fetches = DEFAULT_FETCHES;
+	options.fetches_per_host = DEFAULT_FETCHES_PER_HOST;
+
+	if (argc == 0)
+		exit(1);
+
+	progname = argv[0];
 	while (1) {
 		int opt = getopt_long(argc, argv, OPTSTRING, LONGOPTS, NULL);
 
@@ -410,7 +1091,7 @@ static void parse_arguments(int argc, char *argv[])
 			options.flags |= OPT_CHECK;
 			break;
 		case 'u':
-			options.base_url = optarg;
+			user_base_url = optarg;
 			break;
 		case 'v':
 			if (*GIT_COMMIT)
@@ -431,6 +1112,10 @@ static void parse_arguments(int argc, char *argv[])
 			++output_opts;
 			options.flags |= OPT_METADATA;
 			break;
+		case FAST_METADATA:
+			++output_opts;
+			options.flags |= OPT_METADATA | OPT_FAST_METADATA;
+			break;
 		case 'E':
 			check_known_encoding(optarg);
 			options.enc = optarg;
@@ -444,6 +1129,74 @@ static void parse_arguments(int argc, char *argv[])
 		case 'P':
 			options.flags |= OPT_PRESERVE_CLASSES;
 			break;
+		case 'b':
+			options.batch = true;
+			options.batch_list = optarg;
+			break;
+		case WORKERS:
+			options.workers = atoi(optarg);
+			if (options.workers <= 0)
+				usage();
+			break;
+		case PARALLEL_ATTEMPTS:
+			options.flags |= OPT_PARALLEL_ATTEMPTS;
+			break;
+		case TEXT:
+			++output_opts;
+			options.flags |= OPT_TEXT;
+			break;
+		case MARKDOWN:
+			++output_opts;
+			options.flags |= OPT_MARKDOWN;
+			break;
+		case JSON:
+			options.flags |= OPT_JSON;
+			break;
+		case STATS:
+			options.flags |= OPT_STATS;
+			break;
+		case CACHE_DIR:
+			options.cache_dir = optarg;
+			break;
+		case RESULT_CACHE:
+			size = atol(optarg);
+			if (size <= 0)
+				usage();
+			options.result_cache = (size_t)size << 20; /* Given in MiB */
+			break;
+		case FETCHES:
+			options.fetches = atoi(optarg);
+			if (options.fetches < 0 || (!options.fetches && strcmp(optarg, "0") != 0))
+				usage();
+			break;
+		case FETCHES_PER_HOST:
+			options.fetches_per_host = atoi(optarg);
+			if (options.fetches_per_host <= 0)
+				usage();
+			break;
+		case MAX_SIZE:
+			size = atol(optarg);
+			if (size <= 0)
+				usage();
+			options.max_size = (size_t)size << 20; /* Given in MiB */
+			break;
+		case MAX_NODES:
+			size = atol(optarg);
+			if (size <= 0)
+				usage();
+			options.max_nodes = size;
+			break;
+		case DEADLINE:
+			options.deadline = atof(optarg);
+			if (!(options.deadline > 0))
+				usage();
+			break;
+		case MAX_MEMORY:
+			size = atol(optarg);
+			if (size <= 0)
+				usage();
+			options.max_memory = (size_t)size << 20; /* Given in MiB */
+			break;
 		case DISABLE_SANDBOX:
 			options.disable_sandbox = true;
 			break;
@@ -454,26 +1207,34 @@ static void parse_arguments(int argc, char *argv[])
 
 	if (output_opts > 1)
 		usage();
-	if (!output_opts) {
-		/* Using a browser is the default */
-		options.browser = getenv("RDRVIEW_BROWSER");
-		options.flags |= OPT_BROWSER;
-	}
-
-	if (optind < argc - 1)
-		usage();
-	if (optind == argc - 1) {
-		options.url = strdup(argv[optind]);
-		options.localfile = fopen(options.url, "r"); /* Often NULL of course */
+	if (options.flags & OPT_JSON) {
+		/* The format of the content can still be picked */
+		if (output_opts && !(options.flags & (OPT_TEXT | OPT_MARKDOWN)))
+			usage();
+		output_opts = 1;
 	}
-
-	if (!options.base_url) {
-		if (options.localfile)
-			options.base_url = "none://local.file";
-		else if (!options.url)
-			options.base_url = "none://standard.input";
-		else
-			options.base_url = options.url;
+	if (options.batch) {
+		/* There is no sensible way to open a browser for each document */
+		if (!output_opts || (options.flags & OPT_BROWSER))
+			fatal_msg("batch mode requires one of -c, -H, -M, --fast-meta, --text, --markdown or --json");
+		/* Take the inputs from a list or from the arguments, not both */
+		if (options.batch_list && optind < argc)
+			usage();
+		/* By default, one worker per processor */
+		if (!options.workers)
+			options.workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	} else {
+		/* A single document can't be repeated */
+		if (options.result_cache)
+			fatal_msg("the result cache only works in batch mode");
+		if (!output_opts) {
+			/* Using a browser is the default */
+			options.browser = getenv("RDRVIEW_BROWSER");
+			options.flags |= OPT_BROWSER;
+		}
+		if (optind < argc - 1)
+			usage();
+		set_input(optind == argc - 1 ? argv[optind] : NULL);
 	}
 
 	if (!options.template) {
@@ -482,35 +1243,202 @@ static void parse_arguments(int argc, char *argv[])
 			options.template = "body";
 	}
 
+	if (!options.cache_dir)
+		options.cache_dir = getenv("RDRVIEW_CACHE_DIR");
+	if (options.cache_dir && !*options.cache_dir)
+		options.cache_dir = NULL;
+
 	if (!options.agent) {
 		options.agent = getenv("RDRVIEW_USER_AGENT");
 		if (!options.agent)
 			options.agent = RDRVIEW_DEFAULT_USER_AGENT;
 	}
+	return optind;
 }
 
 /**
- * Save the HTML for a node to the given file
+ * Save the HTML for a node to the given file, in a single large write
  */
 static void save_node_to_file(htmlNodePtr node, FILE *file)
 {
-	int temp_stdout;
+	char *markup;
+	size_t len;
 
-	/* Save a duplicate of the stdout file descriptor, to restore it later */
-	temp_stdout = dup(STDOUT_FILENO);
-	if (temp_stdout < 0)
+	markup = node_to_string(node, &len);
+	if (fwrite(markup, 1, len, file) != len)
 		fatal_errno();
+	xmlFree(markup);
+}
+
+/**
+ * Save a node rendered as plain text or markdown to the given file
+ */
+static void save_text_to_file(htmlNodePtr node, bool markdown, FILE *file)
+{
+	char *text;
+	size_t len;
 
-	/* Turn the file into stdout, so that xmlShellPrintNode() writes to it */
-	if (dup2(fileno(file), STDOUT_FILENO) < 0)
+	text = node_to_text(node, markdown, &len);
+	if (fwrite(text, 1, len, file) != len)
 		fatal_errno();
-	xmlShellPrintNode(node);
-	fflush(stdout);
+	free(text);
+}
+
+/**
+ * Print a field for a json record, with its string value
+ */
+static void print_json_field(FILE *out, const char *name, const char *value)
+{
+	fprintf(out, ",\"%s\":", name);
+	print_json_string(out, value);
+}
+
+/**
+ * Print a json record for a document on a single line. The metadata and the
+ * article can be NULL if they are not available, and the error message is
+ * NULL on success.
+ */
+static void print_json_record(FILE *out, const char *url, const struct metadata *metadata,
+			      htmlNodePtr article, const char *error)
+{
+	static const struct metadata no_metadata = {0};
+	char *content = NULL;
+	size_t len;
+
+	if (!metadata)
+		metadata = &no_metadata;
+
+	fputs("{\"url\":", out);
+	print_json_string(out, url);
+	print_json_field(out, "title", metadata->title);
+	print_json_field(out, "byline", metadata->byline);
+	print_json_field(out, "excerpt", metadata->excerpt);
+	print_json_field(out, "site_name", metadata->site_name);
+	print_json_field(out, "direction", metadata->direction);
+
+	if (article) {
+		xmlChar *text = xmlNodeGetContent(article);
+
+		fprintf(out, ",\"length\":%d", text ? xmlUTF8Strlen(text) : 0);
+		xmlFree(text);
+
+		if (options.flags & (OPT_TEXT | OPT_MARKDOWN))
+			content = node_to_text(article, options.flags & OPT_MARKDOWN, &len);
+		else
+			content = node_to_string(article, &len);
+		if (len && content[len - 1] == '\n')
+			content[len - 1] = '\0';
+	} else {
+		fputs(",\"length\":null", out);
+	}
+	print_json_field(out, "content", content);
+	free(content);
 
-	/* Now restore stdout */
-	if (dup2(temp_stdout, STDOUT_FILENO) < 0)
+	print_json_field(out, "error", error);
+	fputs("}\n", out);
+	if (ferror(out))
+		fatal_msg("I/O error");
+}
+
+/**
+ * Print the json record saved by the child for a document, or an error record
+ * if it saved none; the exit status for the document goes in that error.
+ */
+static void print_json_output(const char *input, const char *output, size_t len, int status)
+{
+	if (!len) {
+		const char *reason = "failed to process the document";
+		char *error;
+
+		/* The children report these failures without a record */
+		if (status == STATUS_TOO_BIG)
+			reason = "the document is too large";
+		else if (status == STATUS_TIMED_OUT)
+			reason = "the document took too long, so it was abandoned";
+		else if (status == STATUS_OUT_OF_MEMORY)
+			reason = "ran out of memory";
+		error = mkstring("%s (exit status %d)", reason, status);
+		print_json_record(stdout, input, NULL, NULL, error);
+		free(error);
+		return;
+	}
+	if (fwrite(output, 1, len, stdout) != len)
 		fatal_errno();
-	close(temp_stdout);
+}
+
+/* Names of the phases in the stats records */
+static const char *const PHASE_NAMES[PHASE_COUNT] = {
+	[PHASE_FETCH] = "fetch",
+	[PHASE_SCRUB] = "scrub",
+	[PHASE_PARSE] = "parse",
+	[PHASE_PREP_DOCUMENT] = "prep_document",
+	[PHASE_GRAB_ARTICLE] = "grab_article",
+	[PHASE_PREP_ARTICLE] = "prep_article",
+	[PHASE_FIX_URLS] = "fix_urls",
+	[PHASE_SERIALIZE] = "serialize",
+};
+
+/**
+ * Print a json array with the names of the extraction flags that are set in
+ * the options but not in the given flags
+ */
+static void print_dropped_flags(FILE *out, unsigned int flags)
+{
+	static const struct {
+		unsigned int flag;
+		const char *name;
+	} names[] = {
+		{OPT_STRIP_UNLIKELY, "strip_unlikely"},
+		{OPT_WEIGHT_CLASSES, "weight_classes"},
+		{OPT_CLEAN_CONDITIONALLY, "clean_conditionally"},
+	};
+	const char *sep = "";
+	unsigned int i;
+
+	fputc('[', out);
+	for (i = 0; i < ARRAY_SIZE(names); ++i) {
+		if ((options.flags & names[i].flag) && !(flags & names[i].flag)) {
+			fprintf(out, "%s\"%s\"", sep, names[i].name);
+			sep = ",";
+		}
+	}
+	fputc(']', out);
+}
+
+/**
+ * Print the stats for a document to stderr as a json record on a single line.
+ * If the input is NULL, this is the record with the totals for a batch of the
+ * given number of documents.
+ */
+static void print_stats_record(const char *input, const struct rdr_stats *st, unsigned long docs)
+{
+	int i;
+
+	if (input) {
+		fputs("{\"input\":", stderr);
+		print_json_string(stderr, input);
+	} else {
+		fprintf(stderr, "{\"documents\":%lu", docs);
+	}
+	for (i = 0; i < PHASE_COUNT; ++i) {
+		fprintf(stderr, ",\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", PHASE_NAMES[i],
+			st->phases[i].wall, st->phases[i].cpu);
+	}
+	if (input) {
+		fputs(",\"attempts\":[", stderr);
+		for (i = 0; i < MIN(st->attempt_count, (int)ARRAY_SIZE(st->attempts)); ++i) {
+			const struct attempt_stats *attempt = &st->attempts[i];
+
+			fputs(i ? ",{\"dropped\":" : "{\"dropped\":", stderr);
+			print_dropped_flags(stderr, attempt->flags);
+			fprintf(stderr, ",\"wall\":%.6f,\"cpu\":%.6f}", attempt->time.wall,
+				attempt->time.cpu);
+		}
+		fputc(']', stderr);
+	}
+	fprintf(stderr, ",\"attempt_count\":%d,\"nodes_before\":%lu,\"nodes_after\":%lu",
+		st->attempt_count, st->nodes_before, st->nodes_after);
+	fprintf(stderr, ",\"node_infos\":%lu,\"peak_rss_kib\":%ld}\n", st->node_infos, st->peak_rss);
 }
 
 /**
@@ -669,31 +1597,33 @@ static int run_browser_command(char *command)
 }
 
 /**
- * Print the already obtained document metadata to standard output
+ * Print the already obtained document metadata to the given stream. The
+ * readerability of the document is left out if it's NULL.
  */
-static void print_metadata(htmlDocPtr doc)
+static void print_metadata(const struct metadata *metadata, htmlDocPtr doc, FILE *out)
 {
-	if (metadata.title)
-		printf("Title: %s\n", metadata.title);
-	if (metadata.byline)
-		printf("Byline: %s\n", metadata.byline);
-	if (metadata.excerpt)
-		printf("Excerpt: %s\n", metadata.excerpt);
-	printf("Readerable: %s\n", is_probably_readerable(doc) ? "Yes" : "No");
-	if (metadata.site_name)
-		printf("Site name: %s\n", metadata.site_name);
-
-	if (metadata.direction) {
+	if (metadata->title)
+		fprintf(out, "Title: %s\n", metadata->title);
+	if (metadata->byline)
+		fprintf(out, "Byline: %s\n", metadata->byline);
+	if (metadata->excerpt)
+		fprintf(out, "Excerpt: %s\n", metadata->excerpt);
+	if (doc)
+		fprintf(out, "Readerable: %s\n", is_probably_readerable(doc) ? "Yes" : "No");
+	if (metadata->site_name)
+		fprintf(out, "Site name: %s\n", metadata->site_name);
+
+	if (metadata->direction) {
 		char *dir = NULL;
 
 		/* Spell out the text direction */
-		if (strcmp(metadata.direction, "ltr") == 0)
+		if (strcmp(metadata->direction, "ltr") == 0)
 			dir = "Left to right";
-		else if (strcmp(metadata.direction, "rtl") == 0)
+		else if (strcmp(metadata->direction, "rtl") == 0)
 			dir = "Right to left";
 
 		if (dir)
-			printf("Text direction: %s\n", dir);
+			fprintf(out, "Text direction: %s\n", dir);
 	}
 }
 
@@ -702,17 +1632,28 @@ static void print_metadata(htmlDocPtr doc)
  */
 static void clean_temp_filepath(void)
 {
+	int i;
+
 	if (!tmpdir) /* This is the child, let the parent handle cleanup */
 		return;
 
-	unlink(inputfile);
-	free(inputfile);
-	inputfile = NULL;
-
-	unlink(outputfile);
+	if (outputfile)
+		unlink(outputfile);
 	free(outputfile);
 	outputfile = NULL;
 
+	for (i = 0; workers && i < options.workers; ++i) {
+		if (workers[i].inputfile)
+			unlink(workers[i].inputfile);
+		free(workers[i].inputfile);
+		workers[i].inputfile = NULL;
+
+		if (workers[i].outputfile)
+			unlink(workers[i].outputfile);
+		free(workers[i].outputfile);
+		workers[i].outputfile = NULL;
+	}
+
 	rmdir(tmpdir);
 	free(tmpdir);
 	tmpdir = NULL;
@@ -822,7 +1763,7 @@ static void clean_iconv(void)
 /**
  * Attach to the article any metadata fields requested by the user
  */
-static void attach_metadata(htmlNodePtr article)
+static void attach_metadata(const struct metadata *metadata, htmlNodePtr article)
 {
 	char *template, *field;
 	bool past_body = false;
@@ -838,19 +1779,19 @@ static void attach_metadata(htmlNodePtr article)
 
 		if (strcmp(field, "title") == 0) {
 			tag = "h1";
-			content = metadata.title;
+			content = metadata->title;
 		} else if (strcmp(field, "body") == 0) {
 			past_body = true;
 			continue;
 		} else if (strcmp(field, "byline") == 0) {
 			tag = "h3";
-			content = metadata.byline;
+			content = metadata->byline;
 		} else if (strcmp(field, "excerpt") == 0) {
 			tag = "p";
-			content = metadata.excerpt;
+			content = metadata->excerpt;
 		} else if (strcmp(field, "sitename") == 0) {
 			tag = "h2";
-			content = metadata.site_name;
+			content = metadata->site_name;
 		} else if (strcmp(field, "url") == 0) {
 			tag = "h2";
 			content = options.url;
@@ -876,9 +1817,10 @@ static void attach_metadata(htmlNodePtr article)
 }
 
 /**
- * Save the HTML document to process to a temporary file
+ * Save the HTML document to process to a temporary file; return false on
+ * failure.
  */
-static void save_input_to_file(FILE *file)
+static bool save_input_to_file(FILE *file)
 {
 	/* Prioritize local files over remote urls, like real browsers do */
 	if (options.localfile)
@@ -886,7 +1828,8 @@ static void save_input_to_file(FILE *file)
 	else if (!options.url)
 		stdin_to_file(file);
 	else
-		url_to_file(file);
+		return url_to_file(file);
+	return true;
 }
 
 /**
@@ -898,7 +1841,7 @@ static void *node_check_for_redirects(htmlNodePtr node)
 	xmlChar *http_equiv;
 	htmlNodePtr ret = NULL;
 
-	if (!node_has_tag(node, "meta"))
+	if (!node_has_tag(node, TAG_META))
 		return NULL;
 
 	http_equiv = xmlGetProp(node, BAD_CAST "http-equiv");
@@ -914,8 +1857,9 @@ static void *node_check_for_redirects(htmlNodePtr node)
 
 /**
  * Is there an html redirect in the document? If so, save its url to the file.
+ * The remote argument tells if the document was downloaded from a url.
  */
-static bool check_html_redirect(htmlDocPtr doc, FILE *file)
+static bool check_html_redirect(htmlDocPtr doc, FILE *file, bool remote)
 {
 	htmlNodePtr node = NULL;
 	xmlChar *content;
@@ -928,7 +1872,7 @@ static bool check_html_redirect(htmlDocPtr doc, FILE *file)
 	 * author can use them to find out if it has been opened. Of course there
 	 * are other ways to do that, but those depend on the browser.
 	 */
-	if (options.localfile || !options.url)
+	if (!remote)
 		return ret;
 
 	if (!xmlDocGetRootElement(doc))
@@ -988,46 +1932,43 @@ static void escape_unicode_base_url(void)
 		fatal_msg("failed to escape unicode url - try to supply a valid one");
 }
 
-/* Status code returned by the child if it found an html redirect */
-#define STATUS_HTML_REDIRECT 2
-
 /**
- * Set up a sandbox and run all dangerous processing of the input HTML file
+ * Run all dangerous processing for a parsed HTML document, and free it; the
+ * caller must have set up the sandbox already. The results are printed to the
+ * out stream, and the article to open with a browser is saved to the output
+ * stream. Return the exit status for the document.
+ *
+ * For OPT_CHECK, the readerability check must have run during the parse, and
+ * the same goes for the head check with OPT_FAST_METADATA.
  */
-static int run_dangerous(int input_fd, int output_fd)
+static int process_document(htmlDocPtr doc, struct readerable_check *check,
+			    struct head_check *head, FILE *out, FILE *output_fp, bool remote)
 {
-	FILE *output_fp;
-	htmlDocPtr doc;
+	struct rdr_context ctx;
 	htmlNodePtr article = NULL;
-	char *input_map;
-	size_t input_size;
+	struct phase_time start;
 	int ret = 0;
 
-	output_fp = fdopen(output_fd, "w");
-	if (!output_fp)
-		fatal_errno();
-
-	/*
-	 * Some standard libraries use newfstatat() to implement fstat(). We don't
-	 * want to allow checking arbitrary paths inside the sandbox, so just map
-	 * the file ahead of time.
-	 */
-	input_size = map_file(input_fd, &input_map);
-
-	start_sandbox();
-	assert_sandbox_works();
-
-	doc = parse_mapped_file(input_map, input_size);
-	munmap(input_map, input_size);
-
-	if (check_html_redirect(doc, output_fp)) {
+	if (check_html_redirect(doc, output_fp, remote)) {
 		ret = STATUS_HTML_REDIRECT;
 		goto out;
 	}
-	init_regexes();
 
 	if (options.flags & OPT_CHECK) {
-		ret = !is_probably_readerable(doc);
+		ret = !readerable_check_passed(check);
+		/* The exit status can't tell the batch results apart from failures */
+		if (options.batch) {
+			fprintf(out, "Readerable: %s\n", ret ? "No" : "Yes");
+			ret = 0;
+		}
+		goto out;
+	}
+
+	/* The rest of the document wasn't even parsed */
+	if (head && head->passed) {
+		start_phase(stats, &start);
+		print_metadata(&head->ctx.metadata, NULL, out);
+		end_phase(stats, PHASE_SERIALIZE, &start);
 		goto out;
 	}
 
@@ -1038,41 +1979,130 @@ static int run_dangerous(int input_fd, int output_fd)
 	 */
 	escape_unicode_base_url();
 
-	article = parse(doc);
-	if (!article)
-		fatal_msg("no content could be extracted");
-	attach_metadata(article);
-
-	if (options.flags & OPT_HTML)
-		xmlShellPrintNode(article);
+	init_context(&ctx, options.flags, options.base_url);
+	ctx.stats = stats;
+	ctx.max_nodes = options.max_nodes;
+	ctx.deadline = deadline;
+	article = parse(&ctx, doc);
+	if (!article) {
+		char *error = "no content could be extracted";
+
+		ret = 1;
+		if (ctx.too_many_nodes) {
+			error = "the document has too many nodes";
+			ret = STATUS_TOO_MANY_NODES;
+		}
+		error_msg(error);
+		if (options.flags & OPT_JSON)
+			print_json_record(output_fp, options.url, &ctx.metadata, NULL, error);
+		goto clean;
+	}
+	/* Still print the article, but let the caller know about the problem */
+	if (ctx.out_of_time) {
+		error_msg("ran out of time, the article may be incomplete");
+		ret = STATUS_PARTIAL;
+	}
+	attach_metadata(&ctx.metadata, article);
+
+	/* The json record goes to the output file, so the parent knows it's there */
+	start_phase(stats, &start);
+	if (options.flags & OPT_JSON)
+		print_json_record(output_fp, options.url, &ctx.metadata, article, NULL);
+	else if (options.flags & OPT_HTML)
+		save_node_to_file(article, out);
 	else if (options.flags & OPT_METADATA)
-		print_metadata(doc);
+		print_metadata(&ctx.metadata, head ? NULL : doc, out);
+	else if (options.flags & (OPT_TEXT | OPT_MARKDOWN))
+		save_text_to_file(article, options.flags & OPT_MARKDOWN, out);
 	else
 		save_node_to_file(article, output_fp);
+	end_phase(stats, PHASE_SERIALIZE, &start);
 
+clean:
+	clean_context(&ctx);
 out:
 	/* Valgrind complains if I don't run these cleanups */
 	free_node(article);
 	free_doc(doc);
-	xmlCleanupParser();
-	clean_iconv();
 	return ret;
 }
 
 /**
- * Close and nullify a stream but return an open file descriptor for the file
+ * Send the stats for the document just processed to the parent
  */
-static int fclose_but_keep_fd(FILE **file)
+static void send_stats(int fd)
 {
-	int fd = fileno(*file);
-
-	fd = dup(fd);
-	if (fd < 0)
+	record_peak_rss(stats);
+	if (write(fd, stats, sizeof(*stats)) != sizeof(*stats))
 		fatal_errno();
+}
 
-	if (fclose(*file))
-		fatal_errno();
-	*file = NULL;
+/**
+ * Set up a sandbox and run all dangerous processing of the input HTML, which
+ * is received through the socket. With --stats, they are sent through their
+ * own descriptor at the end.
+ */
+static int run_dangerous(int sock, int output_fd, int stats_fd)
+{
+	struct readerable_check check;
+	struct readerable_check *checkp = NULL;
+	struct head_check head;
+	struct head_check *headp = NULL;
+	FILE *output_fp;
+	bool remote = options.url && !options.localfile;
+	htmlDocPtr doc;
+	int ret;
+
+	output_fp = fdopen(output_fd, "w");
+	if (!output_fp)
+		fatal_errno();
+
+	start_sandbox();
+	assert_sandbox_works();
+
+	if (options.flags & OPT_CHECK)
+		checkp = &check;
+	if (options.flags & OPT_FAST_METADATA)
+		headp = &head;
+	if (stats)
+		memset(stats, 0, sizeof(*stats)); /* The parent keeps its own copy */
+	doc = parse_stream(sock, checkp, headp);
+	if (doc) {
+		ret = process_document(doc, checkp, headp, stdout, output_fp, remote);
+	} else {
+		char *error = "the document is too large";
+
+		error_msg(error);
+		if (options.flags & OPT_JSON)
+			print_json_record(output_fp, options.url, NULL, NULL, error);
+		ret = STATUS_TOO_BIG;
+	}
+	if (checkp)
+		end_readerable_check(checkp);
+	if (headp)
+		end_head_check(headp);
+	if (stats)
+		send_stats(stats_fd);
+
+	xmlCleanupParser();
+	clean_iconv();
+	return ret;
+}
+
+/**
+ * Close and nullify a stream but return an open file descriptor for the file
+ */
+static int fclose_but_keep_fd(FILE **file)
+{
+	int fd = fileno(*file);
+
+	fd = dup(fd);
+	if (fd < 0)
+		fatal_errno();
+
+	if (fclose(*file))
+		fatal_errno();
+	*file = NULL;
 	return fd;
 }
 
@@ -1086,37 +2116,273 @@ static void clear_file(int fd)
 }
 
 /**
- * Fork a subprocess to run html parsing in a sandbox; return its exit status
+ * Lower a resource limit for this process, without trying to raise the hard
+ * limit if it was already below the new one
+ */
+static void lower_limit(int resource, rlim_t soft, rlim_t hard)
+{
+	struct rlimit lim;
+
+	if (getrlimit(resource, &lim))
+		fatal_errno();
+	lim.rlim_max = MIN(lim.rlim_max, hard);
+	lim.rlim_cur = MIN(lim.rlim_max, soft);
+	if (setrlimit(resource, &lim))
+		fatal_errno();
+}
+
+/**
+ * Apply the resource limits from the options to a new subprocess, before it
+ * sets up its sandbox. The parent kills the subprocess itself once past the
+ * deadline, so the limit on processor time is only a backstop; batch workers
+ * handle many documents, so they don't get one.
+ */
+static void set_child_limits(bool single_document)
+{
+	if (options.max_memory)
+		lower_limit(RLIMIT_AS, options.max_memory, options.max_memory);
+	if (options.deadline && single_document) {
+		/*
+		 * SIGXCPU at the soft limit, and SIGKILL if that gets ignored. Leave
+		 * an extra second, so that the parent gets to kill the child first.
+		 */
+		rlim_t secs = DEADLINE_KILL_FACTOR * options.deadline + 2;
+
+		lower_limit(RLIMIT_CPU, secs, secs + 1);
+	}
+}
+
+/**
+ * Convert the status reported by wait() to a shell-like exit status
+ */
+static int exit_status(int wstatus)
+{
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	if (WIFSIGNALED(wstatus))
+		return 128 + WTERMSIG(wstatus);
+	return 1;
+}
+
+#ifndef MSG_NOSIGNAL /* Not available on macOS, but there's no sandbox anyway */
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Send a buffer through the socket; return false if the peer is gone
+ */
+static bool send_full(int sock, const void *buf, size_t len)
+{
+	const char *pos = buf;
+
+	while (len) {
+		ssize_t ret = send(sock, pos, len, MSG_NOSIGNAL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EPIPE || errno == ECONNRESET))
+			return false;
+		if (ret < 0)
+			fatal_errno();
+		pos += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* Destination for the input document, as it's sent to the sandboxed child */
+struct child_stream {
+	int sock;
+	bool gone; /* The child stopped reading, so it must have failed */
+};
+
+/**
+ * Send a buffer to the child; return false if it's gone
+ */
+static bool send_to_child(struct child_stream *stream, const void *buf, size_t len)
+{
+	if (!stream->gone && !send_full(stream->sock, buf, len))
+		stream->gone = true;
+	return !stream->gone;
+}
+
+/**
+ * Write callback for libcurl, to send the webpage to the child as it arrives
+ */
+static size_t curl_to_child(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	/* Returning a short count makes libcurl give up on the transfer */
+	return send_to_child(data, ptr, size * nmemb) ? size * nmemb : 0;
+}
+
+/**
+ * Send the whole content of a stream to the child
+ */
+static void file_to_child(struct child_stream *stream, FILE *src)
+{
+	char *buf;
+
+	buf = malloc(STREAM_CHUNK_SIZE);
+	if (!buf)
+		fatal_errno();
+
+	while (!feof(src)) {
+		size_t ret;
+
+		ret = fread(buf, 1, STREAM_CHUNK_SIZE, src);
+		if (ferror(src))
+			fatal_msg("I/O error");
+		if (!send_to_child(stream, buf, ret))
+			break;
+	}
+	free(buf);
+}
+
+/**
+ * Send the HTML document to process to the child; return false on failure. If
+ * the child is gone, it's not a failure here: the child reports its own.
+ */
+static bool send_input_to_child(struct child_stream *stream)
+{
+	struct fetch fetch;
+	bool ret;
+
+	/* Prioritize local files over remote urls, like real browsers do */
+	if (options.localfile) {
+		file_to_child(stream, options.localfile);
+		return true;
+	}
+	if (!options.url) {
+		file_to_child(stream, stdin);
+		return true;
+	}
+
+	start_fetch(&fetch, get_curl_share(), options.url, curl_to_child, stream);
+	ret = finish_fetch(&fetch, curl_easy_perform(fetch.curl), &stream->gone);
+	return ret || stream->gone;
+}
+
+/* Child to kill once the alarm for the deadline goes off */
+static pid_t doomed_child;
+static volatile sig_atomic_t doomed_child_killed;
+
+/**
+ * Signal handler for the alarm: kill the child that went too far past the
+ * deadline. The parent may be stuck sending it the document, so this can't
+ * wait for a better moment.
+ */
+static void kill_doomed_child(int signum)
+{
+	(void)signum;
+	kill(doomed_child, SIGKILL);
+	doomed_child_killed = 1;
+}
+
+/**
+ * Set up an alarm to kill the child at the given monotonic time, even if that
+ * has passed already
+ */
+static void set_child_alarm(pid_t cpid, double kill_at)
+{
+	struct sigaction act = {.sa_handler = kill_doomed_child, .sa_flags = SA_RESTART};
+	struct itimerval timer = {0};
+	double left = MAX(kill_at - monotonic_seconds(), 0.001);
+
+	doomed_child = cpid;
+	doomed_child_killed = 0;
+	if (sigaction(SIGALRM, &act, NULL))
+		fatal_errno();
+	timer.it_value.tv_sec = left;
+	timer.it_value.tv_usec = (left - timer.it_value.tv_sec) * 1000000;
+	if (setitimer(ITIMER_REAL, &timer, NULL))
+		fatal_errno();
+}
+
+/**
+ * Cancel the alarm for the child, if any; return true if it already went off
+ * and killed it. The child may have exited on its own just before that.
+ */
+static bool clear_child_alarm(int wstatus)
+{
+	struct itimerval timer = {0};
+
+	if (setitimer(ITIMER_REAL, &timer, NULL))
+		fatal_errno();
+	return doomed_child_killed && WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGKILL;
+}
+
+/**
+ * Fork a subprocess to run html parsing in a sandbox, and stream the input
+ * document to it; return its exit status. The monotonic time when the document
+ * was requested is needed for the deadline.
  */
-static int fork_and_run_dangerous(FILE **input_fp, FILE **output_fp)
+static int stream_and_run_dangerous(FILE **output_fp, double requested)
 {
+	struct child_stream stream = {0};
+	struct rdr_stats parent_stats = {0};
+	struct rdr_stats child_stats = {0};
+	struct phase_time start;
 	pid_t cpid;
 	int wstatus;
-	int input_fd, output_fd;
+	int output_fd;
+	int sv[2];
+	int stats_pipe[2] = {-1, -1};
+	bool sent;
+	bool killed;
 
-	/* The files are shared with the child, which invalidates the streams */
-	input_fd = fclose_but_keep_fd(input_fp);
+	/* The file is shared with the child, which invalidates the stream */
 	output_fd = fclose_but_keep_fd(output_fp);
 
 	/* Prepare the file to receive new output from the child */
 	clear_file(output_fd);
 
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		fatal_errno();
+	if (stats && pipe(stats_pipe))
+		fatal_errno();
+
+	/* Don't let the child inherit buffered output, it would get printed twice */
+	fflush(stdout);
+
 	cpid = fork();
 	if (cpid < 0) {
 		fatal_errno();
 	} else if (!cpid) { /* Sandboxed subprocess */
+		close(sv[0]);
+		if (stats)
+			close(stats_pipe[0]);
+		close_curl_sockets();
 		free(tmpdir);
 		tmpdir = NULL; /* Otherwise the child would remove it on exit */
-		exit(run_dangerous(input_fd, output_fd));
-	} else if (wait(&wstatus) < 0) {
-		fatal_errno();
+		set_child_limits(true);
+		exit(run_dangerous(sv[1], output_fd, stats_pipe[1]));
 	}
-
-	/* Prepare the input file in case we need to download a new document */
-	clear_file(input_fd);
-	*input_fp = fdopen(input_fd, "w+");
-	if (!*input_fp)
+	close(sv[1]);
+	if (stats)
+		close(stats_pipe[1]);
+	if (options.deadline)
+		set_child_alarm(cpid, requested + DEADLINE_KILL_FACTOR * options.deadline + 1);
+
+	stream.sock = sv[0];
+	start_phase(stats, &start);
+	sent = send_input_to_child(&stream);
+	end_phase(stats ? &parent_stats : NULL, PHASE_FETCH, &start);
+	/* Kill the child before it sees the end of a partial document */
+	if (!sent && kill(cpid, SIGKILL))
 		fatal_errno();
+	close(sv[0]);
+	if (waitpid(cpid, &wstatus, 0) < 0)
+		fatal_errno();
+	killed = options.deadline && clear_child_alarm(wstatus);
+
+	/* The child may have died before sending anything, but that's fine */
+	if (stats) {
+		if (!read_full(stats_pipe[0], &child_stats, sizeof(child_stats)))
+			memset(&child_stats, 0, sizeof(child_stats));
+		add_stats(stats, &parent_stats);
+		add_stats(stats, &child_stats);
+		close(stats_pipe[0]);
+	}
 
 	/* Prepare the output file in case we need to read it */
 	*output_fp = fdopen(output_fd, "w+");
@@ -1124,85 +2390,974 @@ static int fork_and_run_dangerous(FILE **input_fp, FILE **output_fp)
 		fatal_errno();
 	rewind(*output_fp);
 
-	if (WIFEXITED(wstatus))
-		return WEXITSTATUS(wstatus);
-	if (WIFSIGNALED(wstatus))
-		return 128 + WTERMSIG(wstatus);
-	return 1;
+	if (!sent)
+		return 1;
+	if (killed || (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGXCPU)) {
+		/* Whatever the child wrote may be cut short */
+		clear_file(output_fd);
+		error_msg("the document took too long, so it was abandoned");
+		return STATUS_TIMED_OUT;
+	}
+	return exit_status(wstatus);
 }
 
 /**
- * Update the url in the options with the contents of the file
+ * Read the whole contents of a file into a new null-terminated buffer; return
+ * NULL if the file is empty. The size argument is set to the length read.
  */
-static void update_url_from_file(FILE *file)
+static char *read_file_contents(int fd, size_t *size)
 {
-	int fd = fileno(file);
 	struct stat statbuf;
-	size_t size, ret;
+	char *buf;
+	size_t done = 0;
 
 	if (fstat(fd, &statbuf))
 		fatal_errno();
-	size = statbuf.st_size;
-	if (!size)
-		fatal_msg("the document has an html redirect without a target url");
+	*size = statbuf.st_size;
+	if (!*size)
+		return NULL;
 
-	free(options.url);
-	options.url = malloc(size);
-	if (!options.url)
+	buf = malloc(*size + 1);
+	if (!buf)
 		fatal_errno();
+	while (done < *size) {
+		ssize_t ret = pread(fd, buf + done, *size - done, done);
 
-	ret = fread(options.url, 1, size, file);
-	if (ret < size)
-		fatal_msg("I/O error");
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			fatal_errno();
+		if (!ret) /* The file got truncated somehow */
+			break;
+		done += ret;
+	}
+	buf[done] = '\0';
+	*size = done;
+	return buf;
+}
+
+/**
+ * Get the url saved by the child to the output file for an html redirect;
+ * return NULL if there is none.
+ */
+static char *read_redirect_url(int fd)
+{
+	size_t size;
+	char *url;
+
+	url = read_file_contents(fd, &size);
+	if (!url || !size) {
+		free(url);
+		error_msg("the document has an html redirect without a target url");
+		return NULL;
+	}
 
 	/*
 	 * The url in the output file should be null-terminated already, but it
 	 * comes from the sandboxed child so it's not trustworthy.
 	 */
-	options.url[size - 1] = '\0';
+	url[size - 1] = '\0';
+	return url;
+}
+
+/**
+ * Make the url of an html redirect the next input to process; the string will
+ * be freed later.
+ */
+static void set_redirect_input(char *url)
+{
+	set_input(NULL);
+	options.url = url;
 
 	/* TODO: don't ignore the user-supplied base url for html redirects */
 	options.base_url = options.url;
 }
 
+/**
+ * Update the url in the options with the contents of the file; return false
+ * if the file has no url.
+ */
+static bool update_url_from_file(FILE *file)
+{
+	char *url = read_redirect_url(fileno(file));
+
+	if (!url)
+		return false;
+	set_redirect_input(url);
+	return true;
+}
+
+/**
+ * Run the whole extraction for the current input document, following any html
+ * redirects; return the exit status of the last child.
+ */
+static int process_input(FILE **output_fp)
+{
+	double requested = monotonic_seconds();
+	int ret;
+
+	if (options.deadline)
+		deadline = requested + options.deadline;
+	do {
+		ret = stream_and_run_dangerous(output_fp, requested);
+		/*
+		 * If the child finds an html redirect, it saves the url to the output
+		 * file and returns STATUS_HTML_REDIRECT.
+		 */
+		if (ret == STATUS_HTML_REDIRECT && !update_url_from_file(*output_fp)) {
+			clear_file(fileno(*output_fp)); /* Not a real output */
+			return 1;
+		}
+	} while (ret == STATUS_HTML_REDIRECT);
+	return ret;
+}
+
+/*
+ * Header for each job sent to a batch worker; the url and the base url come
+ * right after it, in that order.
+ */
+struct job_request {
+	size_t input_size;
+	size_t url_len; /* Includes the null termination; zero if no url */
+	size_t base_url_len; /* Includes the null termination */
+	bool remote; /* The document was downloaded, so redirects are allowed */
+	double deadline; /* Monotonic time to stop new extraction attempts, or zero */
+};
+
+/**
+ * Receive a null-terminated string of the given length from the socket
+ */
+static char *read_string(int sock, size_t len)
+{
+	char *str;
+
+	str = malloc(len);
+	if (!str)
+		fatal_errno();
+	if (!read_full(sock, str, len))
+		fatal_msg("the batch job request was cut short");
+	str[len - 1] = '\0';
+	return str;
+}
+
+/**
+ * Main loop for a batch worker: set up the sandbox once, and then process each
+ * document requested through the socket until the parent closes it. The input
+ * file is mapped again for every document, and the results go to stdout,
+ * which must be the output file.
+ */
+__attribute__((noreturn)) static void run_worker(int sock, int input_fd)
+{
+	struct job_request req;
+	struct readerable_check check;
+	struct readerable_check *checkp = NULL;
+	struct head_check head;
+	struct head_check *headp = NULL;
+
+	start_sandbox();
+	assert_sandbox_works();
+
+	if (options.flags & OPT_CHECK)
+		checkp = &check;
+	if (options.flags & OPT_FAST_METADATA)
+		headp = &head;
+	while (read_full(sock, &req, sizeof(req))) {
+		char *url = NULL;
+		char *base_url;
+		char *map;
+		htmlDocPtr doc;
+		int status;
+
+		if (stats)
+			memset(stats, 0, sizeof(*stats));
+		if (req.url_len)
+			url = read_string(sock, req.url_len);
+		base_url = read_string(sock, req.base_url_len);
+		options.url = url;
+		options.base_url = base_url;
+		deadline = req.deadline;
+
+		/* The parent checks the size, because fstat() may not be allowed */
+		map = mmap(NULL, req.input_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, input_fd, 0);
+		if (map == MAP_FAILED)
+			fatal_errno();
+		doc = parse_mapped_file(map, req.input_size, checkp, headp);
+		munmap(map, req.input_size);
+		status = process_document(doc, checkp, headp, stdout, stdout, req.remote);
+		if (checkp)
+			end_readerable_check(checkp);
+		if (headp)
+			end_head_check(headp);
+		if (fflush(stdout))
+			fatal_errno();
+		if (write(sock, &status, sizeof(status)) != sizeof(status))
+			fatal_errno();
+		if (stats) /* Right after the status */
+			send_stats(sock);
+
+		if (options.base_url != base_url)
+			xmlFree((char *)options.base_url);
+		free(base_url);
+		free(url);
+		options.url = NULL;
+	}
+
+	xmlCleanupParser();
+	clean_iconv();
+	exit(0);
+}
+
+/**
+ * Start the subprocess for a batch worker, connected to the parent through a
+ * new socket
+ */
+static void start_worker(struct worker *wk)
+{
+	int sv[2];
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		fatal_errno();
+
+	/* Don't let the child inherit buffered output, it would get printed twice */
+	fflush(stdout);
+
+	wk->pid = fork();
+	if (wk->pid < 0)
+		fatal_errno();
+	if (wk->pid) {
+		close(sv[1]);
+		wk->sock = sv[0];
+		return;
+	}
+
+	free(tmpdir);
+	tmpdir = NULL; /* Otherwise the child would remove it on exit */
+
+	/* Each job sends its own url, so this copy would only leak */
+	free(options.url);
+	options.url = NULL;
+
+	/*
+	 * The sandbox still allows writes to any open descriptor, so close all
+	 * those that belong to the other workers. The input list is closed as
+	 * well, because exit() could otherwise mess with its file offset.
+	 */
+	close(sv[0]);
+	for (i = 0; i < options.workers; ++i) {
+		if (&workers[i] == wk)
+			continue;
+		if (workers[i].sock >= 0)
+			close(workers[i].sock);
+		close(fileno(workers[i].input_fp));
+		close(fileno(workers[i].output_fp));
+	}
+	if (batch_list)
+		close(fileno(batch_list));
+	close_curl_sockets();
+	close(STDIN_FILENO);
+	if (dup2(fileno(wk->output_fp), STDOUT_FILENO) < 0)
+		fatal_errno();
+	close(fileno(wk->output_fp));
+
+	set_child_limits(false);
+	run_worker(sv[1], fileno(wk->input_fp));
+}
+
+/**
+ * Wait for a worker subprocess to terminate; return its exit status
+ */
+static int reap_worker(struct worker *wk)
+{
+	int wstatus;
+
+	close(wk->sock);
+	wk->sock = -1;
+	if (waitpid(wk->pid, &wstatus, 0) < 0)
+		fatal_errno();
+	wk->pid = 0;
+	return exit_status(wstatus);
+}
+
+/**
+ * Send a job request to a worker, for the document in its input file; return
+ * false if the worker is gone
+ */
+static bool send_request(struct worker *wk, const struct job_request *req)
+{
+	if (!send_full(wk->sock, req, sizeof(*req)))
+		return false;
+	if (req->url_len && !send_full(wk->sock, options.url, req->url_len))
+		return false;
+	return send_full(wk->sock, options.base_url, req->base_url_len);
+}
+
+/**
+ * Work out the key for the result of a job from its document, in the given
+ * input file, and the settings for the request; if the result is already in
+ * the cache, complete the job with it and return true.
+ */
+static bool find_cached_result(struct job *job, int input_fd, const struct job_request *req)
+{
+	const char *output;
+	char *settings;
+	char *map;
+	size_t len;
+
+	map = mmap(NULL, req->input_size, PROT_READ, MAP_SHARED, input_fd, 0);
+	if (map == MAP_FAILED)
+		fatal_errno();
+	/* All other options that affect the result are the same for the whole batch */
+	settings = mkstring("%s\n%s\n%d", options.base_url, options.url ? options.url : "",
+			    req->remote);
+	get_result_key(&job->key, map, req->input_size, settings);
+	free(settings);
+	munmap(map, req->input_size);
+
+	output = find_result(results, &job->key, &len);
+	if (!output)
+		return false;
+	job->output = len ? malloc(len + 1) : NULL;
+	if (len && !job->output)
+		fatal_errno();
+	if (len) {
+		memcpy(job->output, output, len);
+		job->output[len] = '\0';
+	}
+	job->output_len = len;
+	job->status = 0;
+	job->done = true;
+	return true;
+}
+
+/**
+ * Get the url for the webpage of a job
+ */
+static const char *job_url(const struct job *job)
+{
+	return job->url ? job->url : job->input;
+}
+
+/**
+ * Should the webpage for this url be downloaded ahead of time? Local files
+ * are preferred over remote urls, like in set_input().
+ */
+static bool needs_prefetch(const char *url)
+{
+	return multi && is_http_url(url) && access(url, R_OK) != 0;
+}
+
+/**
+ * Write callback for libcurl, to keep a webpage downloaded ahead of time in
+ * the memory of its job
+ */
+static size_t append_to_body(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct job *job = data;
+	size_t len = size * nmemb;
+
+	if (options.max_size && job->body_len + len > options.max_size) {
+		job->too_big = true;
+		return 0; /* Makes libcurl give up on the transfer */
+	}
+	if (job->body_len + len > job->body_size) {
+		job->body_size = MAX(2 * job->body_size, job->body_len + len);
+		job->body = realloc(job->body, job->body_size);
+		if (!job->body)
+			fatal_errno();
+	}
+	memcpy(job->body + job->body_len, ptr, len);
+	job->body_len += len;
+	return len;
+}
+
+/**
+ * Start the download of the webpage for a job, along with the others
+ */
+static void start_prefetch(struct job *job)
+{
+	job->fetch = malloc(sizeof(*job->fetch));
+	if (!job->fetch)
+		fatal_errno();
+	/* The multi handle has its own pool, the only one with per-host limits */
+	start_fetch(job->fetch, NULL, job_url(job), append_to_body, job);
+	if (curl_easy_setopt(job->fetch->curl, CURLOPT_PRIVATE, job))
+		fatal();
+	if (curl_multi_add_handle(multi, job->fetch->curl))
+		fatal();
+	job->state = JOB_FETCHING;
+	++active_fetches;
+}
+
+/**
+ * Make progress on all the downloads, and make ready the jobs whose webpages
+ * are complete; those that failed are done already.
+ */
+static void run_prefetches(void)
+{
+	CURLMsg *msg;
+	int running, left;
+
+	if (curl_multi_perform(multi, &running))
+		fatal();
+	while ((msg = curl_multi_info_read(multi, &left))) {
+		CURL *curl = msg->easy_handle;
+		CURLcode res = msg->data.result;
+		struct job *job;
+		char *private;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		if (curl_easy_getinfo(curl, CURLINFO_PRIVATE, &private))
+			fatal();
+		job = (struct job *)private;
+		if (stats) {
+			/* The processor time is shared by all downloads */
+			curl_off_t usecs;
+
+			if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &usecs))
+				fatal();
+			job->stats.phases[PHASE_FETCH].wall += usecs / 1e6;
+		}
+		if (curl_multi_remove_handle(multi, curl))
+			fatal();
+		--active_fetches;
+
+		if (finish_fetch(job->fetch, res, &job->too_big)) {
+			job->prefetched = true;
+			job->state = JOB_READY;
+		} else {
+			job->status = 1;
+			if (job->too_big) {
+				error_msg("the document is too large");
+				job->status = STATUS_TOO_BIG;
+			}
+			job->done = true;
+			job->state = JOB_DISPATCHED;
+		}
+		free(job->fetch);
+		job->fetch = NULL;
+	}
+}
+
+/**
+ * Save the document for a job to the input file of an idle worker, and send
+ * the request; return 0 on success, or the exit status for the job if it
+ * failed before that.
+ */
+static int dispatch_job(struct worker *wk, struct job *job)
+{
+	struct job_request req = {0};
+	struct stat statbuf;
+	struct phase_time start;
+	bool saved;
+
+	/*
+	 * The time spent waiting for a free worker doesn't count against the
+	 * deadline, but any download that still needs to happen here does
+	 */
+	job->start = monotonic_seconds();
+	if (job->url) {
+		char *url = strdup(job->url);
+
+		if (!url)
+			fatal_errno();
+		set_redirect_input(url);
+	} else {
+		set_input(job->input);
+	}
+
+	clear_stream(wk->input_fp);
+	if (job->prefetched) {
+		if (job->body_len)
+			fwrite(job->body, 1, job->body_len, wk->input_fp);
+		if (ferror(wk->input_fp))
+			fatal_msg("I/O error");
+		if (fflush(wk->input_fp))
+			fatal_errno();
+		free(job->body);
+		job->body = NULL;
+		job->body_len = job->body_size = 0;
+		job->prefetched = false;
+	} else {
+		start_phase(stats, &start);
+		saved = save_input_to_file(wk->input_fp);
+		end_phase(stats ? &job->stats : NULL, PHASE_FETCH, &start);
+		if (!saved)
+			return 1;
+	}
+	if (fstat(fileno(wk->input_fp), &statbuf))
+		fatal_errno();
+	if (!statbuf.st_size) {
+		error_msg("the document is empty");
+		return 1;
+	}
+	/* The worker maps the whole file, so check before it gets there */
+	if (options.max_size && (size_t)statbuf.st_size > options.max_size) {
+		error_msg("the document is too large");
+		return STATUS_TOO_BIG;
+	}
+	clear_file(fileno(wk->output_fp));
+
+	req.input_size = statbuf.st_size;
+	req.url_len = options.url ? strlen(options.url) + 1 : 0;
+	req.base_url_len = strlen(options.base_url) + 1;
+	req.remote = options.url && !options.localfile;
+	if (options.deadline)
+		req.deadline = job->start + options.deadline;
+
+	if (results && find_cached_result(job, fileno(wk->input_fp), &req))
+		return 0; /* No need for the worker */
+
+	if (!wk->pid)
+		start_worker(wk);
+	if (!send_request(wk, &req)) {
+		/* The worker died while idle, somehow; give it one more chance */
+		reap_worker(wk);
+		start_worker(wk);
+		if (!send_request(wk, &req))
+			fatal_msg("the batch workers keep dying");
+	}
+
+	wk->job = job;
+	if (clock_gettime(CLOCK_MONOTONIC, &wk->start))
+		fatal_errno();
+	return 0;
+}
+
+/**
+ * Save the output of the worker for the job that it just completed, and free
+ * the worker for a new one. If the worker died or was killed, whatever it had
+ * written is thrown away, because it may be cut short.
+ */
+static void complete_job(struct worker *wk, int status, bool dead)
+{
+	struct job *job = wk->job;
+
+	wk->job = NULL;
+	if (dead) {
+		clear_file(fileno(wk->output_fp));
+		job->status = status;
+		job->done = true;
+		return;
+	}
+	if (status == STATUS_HTML_REDIRECT) {
+		char *url = read_redirect_url(fileno(wk->output_fp));
+
+		job->status = 1;
+		if (url) {
+			free(job->url);
+			job->url = url;
+			if (needs_prefetch(url)) {
+				job->state = JOB_QUEUED;
+				return;
+			}
+			job->status = dispatch_job(wk, job);
+			if (!job->status)
+				return;
+		}
+		job->done = true;
+		return; /* The output file has no real output for the job */
+	}
+
+	job->output = read_file_contents(fileno(wk->output_fp), &job->output_len);
+	job->status = status;
+	job->done = true;
+
+	/* Failures may not happen again, and their error messages would be lost */
+	if (results && !status)
+		save_result(results, &job->key, job->output, job->output_len);
+}
+
+/**
+ * Collect the results from a worker whose socket is ready for reading
+ */
+static void collect_from_worker(struct worker *wk)
+{
+	struct rdr_stats job_stats;
+	int status;
+	bool dead = false;
+
+	if (!read_full(wk->sock, &status, sizeof(status)) ||
+	    (stats && !read_full(wk->sock, &job_stats, sizeof(job_stats)))) {
+		/* The worker died, so report its exit status and replace it */
+		status = reap_worker(wk);
+		if (!status || status == STATUS_HTML_REDIRECT)
+			status = 1;
+		dead = true;
+	} else if (stats) {
+		add_stats(&wk->job->stats, &job_stats);
+	}
+	complete_job(wk, status, dead);
+}
+
+/**
+ * Get rid of a worker that is taking too long with its job
+ */
+static void kill_worker(struct worker *wk)
+{
+	fprintf(stderr, "%s: timed out on %s\n", progname, wk->job->input);
+	if (kill(wk->pid, SIGKILL))
+		fatal_errno();
+	reap_worker(wk);
+	complete_job(wk, STATUS_TIMED_OUT, true);
+}
+
+/**
+ * Return the milliseconds left before the worker's job times out. A deadline
+ * counts from the dispatch of the job, so it covers any download not done
+ * ahead of time.
+ */
+static long worker_time_left(struct worker *wk, const struct timespec *now)
+{
+	long timeout = WORKER_TIMEOUT * 1000L;
+	long elapsed;
+
+	if (options.deadline) {
+		timeout = (DEADLINE_KILL_FACTOR * options.deadline + 1) * 1000;
+		elapsed = (now->tv_sec + now->tv_nsec / 1e9 - wk->job->start) * 1000;
+	} else {
+		elapsed = (now->tv_sec - wk->start.tv_sec) * 1000;
+		elapsed += (now->tv_nsec - wk->start.tv_nsec) / 1000000;
+	}
+	return MAX(timeout - elapsed, 0);
+}
+
+/**
+ * Wait until at least one of the busy workers has completed its job, or taken
+ * too long with it, or until there is progress on the downloads
+ */
+static void wait_for_workers(void)
+{
+	static struct pollfd *fds;
+	static struct curl_waitfd *waitfds;
+	static int *idxs;
+	struct timespec now;
+	long timeout = -1;
+	int i, nfds = 0;
+
+	if (!fds) {
+		fds = calloc(options.workers, sizeof(*fds));
+		waitfds = calloc(options.workers, sizeof(*waitfds));
+		idxs = calloc(options.workers, sizeof(*idxs));
+		if (!fds || !waitfds || !idxs)
+			fatal_errno();
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		fatal_errno();
+	for (i = 0; i < options.workers; ++i) {
+		long left;
+
+		if (!workers[i].job)
+			continue;
+		fds[nfds].fd = workers[i].sock;
+		fds[nfds].events = POLLIN;
+		idxs[nfds++] = i;
+
+		left = worker_time_left(&workers[i], &now);
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+	if (!nfds && !active_fetches)
+		return;
+
+	if (active_fetches) {
+		/* Let libcurl wait on the workers along with its own sockets */
+		for (i = 0; i < nfds; ++i) {
+			waitfds[i].fd = fds[i].fd;
+			waitfds[i].events = CURL_WAIT_POLLIN;
+			waitfds[i].revents = 0;
+		}
+		/* Without busy workers, any timeout will do; this runs in a loop */
+		if (curl_multi_wait(multi, waitfds, nfds, timeout < 0 ? 1000 : timeout, NULL))
+			fatal();
+		for (i = 0; i < nfds; ++i)
+			fds[i].revents = waitfds[i].revents;
+		run_prefetches();
+	} else if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+		fatal_errno();
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		fatal_errno();
+	for (i = 0; i < nfds; ++i) {
+		struct worker *wk = &workers[idxs[i]];
+
+		if (fds[i].revents)
+			collect_from_worker(wk);
+		else if (!worker_time_left(wk, &now))
+			kill_worker(wk);
+	}
+}
+
+/**
+ * Set up the temporary files for all the batch workers; the subprocesses are
+ * only started when needed.
+ */
+static void create_workers(void)
+{
+	int i;
+
+	workers = calloc(options.workers, sizeof(*workers));
+	if (!workers)
+		fatal_errno();
+
+	for (i = 0; i < options.workers; ++i) {
+		struct worker *wk = &workers[i];
+		char *name;
+
+		wk->sock = -1;
+		name = mkstring("input-%d.html", i);
+		wk->input_fp = new_temp_file(name, &wk->inputfile, false);
+		free(name);
+		name = mkstring("output-%d.html", i);
+		wk->output_fp = new_temp_file(name, &wk->outputfile, false);
+		free(name);
+	}
+}
+
+/**
+ * Close the sockets for all workers so that they exit, and wait for them
+ */
+static void stop_workers(void)
+{
+	int i;
+
+	for (i = 0; i < options.workers; ++i) {
+		if (workers[i].pid)
+			reap_worker(&workers[i]);
+	}
+}
+
+/**
+ * Return an idle worker, or NULL if they are all busy
+ */
+static struct worker *get_idle_worker(void)
+{
+	int i;
+
+	for (i = 0; i < options.workers; ++i) {
+		if (!workers[i].job)
+			return &workers[i];
+	}
+	return NULL;
+}
+
+/**
+ * Get the next input from a newline-separated list; return NULL at the end.
+ * Blank lines are ignored.
+ */
+static char *read_batch_line(FILE *list, char **line, size_t *n)
+{
+	ssize_t len;
+
+	while ((len = getline(line, n, list)) >= 0) {
+		while (len && isspace((unsigned char)(*line)[len - 1]))
+			(*line)[--len] = '\0';
+		if (len)
+			return *line;
+	}
+	if (ferror(list))
+		fatal_msg("I/O error");
+	return NULL;
+}
+
+/**
+ * Print the header and the output for a completed job, and free its memory;
+ * return 0 if the job succeeded, 1 otherwise.
+ */
+static int print_job_result(struct job *job)
+{
+	int ret = 0;
+
+	if (options.flags & OPT_JSON) {
+		print_json_output(job->input, job->output, job->output_len, job->status);
+	} else {
+		printf("==> %s <==\n", job->input);
+		if (job->output_len)
+			fwrite(job->output, 1, job->output_len, stdout);
+	}
+	fflush(stdout); /* Keep the output ahead of any error messages */
+	if (ferror(stdout))
+		fatal_msg("I/O error");
+	if (job->status == STATUS_PARTIAL)
+		fprintf(stderr, "%s: the result may be incomplete for %s\n", progname, job->input);
+	else if (job->status)
+		fprintf(stderr, "%s: failed to process %s\n", progname, job->input);
+	if (job->status)
+		ret = 1;
+	if (stats) {
+		print_stats_record(job->input, &job->stats, 1);
+		add_stats(stats, &job->stats);
+	}
+
+	free(job->input);
+	free(job->url);
+	free(job->body); /* Only left over if the download failed */
+	free(job->output);
+	return ret;
+}
+
+/**
+ * Run the extraction for each input in a batch, using a pool of workers, and
+ * print the results in order with a header before each one; return 0 if they
+ * all succeeded, 1 otherwise. The inputs are taken from the null-terminated
+ * array if it's not empty, or from the list file otherwise.
+ */
+static int process_batch(char *inputs[])
+{
+	struct job *jobs; /* Ring buffer for the jobs not yet printed */
+	unsigned long window, next_job = 0, next_print = 0;
+	char *line = NULL;
+	size_t n = 0;
+	bool more = true;
+	int ret = 0;
+
+	if (!*inputs) {
+		batch_list = stdin;
+		if (options.batch_list && strcmp(options.batch_list, "-") != 0) {
+			batch_list = fopen(options.batch_list, "r");
+			if (!batch_list)
+				fatal_errno();
+		}
+	}
+
+	/* Don't hold on to too many results only because one job is slow */
+	window = 4 * options.workers + options.fetches;
+	jobs = calloc(window, sizeof(*jobs));
+	if (!jobs)
+		fatal_errno();
+	create_workers();
+	if (options.result_cache)
+		results = new_result_cache(options.result_cache);
+	if (options.fetches) {
+		multi = curl_multi_init();
+		if (!multi)
+			fatal_msg("libcurl could not be initialized");
+		if (curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)options.fetches_per_host))
+			fatal();
+	}
+
+	while (more || next_print < next_job) {
+		struct worker *wk;
+		unsigned long i;
+
+		/* Read ahead only as far as there is something to do with the inputs */
+		while (more && next_job - next_print < window &&
+		       (get_idle_worker() || active_fetches < options.fetches)) {
+			struct job *job = &jobs[next_job % window];
+			const char *input;
+
+			if (batch_list)
+				input = read_batch_line(batch_list, &line, &n);
+			else
+				input = *inputs ? *inputs++ : NULL;
+			if (!input) {
+				more = false;
+				break;
+			}
+
+			memset(job, 0, sizeof(*job));
+			job->input = strdup(input);
+			if (!job->input)
+				fatal_errno();
+			job->state = needs_prefetch(input) ? JOB_QUEUED : JOB_READY;
+			++next_job;
+		}
+
+		/* Start the downloads and the extractions in the input order */
+		for (i = next_print; i < next_job; ++i) {
+			struct job *job = &jobs[i % window];
+
+			if (job->state == JOB_QUEUED && active_fetches < options.fetches) {
+				start_prefetch(job);
+			} else if (job->state == JOB_READY && (wk = get_idle_worker())) {
+				job->state = JOB_DISPATCHED;
+				job->status = dispatch_job(wk, job);
+				if (job->status)
+					job->done = true;
+			}
+		}
+
+		while (next_print < next_job && jobs[next_print % window].done)
+			ret |= print_job_result(&jobs[next_print++ % window]);
+		if (next_print < next_job)
+			wait_for_workers();
+	}
+
+	stop_workers();
+	if (multi)
+		curl_multi_cleanup(multi);
+	multi = NULL;
+	if (stats) /* The totals for the whole batch */
+		print_stats_record(NULL, stats, next_print);
+	if (results)
+		free_result_cache(results);
+	set_input(NULL);
+	free(jobs);
+	free(line);
+	if (batch_list && batch_list != stdin)
+		fclose(batch_list);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
-	FILE *input_fp, *output_fp;
+	FILE *output_fp;
 	static char *command = NULL; /* Static for the sake of valgrind */
+	int first_arg;
 	int ret;
 
 	LIBXML_TEST_VERSION
 	/* I made a mess mixing xmlMalloc() and malloc(), so play it safe here */
 	if (xmlMemSetup(free, malloc, realloc, strdup))
 		fatal();
+	/*
+	 * Older versions of libxml2 report the encoding errors without a parser
+	 * context, so HTML_PARSE_NOERROR is not enough to silence them.
+	 */
+	xmlSetGenericErrorFunc(NULL, ignore_xml_error);
 
 	set_cleanup_handlers();
-	parse_arguments(argc, argv);
+	first_arg = parse_arguments(argc, argv);
+	if (options.flags & OPT_STATS) {
+		static struct rdr_stats main_stats;
 
-	inputfile = get_temp_filepath("input.html");
-	outputfile = get_temp_filepath("output.html");
-	input_fp = fopen(inputfile, "w+");
-	output_fp = fopen(outputfile, "w+");
-	if (!input_fp || !output_fp)
-		fatal_msg("failed to create the temporary files");
+		stats = &main_stats;
+	}
+
+	/* Pay for these only once, all children will inherit the results */
+	init_iconv();
+	init_regexes();
+
+	if (options.batch)
+		return process_batch(&argv[first_arg]);
+
+	/* Only the browser needs to open the output file on its own */
+	output_fp = new_temp_file("output.html", &outputfile, options.flags & OPT_BROWSER);
 
 	/* Do this before the fork to avoid wasting time if there is no browser */
 	if (options.flags & OPT_BROWSER)
 		command = get_browser_command(outputfile);
 
-	init_iconv();
-	do {
-		save_input_to_file(input_fp);
-		ret = fork_and_run_dangerous(&input_fp, &output_fp);
-		/*
-		 * If the child finds an html redirect, it saves the url to the output
-		 * file and returns STATUS_HTML_REDIRECT.
-		 */
-		if (ret == STATUS_HTML_REDIRECT)
-			update_url_from_file(output_fp);
-	} while (ret == STATUS_HTML_REDIRECT);
+	ret = process_input(&output_fp);
+	if (options.flags & OPT_JSON) {
+		char *output;
+		size_t len;
 
-	if (!ret && (options.flags & OPT_BROWSER))
-		ret = run_browser_command(command);
+		output = read_file_contents(fileno(output_fp), &len);
+		print_json_output(options.url, output, len, ret);
+		free(output);
+	}
+	if (stats) /* A NULL input would look like the totals for a batch */
+		print_stats_record(options.url ? options.url : "-", stats, 1);
+	/* An incomplete article is still worth a look */
+	if ((!ret || ret == STATUS_PARTIAL) && (options.flags & OPT_BROWSER)) {
+		int err = run_browser_command(command);
+
+		if (err)
+			ret = err;
+	}
 	return ret;
 }
@@ -1,5 +1,5 @@
 /*
- * The single header file for rdrview
+ * The internal header file for rdrview, the library API is in librdrview.h
  *
  * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  *
@@ -32,6 +32,7 @@
 #include <regex.h>
 #include <libxml/HTMLtree.h>
 #include <libxml/debugXML.h>
+#include "librdrview.h"
 
 /* The Incapsula CDN demands user-agent strings of a certain form */
 #define RDRVIEW_DEFAULT_USER_AGENT "Mozilla/5.0 rdrview/0.1.3"
@@ -47,37 +48,143 @@ struct options {
 	const char *agent;
 	char *url;
 	FILE *localfile; /* Used only if the "url" is actually a local path */
+	bool batch; /* Process a whole list of inputs */
+	const char *batch_list; /* File with the list of inputs, or NULL */
+	int workers; /* Number of subprocesses for batch mode */
+	const char *cache_dir; /* Directory for the http cache, or NULL */
+	size_t result_cache; /* Size limit for the batch result cache, or zero */
+	int fetches; /* Concurrent downloads for batch mode, or zero for none */
+	int fetches_per_host; /* Limit on the concurrent downloads from one host */
+	size_t max_size; /* Refuse bigger inputs, in bytes; zero for no limit */
+	unsigned long max_nodes; /* Refuse documents with more nodes, or zero */
+	double deadline; /* Seconds for the extraction attempts, or zero */
+	size_t max_memory; /* Address space limit for the subprocesses, or zero */
 };
 extern struct options options;
 
-/* Flags for the options struct */
+/* Flags for the options struct; bits 4 to 9 are for the extraction itself */
 #define OPT_HTML (1 << 0) /* Output the html for the article */
 #define OPT_METADATA (1 << 1) /* Output the metadata for the article */
 #define OPT_CHECK (1 << 2) /* Check if the doc looks readerable and exit */
 #define OPT_BROWSER (1 << 3) /* Open the article in a browser */
-#define OPT_URL_OVERRIDE (1 << 4) /* Override the base url */
-#define OPT_STRIP_UNLIKELY (1 << 5) /* Remove unlikely nodes early */
-#define OPT_WEIGHT_CLASSES (1 << 6) /* Consider classes for node score */
-#define OPT_CLEAN_CONDITIONALLY (1 << 7) /* Remove fishy nodes on prep */
-#define OPT_PRESERVE_CLASSES (1 << 8) /* Preserve class attributes */
+#define OPT_TEXT (1 << 10) /* Output the article as plain text */
+#define OPT_MARKDOWN (1 << 11) /* Output the article as markdown */
+#define OPT_JSON (1 << 12) /* Output the article and metadata as json */
+#define OPT_STATS (1 << 13) /* Report the timing of each phase to stderr */
+#define OPT_FAST_METADATA (1 << 14) /* Take the metadata from the head if possible */
+
+/* Exit statuses for the outcome of a document, other than success or failure */
+#define STATUS_HTML_REDIRECT 2 /* Only between processes, the child found a redirect */
+#define STATUS_TOO_BIG 3 /* The input is larger than --max-size */
+#define STATUS_TOO_MANY_NODES 4 /* The document has more nodes than --max-nodes */
+#define STATUS_PARTIAL 5 /* The deadline cut the extraction attempts short */
+#define STATUS_TIMED_OUT 6 /* Killed for taking much longer than the deadline */
+#define STATUS_OUT_OF_MEMORY 7 /* Ran out of memory, maybe because of --max-memory */
+
+/*
+ * Ids for the tag names that the extraction code needs to recognize; all other
+ * tags are TAG_UNKNOWN. Keep these sorted, the names get looked up in order.
+ */
+enum tag_id {
+	TAG_UNKNOWN = 0,
+	TAG_A, TAG_ABBR, TAG_ADDRESS, TAG_ARTICLE, TAG_ASIDE, TAG_AUDIO, TAG_B,
+	TAG_BASE, TAG_BDO, TAG_BLOCKQUOTE, TAG_BODY, TAG_BR, TAG_BUTTON,
+	TAG_CAPTION, TAG_CITE, TAG_CODE, TAG_COL, TAG_COLGROUP, TAG_DATA,
+	TAG_DATALIST, TAG_DD, TAG_DEL, TAG_DETAILS, TAG_DFN, TAG_DIV, TAG_DL,
+	TAG_DT, TAG_EM, TAG_EMBED, TAG_FIELDSET, TAG_FIGCAPTION, TAG_FIGURE,
+	TAG_FONT, TAG_FOOTER, TAG_FORM, TAG_H1, TAG_H2, TAG_H3, TAG_H4, TAG_H5,
+	TAG_H6, TAG_HEADER, TAG_HR, TAG_I, TAG_IFRAME, TAG_IMG, TAG_INPUT,
+	TAG_INS, TAG_KBD, TAG_LABEL, TAG_LI, TAG_LINK, TAG_MAIN, TAG_MARK,
+	TAG_MATH, TAG_META, TAG_METER, TAG_NAV, TAG_NOSCRIPT, TAG_OBJECT,
+	TAG_OL, TAG_OUTPUT, TAG_P, TAG_PICTURE, TAG_PRE, TAG_PROGRESS, TAG_Q,
+	TAG_RUBY, TAG_SAMP, TAG_SCRIPT, TAG_SECTION, TAG_SELECT, TAG_SMALL,
+	TAG_SOURCE, TAG_SPAN, TAG_STRONG, TAG_STYLE, TAG_SUB, TAG_SUMMARY,
+	TAG_SUP, TAG_SVG, TAG_TABLE, TAG_TBODY, TAG_TD, TAG_TEMPLATE,
+	TAG_TEXTAREA, TAG_TFOOT, TAG_TH, TAG_THEAD, TAG_TIME, TAG_TITLE, TAG_TR,
+	TAG_UL, TAG_VAR, TAG_VIDEO, TAG_WBR,
+	TAG_COUNT /* Not a real tag */
+};
 
 /* fx: number of chars an article must have in order to return a result */
 #define DEFAULT_CHAR_THRESHOLD 500
 
-/* Metadata extracted from the article */
-struct metadata {
-	char *title;
-	char *byline;
-	char *excerpt;
-	char *site_name;
-	char *direction;
+/* Phases in the processing of a document, timed for the stats */
+enum stats_phase {
+	PHASE_FETCH, /* Download or read of the input, overlaps with the parse */
+	PHASE_SCRUB, /* invalidate_script_cdata() */
+	PHASE_PARSE, /* The html parser itself */
+	PHASE_PREP_DOCUMENT,
+	PHASE_GRAB_ARTICLE, /* All extraction attempts, prep_article() included */
+	PHASE_PREP_ARTICLE,
+	PHASE_FIX_URLS,
+	PHASE_SERIALIZE,
+	PHASE_COUNT /* Not a real phase */
+};
+
+/* Time spent on something, in seconds */
+struct phase_time {
+	double wall;
+	double cpu; /* For the thread that did the work */
+};
+
+/* Timing of a single extraction attempt */
+struct attempt_stats {
+	unsigned int flags; /* Flags in the context for the attempt */
+	struct phase_time time;
+};
+
+/* Instrumentation for the processing of a document, see stats.c */
+struct rdr_stats {
+	struct phase_time phases[PHASE_COUNT];
+	struct attempt_stats attempts[4]; /* Only the first ones if there are more */
+	int attempt_count;
+	unsigned long nodes_before; /* Nodes in the parsed document */
+	unsigned long nodes_after; /* Nodes in the extracted article */
+	unsigned long node_infos; /* Info structs allocated */
+	long peak_rss; /* In KiB */
 };
-extern struct metadata metadata;
 
-/* Extra information we might attach to a node via its _private field */
+/* Statistics for the text content of a node, after stripping excess whitespace */
+struct text_stats {
+	int length; /* Number of utf8 characters */
+	int link_length; /* Sum of the stripped lengths of all descendant links */
+	int commas;
+	bool leading_space;
+	bool trailing_space;
+};
+
+/* Counts of the descendants of a node, for the sake of clean_conditionally() */
+struct node_profile {
+	int p_count;
+	int img_count;
+	int li_count;
+	int input_count;
+	int embed_count;
+	bool has_video; /* Is any of the embeds a video? */
+};
+
+/* What the attributes of an element say about it, see scan_attributes() */
+struct node_attrs {
+	unsigned char flags;
+	unsigned char class_flags; /* CLASS_* flags for the class */
+	unsigned char id_flags; /* CLASS_* flags for the id */
+};
+
+/* Flags for the node_attrs struct */
+#define ATTR_HIDDEN (1 << 0) /* The node is not visible */
+#define ATTR_AUTHOR (1 << 1) /* The rel or itemprop suggest a byline */
+#define ATTR_COMPLEMENTARY (1 << 2) /* The role is complementary */
+
+/*
+ * Extra information we might attach to a node via its _private field. These
+ * structs are allocated from an arena, so they are never freed on their own.
+ */
 struct node_info {
 	unsigned char flags;
+	struct node_attrs attrs; /* Only valid with NODE_ATTRS */
 	double score;
+	struct text_stats stats; /* Only valid with NODE_TEXT_STATS */
+	struct node_profile profile; /* Only valid with NODE_PROFILE */
 };
 
 /* Flags for the node_info struct */
@@ -86,18 +193,129 @@ struct node_info {
 #define NODE_CANDIDATE (1 << 2) /* The node is marked as a candidate */
 #define NODE_TOP_CANDIDATE (1 << 3) /* The node is marked as a top candidate */
 #define NODE_DATATABLE (1 << 4) /* The node is marked as a data table */
+#define NODE_TEXT_STATS (1 << 5) /* The text statistics are up to date */
+#define NODE_PROFILE (1 << 6) /* The profile is up to date */
+#define NODE_ATTRS (1 << 7) /* The attribute info is set */
+
+/* An element of a document, in a node_index */
+struct index_entry {
+	htmlNodePtr node;
+	struct node_info *info; /* Every element in the index has one */
+	long parent; /* Entry for the parent, or -1 if it's not an element */
+};
+
+/*
+ * All the elements of a document in preorder, for the passes that don't change
+ * the tree. It must be built again after any change.
+ */
+struct node_index {
+	struct index_entry *entries;
+	size_t count;
+	size_t size; /* Allocated entries */
+};
+
+/* A single change made to a document, recorded so that it can be undone */
+struct journal_entry {
+	int type;
+	htmlNodePtr node;
+	htmlNodePtr parent; /* Former location of an unlinked node */
+	htmlNodePtr prev; /* Same */
+	xmlChar *old; /* Former name or content of the node */
+};
+
+/* Size of the reads for a streamed document */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+/* Receives each chunk of output from a script scrubber */
+typedef void (*chunk_fn)(void *data, const char *chunk, size_t len);
+
+/* State for invalidate_script_cdata() on a document received in chunks */
+struct script_scrubber {
+	int state;
+	char *buf; /* Received bytes that were not passed on yet */
+	size_t len;
+	size_t size; /* Allocated for the buffer */
+	size_t pos; /* Bytes at the start of the buffer that are ready to pass on */
+	size_t scan; /* Offset after the ready bytes to resume the search */
+	bool held; /* Is the last byte received held back? */
+	char last;
+	chunk_fn emit;
+	void *data;
+};
+
+/* State for a readerability check on a document while it's being parsed */
+struct readerable_check {
+	struct class_cache *cache;
+	htmlNodePtr *divs; /* Open <div> elements with a <br> child, innermost last */
+	size_t div_count;
+	size_t div_size; /* Allocated entries */
+	double score;
+	startElementSAXFunc start_element; /* Original handlers of the parser */
+	endElementSAXFunc end_element;
+};
+
+/* State for a metadata-only parse that may stop after the <head> */
+struct head_check {
+	struct rdr_context ctx; /* Holds the metadata once the check passes */
+	bool head_done; /* The end of the head was seen */
+	bool passed; /* The head had all the metadata, so the parse stopped */
+	endElementSAXFunc end_element; /* Original handler of the parser */
+};
+
+/* The cached response for a url, and the new one while it's downloaded */
+struct cache_entry {
+	const char *url;
+	char *path; /* NULL if the cache directory is not available */
+	FILE *file; /* The cached response, at its body; NULL if there is none */
+	char *etag; /* Validators for the cached response, or NULL */
+	char *last_modified;
+	long status; /* Status code of the new response */
+	char *new_etag; /* Validators received for the new response, or NULL */
+	char *new_last_modified;
+	char *new_path; /* Temporary file for the new entry, if it's needed */
+	FILE *new_file;
+	bool failed; /* Couldn't save the new entry */
+};
+
+/* Identifies the result for a document, as a hash of the html and settings */
+struct result_key {
+	unsigned long long hi;
+	unsigned long long lo;
+};
+
+/* Log of all changes made to a document during an extraction attempt */
+struct journal {
+	struct journal_entry *entries;
+	size_t count;
+	size_t size; /* Allocated entries */
+};
+
+/* arena.c */
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern void *arena_calloc(struct arena *arena, size_t size);
+extern void arena_adopt(struct arena *arena, struct arena *other);
+extern void free_arena(struct arena *arena);
+
+/* cache.c */
+extern void open_cache_entry(struct cache_entry *entry, const char *dir, const char *url);
+extern void cache_header_line(struct cache_entry *entry, const char *line, size_t len);
+extern void cache_body_chunk(struct cache_entry *entry, const char *chunk, size_t len);
+extern bool finish_cache_entry(struct cache_entry *entry, bool complete);
+extern void close_cache_entry(struct cache_entry *entry);
 
 /* content.c */
 extern void trim_and_unescape(char **str);
 extern void strcpy_normalize(xmlChar *dest, const xmlChar *src);
 extern xmlChar *node_get_normalized_content(htmlNodePtr node);
-extern xmlChar *node_get_normalized_or_preformatted(htmlNodePtr node);
+extern const xmlChar *scratch_normalized_content(htmlNodePtr node);
+extern const struct text_stats *get_text_stats(htmlNodePtr node);
 extern int text_normalized_content_length(htmlNodePtr node);
+extern int text_comma_count(htmlNodePtr node);
 extern int text_content_length(htmlNodePtr node);
 extern int char_count(const char *str, char c);
 extern double get_link_density(htmlNodePtr node);
 extern bool is_phrasing_content(htmlNodePtr node);
-extern htmlNodePtr has_single_tag_inside(htmlNodePtr node, const char *tag);
+extern htmlNodePtr has_single_tag_inside(htmlNodePtr node, enum tag_id tag);
 extern int word_count(const char *str, bool separators_are_spaces);
 extern char *find_last_separator(char *str);
 extern void replace_char(char *str, int old, int new);
@@ -107,60 +325,141 @@ extern bool word_in_str(const char *str, const char *word);
 typedef bool (*condition_fn)(htmlNodePtr);
 typedef bool (*condition_fn2)(htmlNodePtr, const void *);
 typedef void *(*action_fn)(htmlNodePtr);
+typedef void *(*action_fn2)(htmlNodePtr, void *);
 typedef htmlNodePtr (replace_fn)(htmlNodePtr);
-typedef double (*calc_fn)(htmlNodePtr);
+typedef htmlNodePtr (replace_fn2)(htmlNodePtr, void *);
 extern htmlNodePtr first_node(htmlDocPtr doc);
 extern htmlNodePtr skip_node_descendants(htmlNodePtr node);
 extern htmlNodePtr following_node(htmlNodePtr node);
 extern xmlNodePtr remove_and_get_following(xmlNodePtr node);
 extern void remove_descendants_if(htmlNodePtr node, condition_fn check);
+extern void remove_descendants_if_with_data(htmlNodePtr node, condition_fn2 check, const void *data);
 extern void remove_nodes_if(htmlDocPtr doc, condition_fn check);
 extern bool forall_descendants(htmlNodePtr node, condition_fn check);
 extern bool such_desc_exists(htmlNodePtr node, condition_fn2 check, const void *data);
 extern bool such_node_exists(htmlDocPtr doc, condition_fn2 check, const void *data);
 extern bool has_such_descendant(htmlNodePtr node, condition_fn check);
 extern void *run_on_nodes(htmlDocPtr doc, action_fn act);
+extern void *run_on_nodes_with_data(htmlDocPtr doc, action_fn2 act, void *data);
 extern void change_descendants(htmlNodePtr node, replace_fn replace);
-extern double total_for_descendants(htmlNodePtr node, calc_fn calc);
-extern int count_such_descs(htmlNodePtr node, condition_fn2 check, const void *data);
-extern htmlNodePtr first_descendant_with_tag(htmlNodePtr node, const char *tag);
-extern htmlNodePtr first_node_with_tag(htmlDocPtr doc, const char *tag);
+extern void change_descendants_with_data(htmlNodePtr node, replace_fn2 replace, void *data);
+extern htmlNodePtr first_descendant_with_tag(htmlNodePtr node, enum tag_id tag);
+extern htmlNodePtr first_node_with_tag(htmlDocPtr doc, enum tag_id tag);
 extern void bw_remove_descendants_if(htmlNodePtr node, condition_fn2 check, const void *data);
 extern htmlNodePtr next_element(htmlNodePtr node);
 extern htmlNodePtr prev_element(htmlNodePtr node);
+extern void build_node_index(struct node_index *index, htmlDocPtr doc);
+extern void free_node_index(struct node_index *index);
+
+/* journal.c */
+extern htmlNodePtr journal_new_node(struct journal *jnl, htmlDocPtr doc, const char *name);
+extern void journal_unlink(struct journal *jnl, htmlNodePtr node);
+extern void journal_remove(struct journal *jnl, htmlNodePtr node);
+extern htmlNodePtr journal_remove_and_get_following(struct journal *jnl, htmlNodePtr node);
+extern void journal_add_child(struct journal *jnl, htmlNodePtr parent, htmlNodePtr node);
+extern void journal_add_prev_sibling(struct journal *jnl, htmlNodePtr next, htmlNodePtr node);
+extern void journal_replace(struct journal *jnl, htmlNodePtr old, htmlNodePtr new);
+extern void journal_set_name(struct journal *jnl, htmlNodePtr node, const char *name);
+extern void undo_journal(struct journal *jnl);
 
 /* node.c */
+extern struct arena *use_arena(struct arena *arena);
+extern struct arena *current_arena(void);
 extern struct node_info *allocate_node_info(htmlNodePtr node);
+extern unsigned long node_infos_allocated(void);
+extern void clear_tree_info(htmlNodePtr node);
 extern void free_node(htmlNodePtr node);
 extern void free_doc(htmlDocPtr doc);
-extern bool node_has_tag_array(htmlNodePtr node, int tagc, const char * const tagv[]);
-extern htmlNodePtr has_ancestor_tag(htmlNodePtr node, const char *tag);
-extern bool node_has_unlikely_class_id(htmlNodePtr node);
-extern bool is_node_visible(htmlNodePtr node);
-extern int get_class_weight(htmlNodePtr node);
+extern void invalidate_cached_stats(htmlNodePtr node);
+extern void unlink_node(htmlNodePtr node);
+extern void append_child(htmlNodePtr parent, htmlNodePtr node);
+extern void add_prev_sibling(htmlNodePtr next, htmlNodePtr node);
+extern void replace_node(htmlNodePtr old, htmlNodePtr new);
+extern void set_node_name(htmlNodePtr node, const char *name);
+extern void set_node_content(htmlNodePtr node, const char *content);
+extern enum tag_id resolve_tag_id(htmlNodePtr node);
+extern htmlNodePtr has_ancestor_tag(htmlNodePtr node, enum tag_id tag);
+extern const struct node_attrs *get_node_attrs(struct class_cache *cache, htmlNodePtr node,
+					       struct node_attrs *buf);
+extern void scan_document_attrs(struct class_cache *cache, htmlDocPtr doc);
+extern void copy_document_attrs(htmlDocPtr copy, htmlDocPtr doc);
+extern bool is_node_visible(struct class_cache *cache, htmlNodePtr node);
+extern unsigned int get_class_id_flags(struct class_cache *cache, htmlNodePtr node);
+extern bool node_has_unlikely_class_id(struct class_cache *cache, htmlNodePtr node);
+extern int get_class_weight(const struct rdr_context *ctx, htmlNodePtr node);
 extern bool attrcmp(htmlNodePtr node, const char *attrname, const char *str);
 
+/* output.c */
+extern void node_to_output_buffer(xmlOutputBufferPtr out, htmlNodePtr node);
+extern char *node_to_string(htmlNodePtr node, size_t *len);
+extern char *node_to_text(htmlNodePtr node, bool markdown, size_t *len);
+extern void print_json_string(FILE *out, const char *str);
+
 /* prep_article.c */
-extern void prep_article(htmlNodePtr article);
+extern void prep_article(const struct rdr_context *ctx, htmlNodePtr article);
 
 /* readability.c */
-extern htmlNodePtr parse(htmlDocPtr doc);
+extern void start_head_check(struct head_check *check, htmlParserCtxtPtr parser);
+extern void end_head_check(struct head_check *check);
 
 /* readerable.c */
-extern bool is_probably_readerable(htmlDocPtr doc);
+extern void start_readerable_check(struct readerable_check *check, htmlParserCtxtPtr parser);
+extern bool readerable_check_passed(const struct readerable_check *check);
+extern void end_readerable_check(struct readerable_check *check);
 
 /* regex.c */
-extern regex_t unlikely_re, candidate_re, byline_re, property_re, name_re;
-extern regex_t imgext_re, hascontent_re, negative_re, positive_re;
-extern regex_t sentence_dot_re, b64_dataurl_re, srcset_re, src_re, videos_re;
-extern regex_t share_re, absolute_re;
+/* Flags for the patterns matched by a class or id, see classify_class_id() */
+#define CLASS_UNLIKELY (1 << 0)
+#define CLASS_CANDIDATE (1 << 1)
+#define CLASS_NEGATIVE (1 << 2)
+#define CLASS_POSITIVE (1 << 3)
+#define CLASS_BYLINE (1 << 4)
+
+struct keywords;
+/* A pattern to match, either as a regex or as a faster set of keywords */
+struct pattern {
+	regex_t regex;
+	struct keywords *keywords; /* NULL if the regex must be used */
+};
+extern struct pattern unlikely_re, candidate_re, byline_re, property_re, name_re;
+extern struct pattern imgext_re, hascontent_re, negative_re, positive_re;
+extern struct pattern sentence_dot_re, b64_dataurl_re, srcset_re, src_re, videos_re;
+extern struct pattern share_re, absolute_re;
 extern void init_regexes(void);
-extern bool regex_matches(const regex_t *preg, const xmlChar *string);
+extern bool regex_matches(const struct pattern *pat, const xmlChar *string);
+extern struct class_cache *new_class_cache(void);
+extern void freeze_class_cache(struct class_cache *cache);
+extern void free_class_cache(struct class_cache *cache);
+extern unsigned int classify_class_id(struct class_cache *cache, const xmlChar *str);
+
+/* scrub.c */
+extern void invalidate_script_cdata(char *map, size_t size);
+extern void init_scrubber(struct script_scrubber *scrub, chunk_fn emit, void *data);
+extern void scrub_chunk(struct script_scrubber *scrub, const char *chunk, size_t len);
+extern void finish_scrubber(struct script_scrubber *scrub);
+
+/* stats.c */
+extern void start_phase(const struct rdr_stats *stats, struct phase_time *start);
+extern void end_phase(struct rdr_stats *stats, enum stats_phase phase, const struct phase_time *start);
+extern void end_attempt(struct rdr_stats *stats, unsigned int flags, const struct phase_time *start);
+extern void add_stats(struct rdr_stats *dest, const struct rdr_stats *src);
+extern void record_peak_rss(struct rdr_stats *stats);
+extern double monotonic_seconds(void);
+
+/* results.c */
+struct result_cache;
+extern void get_result_key(struct result_key *key, const char *input, size_t len, const char *settings);
+extern struct result_cache *new_result_cache(size_t max_size);
+extern const char *find_result(struct result_cache *cache, const struct result_key *key, size_t *len);
+extern void save_result(struct result_cache *cache, const struct result_key *key,
+			const char *output, size_t len);
+extern void free_result_cache(struct result_cache *cache);
 
 /* sandbox.c */
 extern void start_sandbox(void);
 
-/* rdrview.c */
+/* fatal.c */
+extern const char *progname;
 extern __attribute__((noreturn)) void fatal_errno(void);
 extern __attribute__((noreturn)) void fatal_msg(char *message);
 extern __attribute__((noreturn)) void fatal_with_loc(const char *fn, int line);
@@ -177,16 +476,78 @@ extern __attribute__((noreturn)) void fatal_with_loc(const char *fn, int line);
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+/* Set in the extra field of a node once its tag id is known */
+#define TAG_ID_KNOWN 0x8000
+
+/**
+ * Get the tag id for a node; it's only worked out the first time
+ */
+static inline enum tag_id get_tag_id(htmlNodePtr node)
+{
+	if (node && (node->extra & TAG_ID_KNOWN))
+		return node->extra & ~TAG_ID_KNOWN;
+	return resolve_tag_id(node);
+}
+
+/**
+ * The name of the node is about to change, so its tag id must be worked out
+ * again
+ */
+static inline void forget_tag_id(htmlNodePtr node)
+{
+	node->extra = 0;
+}
+
 /**
- * Check if a node has one of the given (lowercase) tag names
+ * Check if a node has one of the tags in the array
+ *
+ * It's usually cleaner to call this function through the node_has_tag() macro
+ * wrapper, so that the tag count argument is not required.
+ */
+static inline bool node_has_tag_array(htmlNodePtr node, int tagc, const enum tag_id tagv[])
+{
+	enum tag_id id = get_tag_id(node);
+
+	while (tagc--) {
+		if (id == *tagv++)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Check if a node has one of the given tags
  */
 #define node_has_tag(node, tags...) \
 ({ \
-	const char *tagv[] = {tags}; \
-	int tagc = sizeof(tagv) / sizeof(tagv[0]); \
-	node_has_tag_array(node, tagc, tagv); \
+	const enum tag_id tagv[] = {tags}; \
+	node_has_tag_array(node, ARRAY_SIZE(tagv), tagv); \
 })
 
+/**
+ * Check if a node has one of the tags in a set, given as an array of flags
+ * indexed by the tag id
+ */
+static inline bool node_has_tag_in(htmlNodePtr node, const bool tagset[TAG_COUNT])
+{
+	return tagset[get_tag_id(node)];
+}
+
+/**
+ * Considering only the class and id in the attribute info of a node, is it
+ * unlikely to be readable?
+ */
+static inline bool has_unlikely_class_id(const struct node_attrs *attrs)
+{
+	unsigned int flags = attrs->class_flags | attrs->id_flags;
+
+	/*
+	 * For the node to be unlikely, the class or the id must be on that list.
+	 * Also, neither the class nor the id can be on the candidate list.
+	 */
+	return (flags & CLASS_UNLIKELY) && !(flags & CLASS_CANDIDATE);
+}
+
 /**
  * Mark a node as initialized
  */
@@ -23,36 +23,29 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <libxml/tree.h>
 #include <libxml/uri.h>
 #include "rdrview.h"
 
-struct metadata metadata = {0};
-
-/* List of previous attempts to get the content */
-struct attempt {
-	htmlNodePtr article;
-	int length;
-};
-static struct attempt attempts[4] = {0};
-
 /**
  * Is there a better title than the current one under the name or property of
  * this meta tag?
  */
-static bool is_better_title(char *nameprop)
+static bool is_better_title(struct rdr_context *ctx, char *nameprop)
 {
 	static const char * const titlenames[] = {
 		"dc:title", "dcterm:title", "og:title", "weibo:article:title",
 		"weibo:webpage:title", "title", "twitter:title"
 	};
-	static unsigned int best_i = ARRAY_SIZE(titlenames);
 	unsigned int i;
 
 	for (i = 0; i < ARRAY_SIZE(titlenames); ++i) {
-		if (i <= best_i && word_in_str(nameprop, titlenames[i])) {
-			best_i = i;
+		if (i <= ctx->best_title_i && word_in_str(nameprop, titlenames[i])) {
+			ctx->best_title_i = i;
 			return true;
 		}
 	}
@@ -63,17 +56,16 @@ static bool is_better_title(char *nameprop)
  * Is there a better byline than the current one under the name or property of
  * this meta tag?
  */
-static bool is_better_byline(char *nameprop)
+static bool is_better_byline(struct rdr_context *ctx, char *nameprop)
 {
 	static const char * const authornames[] = {
 		"dc:creator", "dcterm:creator", "author"
 	};
-	static unsigned int best_i = ARRAY_SIZE(authornames);
 	unsigned int i;
 
 	for (i = 0; i < ARRAY_SIZE(authornames); ++i) {
-		if (i <= best_i && word_in_str(nameprop, authornames[i])) {
-			best_i = i;
+		if (i <= ctx->best_byline_i && word_in_str(nameprop, authornames[i])) {
+			ctx->best_byline_i = i;
 			return true;
 		}
 	}
@@ -84,19 +76,18 @@ static bool is_better_byline(char *nameprop)
  * Is there a better excerpt than the current one under the name or property of
  * this meta tag?
  */
-static bool is_better_excerpt(char *nameprop)
+static bool is_better_excerpt(struct rdr_context *ctx, char *nameprop)
 {
 	static const char * const excerptnames[] = {
 		"dc:description", "dcterm:description", "og:description",
 		"weibo:article:description", "weibo:webpage:description",
 		"description", "twitter:description"
 	};
-	static unsigned int best_i = ARRAY_SIZE(excerptnames);
 	unsigned int i;
 
 	for (i = 0; i < ARRAY_SIZE(excerptnames); ++i) {
-		if (i <= best_i && word_in_str(nameprop, excerptnames[i])) {
-			best_i = i;
+		if (i <= ctx->best_excerpt_i && word_in_str(nameprop, excerptnames[i])) {
+			ctx->best_excerpt_i = i;
 			return true;
 		}
 	}
@@ -108,8 +99,9 @@ static bool is_better_excerpt(char *nameprop)
  *
  * TODO: apparently a single property tag can have multiple contents?
  */
-static void parse_meta_attrs(char *nameprop, char *content)
+static void parse_meta_attrs(struct rdr_context *ctx, char *nameprop, char *content)
 {
+	struct metadata *metadata = &ctx->metadata;
 	char **field = NULL;
 
 	if (!*content)
@@ -117,19 +109,19 @@ static void parse_meta_attrs(char *nameprop, char *content)
 
 	replace_char(nameprop, '.', ':');
 
-	field = &metadata.title;
-	if (is_better_title(nameprop))
+	field = &metadata->title;
+	if (is_better_title(ctx, nameprop))
 		goto copy;
 
-	field = &metadata.byline;
-	if (is_better_byline(nameprop))
+	field = &metadata->byline;
+	if (is_better_byline(ctx, nameprop))
 		goto copy;
 
-	field = &metadata.excerpt;
-	if (is_better_excerpt(nameprop))
+	field = &metadata->excerpt;
+	if (is_better_excerpt(ctx, nameprop))
 		goto copy;
 
-	field = &metadata.site_name;
+	field = &metadata->site_name;
 	if (word_in_str(nameprop, "og:site_name"))
 		goto copy;
 	return;
@@ -148,18 +140,15 @@ copy:
  */
 static bool is_heading_with_str(htmlNodePtr node, const void *str)
 {
-	xmlChar *content;
-	bool ret;
+	const xmlChar *content;
 
-	if (!node_has_tag(node, "h1", "h2"))
+	if (!node_has_tag(node, TAG_H1, TAG_H2))
 		return false;
 
-	content = node_get_normalized_content(node);
+	content = scratch_normalized_content(node);
 	if (!content)
 		return false;
-	ret = strcmp(str, (char *)content) == 0; /* TODO: trimming? */
-	xmlFree(content);
-	return ret;
+	return strcmp(str, (char *)content) == 0; /* TODO: trimming? */
 }
 
 /**
@@ -214,15 +203,15 @@ out:
  * If this is a metadata node, extract and remember the metadata. Return NULL,
  * except for the title node: in that case return the node.
  */
-static void *node_extract_metadata(htmlNodePtr node)
+static void *node_extract_metadata(htmlNodePtr node, void *ctx)
 {
 	xmlChar *name = NULL;
 	xmlChar *property = NULL;
 	xmlChar *content = NULL;
 
-	if (node_has_tag(node, "title"))
+	if (node_has_tag(node, TAG_TITLE))
 		return node;
-	if (!node_has_tag(node, "meta"))
+	if (!node_has_tag(node, TAG_META))
 		return NULL;
 
 	content = xmlGetProp(node, (xmlChar *)"content");
@@ -231,13 +220,13 @@ static void *node_extract_metadata(htmlNodePtr node)
 
 	property = xmlGetProp(node, (xmlChar *)"property");
 	if (regex_matches(&property_re, property)) {
-		parse_meta_attrs((char *)property, (char *)content);
+		parse_meta_attrs(ctx, (char *)property, (char *)content);
 		goto out;
 	}
 
 	name = xmlGetProp(node, (xmlChar *)"name");
 	if (regex_matches(&name_re, name))
-		parse_meta_attrs((char *)name, (char *)content);
+		parse_meta_attrs(ctx, (char *)name, (char *)content);
 
 out:
 	xmlFree(name);
@@ -248,70 +237,58 @@ out:
 
 /**
  * fx: Attempts to get excerpt and byline metadata for the article.
+ *
+ * The fields are saved to the metadata in the context; parse() already takes
+ * care of this, so only call it directly if no content is needed.
  */
-static void get_article_metadata(htmlDocPtr doc)
+void get_article_metadata(struct rdr_context *ctx, htmlDocPtr doc)
 {
 	htmlNodePtr titlenode = NULL;
 
-	titlenode = run_on_nodes(doc, node_extract_metadata);
-	if (!metadata.title && titlenode)
-		metadata.title = get_article_title(doc, titlenode);
+	titlenode = run_on_nodes_with_data(doc, node_extract_metadata, ctx);
+	if (!ctx->metadata.title && titlenode)
+		ctx->metadata.title = get_article_title(doc, titlenode);
 }
 
 /**
  * Check if this node has the byline and, if it does, remember the value
  */
-static bool check_byline(htmlNodePtr node)
+static bool check_byline(struct rdr_context *ctx, htmlNodePtr node)
 {
-	static bool found_byline;
-	xmlChar *itemprop = NULL;
-	xmlChar *class = NULL;
-	xmlChar *id = NULL;
-	bool is_byline = true;
+	const struct node_attrs *attrs;
+	struct node_attrs buf;
+	int len;
 
-	if (found_byline)
+	if (ctx->found_byline)
 		return false;
 
-	if (attrcmp(node, "rel", "author"))
-		goto out;
-	itemprop = xmlGetProp(node, (xmlChar *)"itemprop");
-	if (itemprop && strstr((char *)itemprop, "author"))
-		goto out;
-
-	class = xmlGetProp(node, (xmlChar *)"class");
-	id = xmlGetProp(node, (xmlChar *)"id");
-
-	if (regex_matches(&byline_re, class) || regex_matches(&byline_re, id))
-		goto out;
-
-	is_byline = false;
-out:
-	if (is_byline) {
-		int len = text_content_length(node);
+	attrs = get_node_attrs(ctx->class_cache, node, &buf);
+	if (!(attrs->flags & ATTR_AUTHOR) && !((attrs->class_flags | attrs->id_flags) & CLASS_BYLINE))
+		return false;
 
-		if (len > 0 && len < 100) { /* Is this a sane byline? */
-			if (!metadata.byline)
-				metadata.byline = (char *)node_get_normalized_content(node);
-			found_byline = true;
-		}
+	len = text_content_length(node);
+	if (len > 0 && len < 100) { /* Is this a sane byline? */
+		if (!ctx->metadata.byline)
+			ctx->metadata.byline = (char *)node_get_normalized_content(node);
+		ctx->found_byline = true;
 	}
-
-	xmlFree(itemprop);
-	xmlFree(class);
-	xmlFree(id);
-	return found_byline;
+	return ctx->found_byline;
 }
 
 /**
  * Is this node unlikely to be readable?
  */
-static bool is_node_unlikely(htmlNodePtr node)
+static bool is_node_unlikely(const struct rdr_context *ctx, htmlNodePtr node)
 {
-	if (attrcmp(node, "role", "complementary"))
+	const struct node_attrs *attrs;
+	struct node_attrs buf;
+
+	attrs = get_node_attrs(ctx->class_cache, node, &buf);
+	if (attrs->flags & ATTR_COMPLEMENTARY)
 		return true;
-	if (has_ancestor_tag(node, "table") || node_has_tag(node, "body", "a"))
+	if (has_ancestor_tag(node, TAG_TABLE) || node_has_tag(node, TAG_BODY, TAG_A))
 		return false;
-	return node_has_unlikely_class_id(node);
+	return has_unlikely_class_id(attrs);
 }
 
 /**
@@ -321,7 +298,7 @@ static bool is_break_if_element(htmlNodePtr node)
 {
 	if (node->type != XML_ELEMENT_NODE)
 		return true;
-	return node_has_tag(node, "br", "hr");
+	return node_has_tag(node, TAG_BR, TAG_HR);
 }
 
 /**
@@ -334,8 +311,10 @@ static bool is_element_without_content(htmlNodePtr node)
 	return forall_descendants(node, is_break_if_element);
 }
 
-static const char * const DIV_ELEMS[] = {
-	"div", "section", "header", "h1", "h2", "h3", "h4", "h5", "h6",
+static const bool DIV_ELEMS[TAG_COUNT] = {
+	[TAG_DIV] = true, [TAG_SECTION] = true, [TAG_HEADER] = true,
+	[TAG_H1] = true, [TAG_H2] = true, [TAG_H3] = true, [TAG_H4] = true,
+	[TAG_H5] = true, [TAG_H6] = true,
 };
 
 /**
@@ -343,7 +322,7 @@ static const char * const DIV_ELEMS[] = {
  */
 static bool is_division_without_content(htmlNodePtr node)
 {
-	if (!node_has_tag_array(node, ARRAY_SIZE(DIV_ELEMS), DIV_ELEMS))
+	if (!node_has_tag_in(node, DIV_ELEMS))
 		return false;
 	return is_element_without_content(node);
 }
@@ -355,21 +334,21 @@ static bool is_whitespace(htmlNodePtr node)
 {
 	if (xmlNodeIsText(node) && !text_content_length(node))
 		return true;
-	return node_has_tag(node, "br");
+	return node_has_tag(node, TAG_BR);
 }
 
 /**
- * Remove all trailing children that are just whitespace
+ * Remove all trailing children that are just whitespace. The journal may be
+ * NULL if the changes won't need to be undone.
  */
-static void prune_trailing_whitespace(htmlNodePtr node)
+static void prune_trailing_whitespace(struct journal *jnl, htmlNodePtr node)
 {
 	htmlNodePtr child = xmlGetLastChild(node);
 
 	while (child && is_whitespace(child)) {
 		htmlNodePtr prev = child->prev;
 
-		xmlUnlinkNode(child);
-		free_node(child);
+		journal_remove(jnl, child);
 		child = prev;
 	}
 }
@@ -378,25 +357,26 @@ static void prune_trailing_whitespace(htmlNodePtr node)
  * Reparent a node to a preceding "p" sibling; if the sibling is NULL, create
  * it. Return the new parent for the node, or NULL if no reparenting happened.
  */
-static htmlNodePtr reparent_to_p_sibling(htmlNodePtr node, htmlNodePtr sibling)
+static htmlNodePtr reparent_to_p_sibling(struct journal *jnl, htmlNodePtr node,
+					 htmlNodePtr sibling)
 {
 	if (!sibling) {
 		if (is_whitespace(node))
 			return NULL; /* Don't start a paragraph for whitespace alone */
-		sibling = xmlNewNode(NULL, (xmlChar *)"p");
-		if (!sibling || !xmlAddPrevSibling(node, sibling))
-			fatal();
+		sibling = journal_new_node(jnl, node->doc, "p");
+		journal_add_prev_sibling(jnl, node, sibling);
 	}
 
-	xmlUnlinkNode(node);
-	if (!xmlAddChild(sibling, node))
-		fatal();
+	journal_unlink(jnl, node);
+	journal_add_child(jnl, sibling, node);
 	return sibling;
 }
 
-static const char * const DIV_TO_P_ELEMS[] = {
-	"a", "blockquote", "dl", "div", "img", "ol", "p", "pre", "table", "ul",
-	"select",
+static const bool DIV_TO_P_ELEMS[TAG_COUNT] = {
+	[TAG_A] = true, [TAG_BLOCKQUOTE] = true, [TAG_DL] = true,
+	[TAG_DIV] = true, [TAG_IMG] = true, [TAG_OL] = true, [TAG_P] = true,
+	[TAG_PRE] = true, [TAG_TABLE] = true, [TAG_UL] = true,
+	[TAG_SELECT] = true,
 };
 
 /**
@@ -404,17 +384,15 @@ static const char * const DIV_TO_P_ELEMS[] = {
  */
 static bool is_block_element(htmlNodePtr node)
 {
-	static const int tagc = ARRAY_SIZE(DIV_TO_P_ELEMS);
-
 	if (node->type != XML_ELEMENT_NODE)
 		return false;
-	return node_has_tag_array(node, tagc, DIV_TO_P_ELEMS);
+	return node_has_tag_in(node, DIV_TO_P_ELEMS);
 }
 
 /**
  * Handle a div node for grab_article() and return the next node to process
  */
-static htmlNodePtr handle_div_node_for_grab(htmlNodePtr node)
+static htmlNodePtr handle_div_node_for_grab(struct journal *jnl, htmlNodePtr node)
 {
 	htmlNodePtr parag = NULL;
 	htmlNodePtr child;
@@ -422,11 +400,11 @@ static htmlNodePtr handle_div_node_for_grab(htmlNodePtr node)
 	/* fx: Put phrasing content into paragraphs */
 	for (child = node->children; child; child = child->next) {
 		if (is_phrasing_content(child)) {
-			parag = reparent_to_p_sibling(child, parag);
+			parag = reparent_to_p_sibling(jnl, child, parag);
 			if (parag)
 				child = parag;
 		} else if (parag) {
-			prune_trailing_whitespace(parag);
+			prune_trailing_whitespace(jnl, parag);
 			parag = NULL;
 		}
 	}
@@ -437,25 +415,26 @@ static htmlNodePtr handle_div_node_for_grab(htmlNodePtr node)
 	 * be safely converted into plain P elements to avoid confusing the scoring
 	 * algorithm with DIVs with are, in practice, paragraphs.
 	 */
-	if (has_single_tag_inside(node, "p") && get_link_density(node) < 0.25) {
+	if (has_single_tag_inside(node, TAG_P) && get_link_density(node) < 0.25) {
 		htmlNodePtr child = xmlFirstElementChild(node);
 
 		if (!child)
 			fatal();
-		xmlReplaceNode(node, child);
-		free_node(node);
+		journal_replace(jnl, node, child);
 		node = child;
 		mark_to_score(node);
 	} else if (!has_such_descendant(node, is_block_element)) {
-		xmlNodeSetName(node, (xmlChar *)"p");
+		journal_set_name(jnl, node, "p");
 		mark_to_score(node);
 	}
 
 	return following_node(node);
 }
 
-static const char * const TAGS_TO_SCORE[] = {
-	"section", "h2", "h3", "h4", "h5", "h6", "p", "td", "pre",
+static const bool TAGS_TO_SCORE[TAG_COUNT] = {
+	[TAG_SECTION] = true, [TAG_H2] = true, [TAG_H3] = true, [TAG_H4] = true,
+	[TAG_H5] = true, [TAG_H6] = true, [TAG_P] = true, [TAG_TD] = true,
+	[TAG_PRE] = true,
 };
 
 /**
@@ -463,7 +442,7 @@ static const char * const TAGS_TO_SCORE[] = {
  */
 static inline bool has_default_tag_to_score(htmlNodePtr node)
 {
-	return node_has_tag_array(node, ARRAY_SIZE(TAGS_TO_SCORE), TAGS_TO_SCORE);
+	return node_has_tag_in(node, TAGS_TO_SCORE);
 }
 
 /**
@@ -471,13 +450,13 @@ static inline bool has_default_tag_to_score(htmlNodePtr node)
  *
  * This function may have the side-effect of setting the byline.
  */
-static bool no_need_to_score(htmlNodePtr node)
+static bool no_need_to_score(struct rdr_context *ctx, htmlNodePtr node)
 {
-	if (!is_node_visible(node))
+	if (!is_node_visible(ctx->class_cache, node))
 		return true;
-	if (check_byline(node))
+	if (check_byline(ctx, node))
 		return true;
-	if ((options.flags & OPT_STRIP_UNLIKELY) && is_node_unlikely(node))
+	if ((ctx->flags & OPT_STRIP_UNLIKELY) && is_node_unlikely(ctx, node))
 		return true;
 
 	/*
@@ -490,49 +469,60 @@ static bool no_need_to_score(htmlNodePtr node)
 /**
  * Initialize a node with a preliminary readability score.
  */
-void initialize_node(htmlNodePtr node)
+static void initialize_node(struct rdr_context *ctx, htmlNodePtr node)
 {
-	if (node_has_tag(node, "div"))
+	int weight;
+
+	if (node_has_tag(node, TAG_DIV))
 		add_to_score(node, +5);
-	else if (node_has_tag(node, "pre", "td", "blockquote"))
+	else if (node_has_tag(node, TAG_PRE, TAG_TD, TAG_BLOCKQUOTE))
 		add_to_score(node, +3);
-	else if (node_has_tag(node, "address", "form"))
+	else if (node_has_tag(node, TAG_ADDRESS, TAG_FORM))
 		add_to_score(node, -3);
-	else if (node_has_tag(node, "ol", "ul", "dl", "dd", "dt", "li"))
+	else if (node_has_tag(node, TAG_OL, TAG_UL, TAG_DL, TAG_DD, TAG_DT, TAG_LI))
 		add_to_score(node, -3);
-	else if (node_has_tag(node, "h1", "h2", "h3", "h4", "h5", "h6", "th"))
+	else if (node_has_tag(node, TAG_H1, TAG_H2, TAG_H3, TAG_H4, TAG_H5, TAG_H6, TAG_TH))
 		add_to_score(node, -5);
 
-	add_to_score(node, get_class_weight(node));
+	weight = get_class_weight(ctx, node);
+	if (weight)
+		ctx->class_weights_used = true;
+	add_to_score(node, weight);
 	mark_as_initialized(node);
 }
 
 /**
  * fx: Initialize and score ancestors
+ *
+ * The ancestors are found through the index, starting from the entry for the
+ * parent.
  */
-static void assign_content_score_ancestors(htmlNodePtr node, int score)
+static void assign_content_score_ancestors(struct rdr_context *ctx, const struct node_index *index,
+					   long parent, int score)
 {
 	int level = 3; /* Only score 3 ancestors */
+	long i;
 
-	for (node = node->parent; node && level; node = node->parent, level--) {
-		if (!node->name)
-			continue;
-		if (!node->parent || node->parent->type != XML_ELEMENT_NODE)
+	for (i = parent; i >= 0 && level; i = index->entries[i].parent, level--) {
+		const struct index_entry *entry = &index->entries[i];
+		struct node_info *ni = entry->info;
+
+		if (entry->parent < 0)
 			continue;
-		if (!is_initialized(node)) {
-			initialize_node(node);
-			mark_as_candidate(node);
+		if (!(ni->flags & NODE_INITIALIZED)) {
+			initialize_node(ctx, entry->node);
+			ni->flags |= NODE_CANDIDATE;
 		}
 
 		switch (level) {
 		case 3:
-			add_to_score(node, score);
+			ni->score += score;
 			break;
 		case 2:
-			add_to_score(node, score / 2.0);
+			ni->score += score / 2.0;
 			break;
 		case 1:
-			add_to_score(node, score / 6.0);
+			ni->score += score / 6.0;
 			break;
 		}
 	}
@@ -542,39 +532,41 @@ static void assign_content_score_ancestors(htmlNodePtr node, int score)
  * fx: assign a score to them based on how content-y they look. Then add their
  * score to their parent node. A score is determined by things like number of
  * commas, class names, etc. Maybe eventually link density.
+ *
+ * All the nodes to score are elements, so this only needs to go over the index.
  */
-static void *assign_content_score(htmlNodePtr node)
+static void assign_content_scores(struct rdr_context *ctx, const struct node_index *index)
 {
-	xmlChar *text = NULL;
-	int length;
-	int score = 0;
-
-	if (!is_to_score(node))
-		goto out;
+	size_t i;
 
-	if (!node->parent || node->parent->type != XML_ELEMENT_NODE)
-		goto out;
+	for (i = 0; i < index->count; ++i) {
+		const struct index_entry *entry = &index->entries[i];
+		const struct text_stats *stats;
+		int length;
+		int score = 0;
 
-	text = node_get_normalized_content(node);
-	length = text ? xmlUTF8Strlen(text) : 0;
-	if (length < 25)
-		goto out;
+		if (!(entry->info->flags & NODE_TO_SCORE))
+			continue;
+		if (entry->parent < 0)
+			continue;
 
-	++score; /* fx: Add a point for the paragraph itself as a base. */
-	score += char_count((char *)text, ',') + 1; /* fx: points for commas */
+		stats = get_text_stats(entry->node);
+		length = stats->length;
+		if (length < 25)
+			continue;
 
-	/*
-	 * fx: For every 100 characters in this paragraph, add another point.
-	 * Up to 3 points.
-	 */
-	score += MIN(length / 100, 3);
+		++score; /* fx: Add a point for the paragraph itself as a base. */
+		score += stats->commas + 1; /* fx: points for commas */
 
-	/* fx: Initialize and score ancestors */
-	assign_content_score_ancestors(node, score);
+		/*
+		 * fx: For every 100 characters in this paragraph, add another
+		 * point. Up to 3 points.
+		 */
+		score += MIN(length / 100, 3);
 
-out:
-	xmlFree(text);
-	return NULL;
+		/* fx: Initialize and score ancestors */
+		assign_content_score_ancestors(ctx, index, entry->parent, score);
+	}
 }
 
 /*
@@ -595,7 +587,7 @@ static htmlNodePtr find_ancestor_with_more_content(htmlNodePtr node)
 	for (ancestor = node->parent; ancestor; ancestor = ancestor->parent) {
 		double ancestor_score;
 
-		if (node_has_tag(ancestor, "body"))
+		if (node_has_tag(ancestor, TAG_BODY))
 			break;
 
 		ancestor_score = load_score(ancestor);
@@ -623,17 +615,12 @@ static bool is_ancestor_of(htmlNodePtr n1, htmlNodePtr n2)
 	return false;
 }
 
-/*
- * fx: The number of top candidates to consider when analysing how tight the
- * competition is among candidates. TODO: override through cli option?
- */
-#define DEFAULT_N_TOP_CANDIDATES 5
-
 /**
  * Search for a better top candidate among the ancestors of the current one
  */
-static htmlNodePtr find_better_top_candidate(htmlNodePtr *tops)
+static htmlNodePtr find_better_top_candidate(struct rdr_context *ctx)
 {
+	htmlNodePtr *tops = ctx->tops;
 	htmlNodePtr topnode = tops[0];
 	double topscore = load_score(topnode);
 	htmlNodePtr ancestor;
@@ -651,7 +638,7 @@ static htmlNodePtr find_better_top_candidate(htmlNodePtr *tops)
 		static const int MINIMUM_TOPCANDIDATES = 3;
 		int contained_tops = 0;
 
-		if (node_has_tag(ancestor, "body"))
+		if (node_has_tag(ancestor, TAG_BODY))
 			break;
 
 		for (i = 1; i < DEFAULT_N_TOP_CANDIDATES && tops[i]; i++) {
@@ -668,7 +655,7 @@ static htmlNodePtr find_better_top_candidate(htmlNodePtr *tops)
 		}
 	}
 	if (!is_initialized(topnode))
-		initialize_node(topnode);
+		initialize_node(ctx, topnode);
 
 	topnode = find_ancestor_with_more_content(topnode);
 
@@ -678,27 +665,25 @@ static htmlNodePtr find_better_top_candidate(htmlNodePtr *tops)
 	 * located in parent's sibling node.
 	 */
 	while (xmlChildElementCount(topnode->parent) == 1) {
-		if (!topnode->parent || node_has_tag(topnode->parent, "body"))
+		if (!topnode->parent || node_has_tag(topnode->parent, TAG_BODY))
 			break;
 		topnode = topnode->parent;
 	}
 	if (!is_initialized(topnode))
-		initialize_node(topnode);
+		initialize_node(ctx, topnode);
 	return topnode;
 }
 
 /**
- * Return the top candidate list, updated if appropriate to include the node
+ * Update the top candidate list if appropriate to include the node, which must
+ * be a candidate
  */
-static void *consider_for_top_list(htmlNodePtr node)
+static void consider_for_top_list(struct rdr_context *ctx, htmlNodePtr node)
 {
-	static htmlNodePtr tops[DEFAULT_N_TOP_CANDIDATES] = {0};
+	htmlNodePtr *tops = ctx->tops;
 	double score;
 	int i;
 
-	if (!is_candidate(node))
-		return tops;
-
 	score = load_score(node) * (1 - get_link_density(node));
 	save_score(node, score);
 
@@ -714,28 +699,27 @@ static void *consider_for_top_list(htmlNodePtr node)
 		tops[i] = node;
 		break;
 	}
-	return tops;
 }
 
 /**
  * fx: After we've calculated scores, loop through all of the possible
  * candidate nodes we found and find the one with the highest score.
  */
-static htmlNodePtr find_top_candidate(htmlDocPtr doc)
+static htmlNodePtr find_top_candidate(struct rdr_context *ctx, const struct node_index *index)
 {
-	htmlNodePtr *tops = run_on_nodes(doc, consider_for_top_list);
-	htmlNodePtr result;
-
-	if (!tops)
-		return NULL;
+	htmlNodePtr *tops = ctx->tops;
+	size_t i;
 
-	if (!tops[0] || node_has_tag(tops[0], "body"))
-		result = NULL;
-	else
-		result = find_better_top_candidate(tops);
+	/* Forget the candidates from previous attempts */
+	memset(tops, 0, sizeof(ctx->tops));
+	for (i = 0; i < index->count; ++i) {
+		if (index->entries[i].info->flags & NODE_CANDIDATE)
+			consider_for_top_list(ctx, index->entries[i].node);
+	}
 
-	tops[0] = NULL; /* Static array: mark as empty so that it can be reused */
-	return result;
+	if (!tops[0] || node_has_tag(tops[0], TAG_BODY))
+		return NULL;
+	return find_better_top_candidate(ctx);
 }
 
 /**
@@ -747,7 +731,7 @@ static htmlNodePtr get_body(htmlDocPtr doc)
 	htmlNodePtr child;
 
 	for (child = root->children; child; child = child->next) {
-		if (node_has_tag(child, "body"))
+		if (node_has_tag(child, TAG_BODY))
 			return child;
 	}
 	fatal_msg("document has no body tag");
@@ -757,46 +741,44 @@ static htmlNodePtr get_body(htmlDocPtr doc)
  * fx: If we still have no top candidate, just use the body as a last resort.
  * We also have to copy the body node so it is something we can modify.
  */
-static htmlNodePtr top_candidate_from_all(htmlDocPtr doc)
+static htmlNodePtr top_candidate_from_all(struct rdr_context *ctx, struct journal *jnl,
+					  htmlDocPtr doc)
 {
 	htmlNodePtr body = get_body(doc);
 	htmlNodePtr new, child, next;
 
-	new = xmlNewNode(NULL, (xmlChar *)"div");
-	if (!new)
-		fatal();
-
+	new = journal_new_node(jnl, doc, "div");
 	for (child = body->children; child; child = next) {
 		next = child->next;
-		xmlUnlinkNode(child);
-		if (!xmlAddChild(new, child))
-			fatal();
+		journal_unlink(jnl, child);
+		journal_add_child(jnl, new, child);
 	}
-	if (!xmlAddChild(body, new))
-		fatal();
+	journal_add_child(jnl, body, new);
 
-	initialize_node(new);
+	initialize_node(ctx, new);
 	return new;
 }
 
 /**
  * Append a node to the content node for the document
  */
-static void append_content(htmlNodePtr content, htmlNodePtr node)
+static void append_content(struct journal *jnl, htmlNodePtr content, htmlNodePtr node)
 {
-	static const char * const to_div_exc[] = {"div", "article", "section", "p"};
+	static const bool to_div_exc[TAG_COUNT] = {
+		[TAG_DIV] = true, [TAG_ARTICLE] = true, [TAG_SECTION] = true,
+		[TAG_P] = true,
+	};
 
-	if (!node_has_tag_array(node, ARRAY_SIZE(to_div_exc), to_div_exc)) {
+	if (!node_has_tag_in(node, to_div_exc)) {
 		/*
 		 * fx: We have a node that isn't a common block level element, like a
 		 * form or td tag. Turn it into a div so it doesn't get filtered out
 		 * later by accident.
 		 */
-		xmlNodeSetName(node, (xmlChar *)"div");
+		journal_set_name(jnl, node, "div");
 	}
-	xmlUnlinkNode(node);
-	if (!xmlAddChild(content, node))
-		fatal();
+	journal_unlink(jnl, node);
+	journal_add_child(jnl, content, node);
 }
 
 /**
@@ -805,29 +787,21 @@ static void append_content(htmlNodePtr content, htmlNodePtr node)
 static bool is_paragraph_with_content(htmlNodePtr node)
 {
 	double link_density;
-	xmlChar *content;
+	const xmlChar *content;
 	int length;
-	bool ret;
 
-	if (!node_has_tag(node, "p"))
+	if (!node_has_tag(node, TAG_P))
 		return false;
 
-	content = node_get_normalized_content(node);
+	content = scratch_normalized_content(node);
 	if (!content)
 		return false;
 	length = strlen((char *)content);
 	link_density = get_link_density(node);
 
-	ret = true;
 	if (length > 80 && link_density < 0.25)
-		goto out;
-	if (link_density == 0 && regex_matches(&sentence_dot_re, content))
-		goto out;
-
-	ret = false;
-out:
-	xmlFree(content);
-	return ret;
+		return true;
+	return link_density == 0 && regex_matches(&sentence_dot_re, content);
 }
 
 /**
@@ -835,7 +809,7 @@ out:
  * content that might also be related. Things like preambles, content split
  * by ads that we removed, etc.
  */
-static htmlNodePtr gather_related_content(htmlNodePtr top)
+static htmlNodePtr gather_related_content(struct journal *jnl, htmlNodePtr top)
 {
 	htmlNodePtr parent = top->parent;
 	double topscore = load_score(top);
@@ -844,10 +818,7 @@ static htmlNodePtr gather_related_content(htmlNodePtr top)
 	htmlNodePtr content;
 	xmlChar *topclass;
 
-	content = xmlNewNode(NULL, (xmlChar *)"div");
-	if (!content)
-		fatal();
-
+	content = journal_new_node(jnl, top->doc, "div");
 	topclass = xmlGetProp(top, (xmlChar *)"class");
 
 	for (child = parent->children; child; child = next) {
@@ -858,7 +829,7 @@ static htmlNodePtr gather_related_content(htmlNodePtr top)
 		next = child->next; /* The child may get unlinked at some point */
 
 		if (child == top) {
-			append_content(content, child);
+			append_content(jnl, content, child);
 			continue;
 		}
 
@@ -874,12 +845,12 @@ static htmlNodePtr gather_related_content(htmlNodePtr top)
 
 		score = load_score(child);
 		if (is_initialized(child) && score + content_bonus >= score_threshold) {
-			append_content(content, child);
+			append_content(jnl, content, child);
 			continue;
 		}
 
 		if (is_paragraph_with_content(child))
-			append_content(content, child);
+			append_content(jnl, content, child);
 	}
 
 	xmlFree(topclass);
@@ -909,20 +880,20 @@ static void create_main_div(htmlNodePtr article)
 
 	for (child = article->children; child; child = next) {
 		next = child->next;
-		xmlUnlinkNode(child);
-		xmlAddChild(div, child);
+		unlink_node(child);
+		append_child(div, child);
 	}
-	xmlAddChild(article, div);
+	append_child(article, div);
 }
 
 /**
  * Save an extracted article in the list of previous attempts
  */
-static void save_attempt(htmlNodePtr article, int article_len)
+static void save_attempt(struct rdr_context *ctx, htmlNodePtr article, int article_len)
 {
 	struct attempt *slot;
 
-	for (slot = &attempts[0]; slot != &attempts[4]; ++slot) {
+	for (slot = &ctx->attempts[0]; slot != &ctx->attempts[4]; ++slot) {
 		if (slot->article)
 			continue;
 		slot->article = article;
@@ -932,11 +903,29 @@ static void save_attempt(htmlNodePtr article, int article_len)
 	assert(false);
 }
 
+/**
+ * Clear the next flag to drop in the sieve approach of needs_one_more_try();
+ * return false if there are none left.
+ */
+static bool drop_next_flag(unsigned int *flags)
+{
+	if (*flags & OPT_STRIP_UNLIKELY)
+		*flags ^= OPT_STRIP_UNLIKELY;
+	else if (*flags & OPT_WEIGHT_CLASSES)
+		*flags ^= OPT_WEIGHT_CLASSES;
+	else if (*flags & OPT_CLEAN_CONDITIONALLY)
+		*flags ^= OPT_CLEAN_CONDITIONALLY;
+	else
+		return false;
+	return true;
+}
+
 /**
  * Do we need to keep working on extracting the contents? If true, save the
- * current attempt and tweak the flags for the next one.
+ * current attempt and tweak the flags for the next one. No more attempts are
+ * started once the deadline in the context has passed.
  */
-static bool needs_one_more_try(htmlNodePtr article)
+static bool needs_one_more_try(struct rdr_context *ctx, htmlNodePtr article)
 {
 	int article_len = text_normalized_content_length(article);
 
@@ -947,30 +936,32 @@ static bool needs_one_more_try(htmlNodePtr article)
 	 * of finding the content, and the sieve approach gives us a higher
 	 * likelihood of finding the -right- content.
 	 */
-	save_attempt(article, article_len);
+	save_attempt(ctx, article, article_len);
 	if (article_len >= DEFAULT_CHAR_THRESHOLD)
 		return false;
 
-	if (options.flags & OPT_STRIP_UNLIKELY)
-		options.flags ^= OPT_STRIP_UNLIKELY;
-	else if (options.flags & OPT_WEIGHT_CLASSES)
-		options.flags ^= OPT_WEIGHT_CLASSES;
-	else if (options.flags & OPT_CLEAN_CONDITIONALLY)
-		options.flags ^= OPT_CLEAN_CONDITIONALLY;
-	else
+	if (!drop_next_flag(&ctx->flags))
 		return false;
-
+	/*
+	 * Out of time, so settle for the best of the attempts saved so far.
+	 * Parallel attempts all started together, so they are done already.
+	 */
+	if (ctx->deadline && !(ctx->flags & OPT_PARALLEL_ATTEMPTS) &&
+	    monotonic_seconds() >= ctx->deadline) {
+		ctx->out_of_time = true;
+		return false;
+	}
 	return true;
 }
 
 /**
  * Free all articles in the attempt list except for the best one that is given
  */
-static void free_attempts_except(htmlNodePtr best)
+static void free_attempts_except(struct rdr_context *ctx, htmlNodePtr best)
 {
 	struct attempt *slot;
 
-	for (slot = &attempts[0]; slot != &attempts[4]; ++slot) {
+	for (slot = &ctx->attempts[0]; slot != &ctx->attempts[4]; ++slot) {
 		if (slot->article != best)
 			free_node(slot->article);
 	}
@@ -979,14 +970,14 @@ static void free_attempts_except(htmlNodePtr best)
 /**
  * Return the best extraction attempt, or NULL if all were a failure
  */
-static htmlNodePtr get_best_attempt(void)
+static htmlNodePtr get_best_attempt(struct rdr_context *ctx)
 {
 	htmlNodePtr article = NULL;
 	struct attempt *slot, *best;
 
 	/* fx: just return the longest text we found during the different loops */
-	best = &attempts[0];
-	for (slot = &attempts[1]; slot != &attempts[4]; ++slot) {
+	best = &ctx->attempts[0];
+	for (slot = &ctx->attempts[1]; slot != &ctx->attempts[4]; ++slot) {
 		if (slot->length <= best->length)
 			continue;
 		best = slot;
@@ -1000,12 +991,14 @@ static htmlNodePtr get_best_attempt(void)
  * fx: Find out text direction from ancestors of final top candidate
  *
  * The given parent is the actual parent of the node in the original html, not
- * its current parent inside the extracted article.
+ * its current parent inside the extracted article. Return NULL if no direction
+ * is found.
  */
-static void extract_text_direction(htmlNodePtr node, htmlNodePtr parent)
+static char *extract_text_direction(htmlNodePtr node, htmlNodePtr parent)
 {
 	htmlNodePtr ancestor = node;
 	xmlChar *direction = NULL;
+	char *ret;
 
 	while (ancestor && !direction) {
 		if (ancestor->name)
@@ -1013,84 +1006,371 @@ static void extract_text_direction(htmlNodePtr node, htmlNodePtr parent)
 		ancestor = (ancestor == node) ? parent : ancestor->parent;
 	}
 	if (!direction)
-		return;
+		return NULL;
 
-	metadata.direction = malloc(strlen((char *)direction) + 1);
-	if (!metadata.direction)
+	ret = malloc(strlen((char *)direction) + 1);
+	if (!ret)
 		fatal_errno();
-	strcpy(metadata.direction, (char *)direction);
+	strcpy(ret, (char *)direction);
 	xmlFree(direction);
+	return ret;
 }
 
+/* The content gathered by an attempt, before the cleanup for presentation */
+struct gathered {
+	htmlNodePtr content;
+	char *direction; /* Text direction for the top candidate, or NULL */
+	bool top_is_new; /* Is the top candidate a new div for the whole body? */
+};
+
+/* Everything left behind by a single extraction attempt */
+struct attempt_result {
+	htmlDocPtr tempdoc; /* Private copy of the document to use, or NULL */
+	htmlNodePtr article;
+	char *direction; /* Text direction for the article, or NULL */
+	struct gathered saved; /* Content that the next attempt can reuse */
+};
+
 /**
- * fx: Using a variety of metrics (content score, classname, element types),
- * find the content that is most likely to be the stuff a user wants to read.
- * Then return it wrapped up in a div.
+ * Find and gather the content for an extraction attempt, with the flags from
+ * the context.
+ *
+ * We may go through several attempts, so every change made to the document is
+ * logged in a journal and undone before returning. Only the content gets
+ * copied, to be cleaned up for presentation.
  */
-static htmlNodePtr grab_article(htmlDocPtr doc)
+static void gather_content(struct rdr_context *ctx, htmlDocPtr doc, struct gathered *gath)
 {
-	htmlNodePtr node, top, top_parent, article;
-	htmlDocPtr tempdoc = NULL;
+	htmlNodePtr node, top, top_parent, content;
+	struct journal jnl = {0};
+	struct node_index index = {0};
 
-	do {
-		bool top_is_new = false;
+	ctx->class_weights_used = false;
+	gath->top_is_new = false;
 
-		/* We may got through several attempts, so preserve the original doc */
-		free_doc(tempdoc);
-		tempdoc = xmlCopyDoc(doc, 1 /* recursive */);
-		if (!tempdoc)
+	node = first_node(doc);
+	while (node) {
+		if (no_need_to_score(ctx, node)) {
+			node = journal_remove_and_get_following(&jnl, node);
+			continue;
+		}
+
+		if (has_default_tag_to_score(node))
+			mark_to_score(node);
+
+		/*
+		 * fx: Turn all divs that don't have children block level elements
+		 * into p's
+		 */
+		if (node_has_tag(node, TAG_DIV)) {
+			node = handle_div_node_for_grab(&jnl, node);
+			continue;
+		}
+		node = following_node(node);
+	}
+
+	/* The tree won't change again until the top candidate is found */
+	build_node_index(&index, doc);
+	assign_content_scores(ctx, &index);
+	top = find_top_candidate(ctx, &index);
+	free_node_index(&index);
+	if (!top) {
+		top = top_candidate_from_all(ctx, &jnl, doc);
+		gath->top_is_new = true;
+	}
+	top_parent = top->parent; /* Save this before unlinking top */
+	content = gather_related_content(&jnl, top);
+	gath->direction = extract_text_direction(top, top_parent);
+
+	/* The content doesn't belong to any document, so it's printed as xml */
+	gath->content = xmlDocCopyNode(content, NULL, 1 /* recursive */);
+	if (!gath->content)
+		fatal();
+
+	undo_journal(&jnl);
+	clear_tree_info(xmlDocGetRootElement(doc));
+}
+
+/**
+ * Will the next attempt, if there is one, gather the same content as the
+ * current one? The byline is the only state shared between attempts, so this
+ * needs the value of found_byline from before the current attempt.
+ *
+ * Only the strip-unlikely flag changes the walk over the document. The class
+ * weights only change the scores if some node actually got a weight, and the
+ * conditional cleaning affects nothing before prep_article().
+ */
+static bool next_attempt_gathers_the_same(const struct rdr_context *ctx, bool found_byline)
+{
+	unsigned int flags = ctx->flags;
+	unsigned int mask = OPT_STRIP_UNLIKELY;
+
+	/* The attempts run at the same time, so there's nothing to reuse */
+	if (ctx->flags & OPT_PARALLEL_ATTEMPTS)
+		return false;
+
+	if (found_byline != ctx->found_byline)
+		return false;
+	if (!drop_next_flag(&flags))
+		return false;
+	if (ctx->class_weights_used)
+		mask |= OPT_WEIGHT_CLASSES;
+	return !((flags ^ ctx->flags) & mask);
+}
+
+/**
+ * Run a single extraction attempt, with the flags from the context. The
+ * article is saved even if it ended up empty. If the previous attempt left its
+ * content for this one, only the cleanup is repeated.
+ */
+static void run_attempt(struct rdr_context *ctx, htmlDocPtr doc, struct attempt_result *res)
+{
+	bool found_byline = ctx->found_byline;
+	struct gathered gath;
+	struct phase_time start;
+	htmlNodePtr article;
+
+	if (res->saved.content) {
+		gath = res->saved;
+		memset(&res->saved, 0, sizeof(res->saved));
+	} else {
+		gather_content(ctx, res->tempdoc ? res->tempdoc : doc, &gath);
+	}
+
+	if (next_attempt_gathers_the_same(ctx, found_byline)) {
+		res->saved.content = xmlCopyNode(gath.content, 1 /* recursive */);
+		if (!res->saved.content)
 			fatal();
+		res->saved.direction = gath.direction ? strdup(gath.direction) : NULL;
+		if (gath.direction && !res->saved.direction)
+			fatal_errno();
+		res->saved.top_is_new = gath.top_is_new;
+	}
 
-		node = first_node(tempdoc);
-		while (node) {
-			if (no_need_to_score(node)) {
-				node = remove_and_get_following(node);
-				continue;
-			}
+	article = gath.content;
+	res->article = article;
+	res->direction = NULL;
 
-			if (has_default_tag_to_score(node))
-				mark_to_score(node);
+	/*
+	 * fx: So we have all of the content that we need. Now we clean it up
+	 * for presentation.
+	 */
+	start_phase(ctx->stats, &start);
+	prep_article(ctx, article);
+	end_phase(ctx->stats, PHASE_PREP_ARTICLE, &start);
+	if (!article->children) { /* Even the top candidate is gone */
+		free(gath.direction);
+		return;
+	}
+	res->direction = gath.direction;
 
-			/*
-			 * fx: Turn all divs that don't have children block level elements
-			 * into p's
-			 */
-			if (node_has_tag(node, "div")) {
-				node = handle_div_node_for_grab(node);
-				continue;
-			}
-			node = following_node(node);
-		}
+	if (gath.top_is_new) /* fx: we already created a fake div thing... */
+		set_main_div_attrs(article->children);
+	else
+		create_main_div(article);
+}
+
+/* A speculative extraction attempt, to run on its own thread */
+struct attempt_job {
+	struct rdr_context ctx; /* Private copy of the context for the attempt */
+	htmlDocPtr doc; /* The original document, shared by all jobs */
+	bool found_byline; /* Value in the context when the job was prepared */
+	char *byline; /* Same */
+	struct attempt_result res;
+	struct rdr_stats stats; /* Used only if the context has stats */
+	pthread_t thread;
+};
+
+/**
+ * Prepare a job for an attempt with the given flags, starting from the current
+ * state of the context
+ */
+static void init_attempt_job(struct attempt_job *job, const struct rdr_context *ctx,
+			     htmlDocPtr doc, unsigned int flags)
+{
+	job->ctx = *ctx;
+	job->ctx.flags = flags;
+	job->doc = doc;
+	job->found_byline = ctx->found_byline;
+	job->byline = ctx->metadata.byline;
+	memset(&job->res, 0, sizeof(job->res));
+	memset(&job->ctx.arena, 0, sizeof(job->ctx.arena));
+
+	/* The threads can't share the stats either, they get merged later */
+	memset(&job->stats, 0, sizeof(job->stats));
+	if (ctx->stats)
+		job->ctx.stats = &job->stats;
+}
+
+/**
+ * Thread function to run the attempt for a job
+ */
+static void *run_attempt_job(void *data)
+{
+	struct attempt_job *job = data;
+	struct phase_time start;
+	struct arena *prev;
 
-		run_on_nodes(tempdoc, assign_content_score);
-		top = find_top_candidate(tempdoc);
-		if (!top) {
-			top = top_candidate_from_all(tempdoc);
-			top_is_new = true;
+	prev = use_arena(&job->ctx.arena);
+	/* The threads can't share the document, so each one needs a copy */
+	if (!job->res.tempdoc) {
+		job->res.tempdoc = xmlCopyDoc(job->doc, 1 /* recursive */);
+		if (!job->res.tempdoc)
+			fatal();
+		copy_document_attrs(job->res.tempdoc, job->doc);
+	}
+	start_phase(job->ctx.stats, &start);
+	run_attempt(&job->ctx, job->doc, &job->res);
+	end_attempt(job->ctx.stats, job->ctx.flags, &start);
+	use_arena(prev);
+	return NULL;
+}
+
+/**
+ * Thread function for the jobs that don't run on the main thread; those that
+ * do get their info structs counted by parse().
+ */
+static void *run_attempt_thread(void *data)
+{
+	struct attempt_job *job = data;
+
+	run_attempt_job(job);
+	job->stats.node_infos = node_infos_allocated();
+	return NULL;
+}
+
+/**
+ * Free everything left behind by a job whose attempt won't be used
+ */
+static void discard_attempt_job(struct attempt_job *job)
+{
+	if (job->ctx.metadata.byline != job->byline)
+		free(job->ctx.metadata.byline);
+	free(job->res.direction);
+	free_node(job->res.article);
+	free_doc(job->res.tempdoc);
+	free_arena(&job->ctx.arena);
+}
+
+/**
+ * Same as grab_article(), but all the attempts that may be needed are run at
+ * the same time, each on its own thread. The result is then picked exactly as
+ * it would have been if they had run one after the other.
+ */
+static htmlNodePtr grab_article_in_parallel(struct rdr_context *ctx, htmlDocPtr doc)
+{
+	struct attempt_job jobs[ARRAY_SIZE(ctx->attempts)];
+	unsigned int flags = ctx->flags;
+	htmlNodePtr article;
+	char *direction = NULL;
+	int count = 0, used, i, err;
+
+	/*
+	 * The threads will share the cache, so it can't change after this. All the
+	 * classes and ids in the document are already in there.
+	 */
+	freeze_class_cache(ctx->class_cache);
+
+	/* Predict the flags for each attempt, the same as needs_one_more_try() */
+	do {
+		init_attempt_job(&jobs[count++], ctx, doc, flags);
+	} while (count < (int)ARRAY_SIZE(jobs) && drop_next_flag(&flags));
+
+	/* The first attempt is the one most likely to be needed, so run it here */
+	for (i = 1; i < count; ++i) {
+		err = pthread_create(&jobs[i].thread, NULL, run_attempt_thread, &jobs[i]);
+		if (err) {
+			errno = err;
+			fatal_errno();
+		}
+	}
+	run_attempt_job(&jobs[0]);
+	for (i = 1; i < count; ++i) {
+		err = pthread_join(jobs[i].thread, NULL);
+		if (err) {
+			errno = err;
+			fatal_errno();
 		}
-		top_parent = top->parent; /* Save this before unlinking top */
-		article = gather_related_content(top);
+	}
+
+	/* Go over the attempts in their serial order, until one is good enough */
+	for (used = 0; used < count; ++used) {
+		struct attempt_job *job = &jobs[used];
 
 		/*
-		 * fx: So we have all of the content that we need. Now we clean it up
-		 * for presentation.
+		 * The only state shared between attempts is the byline, which an
+		 * earlier attempt may have found. This is rare enough that we can
+		 * just repeat the attempt if the guess was wrong.
 		 */
-		prep_article(article);
-		if (!article->children) /* Even the top candidate is gone */
-			continue;
+		if (job->found_byline != ctx->found_byline) {
+			discard_attempt_job(job);
+			init_attempt_job(job, ctx, doc, job->ctx.flags);
+			run_attempt_job(job);
+		}
+		ctx->found_byline = job->ctx.found_byline;
+		ctx->metadata.byline = job->ctx.metadata.byline;
 
-		if (top_is_new) /* fx: we already created a fake div thing... */
-			set_main_div_attrs(top);
-		else
-			create_main_div(article);
-	} while (needs_one_more_try(article));
+		free(direction);
+		direction = job->res.direction;
+		job->res.direction = NULL;
+
+		assert(ctx->flags == job->ctx.flags);
+		if (!needs_one_more_try(ctx, job->res.article)) {
+			++used;
+			break;
+		}
+	}
+
+	article = get_best_attempt(ctx);
+	if (article)
+		ctx->metadata.direction = direction;
+	else
+		free(direction);
+	free_attempts_except(ctx, article);
+
+	/* The info structs for the articles of these jobs must live on */
+	for (i = 0; i < used; ++i) {
+		free_doc(jobs[i].res.tempdoc);
+		arena_adopt(&ctx->arena, &jobs[i].ctx.arena);
+		if (ctx->stats)
+			add_stats(ctx->stats, &jobs[i].stats);
+	}
+	for (i = used; i < count; ++i)
+		discard_attempt_job(&jobs[i]);
+	return article;
+}
+
+/**
+ * fx: Using a variety of metrics (content score, classname, element types),
+ * find the content that is most likely to be the stuff a user wants to read.
+ * Then return it wrapped up in a div.
+ */
+static htmlNodePtr grab_article(struct rdr_context *ctx, htmlDocPtr doc)
+{
+	struct attempt_result res = {0};
+	struct phase_time start;
+	htmlNodePtr article;
+
+	if (ctx->flags & OPT_PARALLEL_ATTEMPTS)
+		return grab_article_in_parallel(ctx, doc);
+
+	do {
+		free(res.direction);
+		start_phase(ctx->stats, &start);
+		run_attempt(ctx, doc, &res);
+		end_attempt(ctx->stats, ctx->flags, &start);
+	} while (needs_one_more_try(ctx, res.article));
 
-	article = get_best_attempt();
+	article = get_best_attempt(ctx);
 	if (article)
-		extract_text_direction(top, top_parent);
-	free_attempts_except(article);
+		ctx->metadata.direction = res.direction;
+	else
+		free(res.direction);
+	free_attempts_except(ctx, article);
 
-	free_doc(tempdoc);
+	/* The last attempt may have expected one more */
+	free_node(res.saved.content);
+	free(res.saved.direction);
 	return article;
 }
 
@@ -1101,7 +1381,7 @@ static bool is_image_placeholder(htmlNodePtr node)
 {
 	xmlAttrPtr attr;
 
-	if (!node_has_tag(node, "img"))
+	if (!node_has_tag(node, TAG_IMG))
 		return false;
 
 	for (attr = node->properties; attr; attr = attr->next) {
@@ -1131,7 +1411,7 @@ static bool is_image_placeholder(htmlNodePtr node)
  */
 static htmlNodePtr get_single_image(htmlNodePtr node)
 {
-	if (node_has_tag(node, "img"))
+	if (node_has_tag(node, TAG_IMG))
 		return node;
 
 	while (node) {
@@ -1147,7 +1427,7 @@ static htmlNodePtr get_single_image(htmlNodePtr node)
 				return NULL;
 			}
 		}
-		if (node_has_tag(elem_child, "img"))
+		if (node_has_tag(elem_child, TAG_IMG))
 			return elem_child;
 		node = elem_child;
 	}
@@ -1224,7 +1504,7 @@ static void *unwrap_if_noscript_image(htmlNodePtr node)
 {
 	htmlNodePtr prev, newimg, oldimg;
 
-	if (!node_has_tag(node, "noscript"))
+	if (!node_has_tag(node, TAG_NOSCRIPT))
 		return NULL;
 	newimg = get_single_image(node);
 	if (!newimg)
@@ -1243,7 +1523,7 @@ static void *unwrap_if_noscript_image(htmlNodePtr node)
 	 * contains image.
 	 */
 	copy_image_attrs(newimg, oldimg);
-	xmlReplaceNode(prev, newimg);
+	replace_node(prev, newimg);
 	free_node(prev);
 	return NULL;
 }
@@ -1271,15 +1551,15 @@ static void unwrap_noscript_images(htmlDocPtr doc)
  */
 static bool is_script_or_noscript(htmlNodePtr node)
 {
-	if (node_has_tag(node, "noscript"))
+	if (node_has_tag(node, TAG_NOSCRIPT))
 		return true;
-	if (node_has_tag(node, "script")) {
+	if (node_has_tag(node, TAG_SCRIPT)) {
 		xmlAttrPtr src = xmlHasProp(node, (xmlChar *)"src");
 
 		/* I don't see how this is necessary at all, but just follow firefox */
 		if (src && xmlRemoveProp(src) < 0)
 			fatal();
-		xmlNodeSetContent(node, (xmlChar *)"");
+		set_node_content(node, "");
 		return true;
 	}
 	return false;
@@ -1290,7 +1570,7 @@ static bool is_script_or_noscript(htmlNodePtr node)
  */
 static bool is_double_br(htmlNodePtr node)
 {
-	return node_has_tag(node, "br") && node_has_tag(next_element(node), "br");
+	return node_has_tag(node, TAG_BR) && node_has_tag(next_element(node), TAG_BR);
 }
 
 /**
@@ -1305,20 +1585,20 @@ static void *replace_brs(htmlNodePtr node)
 	htmlNodePtr next;
 	bool replaced = false;
 
-	if (!node_has_tag(node, "br"))
+	if (!node_has_tag(node, TAG_BR))
 		return NULL;
 
 	for (next = next_element(node); next; next = next_element(node)) {
-		if (!node_has_tag(next, "br"))
+		if (!node_has_tag(next, TAG_BR))
 			break;
 		replaced = true;
-		xmlUnlinkNode(next);
+		unlink_node(next);
 		free_node(next);
 	}
 	if (!replaced)
 		return NULL;
 
-	xmlNodeSetName(node, (xmlChar *)"p");
+	set_node_name(node, "p");
 	for (next = node->next; next; next = node->next) {
 		/*
 		 * fx: If we've hit another <br><br>, we're done adding children
@@ -1328,14 +1608,13 @@ static void *replace_brs(htmlNodePtr node)
 			break;
 
 		/* fx: make this node a child of the new <p> */
-		xmlUnlinkNode(next);
-		if (!xmlAddChild(node, next))
-			fatal();
+		unlink_node(next);
+		append_child(node, next);
 	}
-	prune_trailing_whitespace(node);
+	prune_trailing_whitespace(NULL, node);
 
-	if (node_has_tag(node->parent, "p"))
-		xmlNodeSetName(node->parent, (xmlChar *)"div");
+	if (node_has_tag(node->parent, TAG_P))
+		set_node_name(node->parent, "div");
 	return NULL;
 }
 
@@ -1348,10 +1627,10 @@ static void prep_document(htmlDocPtr doc)
 	htmlNodePtr node = first_node(doc);
 
 	while (node) {
-		if (node_has_tag(node, "style")) {
+		if (node_has_tag(node, TAG_STYLE)) {
 			node = remove_and_get_following(node);
-		} else if (node_has_tag(node, "font")) {
-			xmlNodeSetName(node, (xmlChar *)"span");
+		} else if (node_has_tag(node, TAG_FONT)) {
+			set_node_name(node, "span");
 			node = following_node(node);
 		} else {
 			node = following_node(node);
@@ -1363,14 +1642,14 @@ static void prep_document(htmlDocPtr doc)
 /**
  * Replace a relative URL with its absolute version
  */
-static void to_absolute_url(xmlChar **url)
+static void to_absolute_url(const struct rdr_context *ctx, xmlChar **url)
 {
 	xmlChar *original = *url;
 	xmlChar *result;
 	size_t i;
 
 	/* fx: Leave hash links alone if the base URI matches the document URI */
-	if (!(options.flags & OPT_URL_OVERRIDE) && original[0] == '#')
+	if (!(ctx->flags & OPT_URL_OVERRIDE) && original[0] == '#')
 		return;
 
 	/* Trailing whitespace in the URL seems to confuse libxml2 */
@@ -1381,13 +1660,227 @@ static void to_absolute_url(xmlChar **url)
 		original[i] = '\0';
 	}
 
-	result = xmlBuildURI(original, (xmlChar *)options.base_url);
+	result = xmlBuildURI(original, (xmlChar *)ctx->base_url);
 	if (!result)
 		return;
 	xmlFree(original);
 	*url = result;
 }
 
+/*
+ * The base for all the relative urls of an article, resolved only once. Its
+ * parts are taken from libxml2 itself, by resolving a few probes against it,
+ * so that the simple relative urls can just be appended to the right part and
+ * still come out exactly as xmlBuildURI() would have built them. Anything
+ * more complicated falls back to xmlBuildURI().
+ */
+struct url_resolver {
+	const struct rdr_context *ctx;
+	char *scheme; /* Prefix for urls like "//host/path", or NULL if unknown */
+	char *root; /* Prefix for urls like "/path", or NULL */
+	char *dir; /* Prefix for urls like "path", or NULL */
+	char *buf; /* The last url or srcset resolved, null-terminated */
+	size_t len;
+	size_t size; /* Allocated for the buffer */
+};
+
+/**
+ * Resolve a probe url against the base; return the part of the result that
+ * comes before the probe, or NULL if that's not how the result looks.
+ */
+static char *get_base_prefix(const char *base, const char *probe)
+{
+	xmlChar *result;
+	size_t len, probe_len = strlen(probe);
+
+	result = xmlBuildURI((xmlChar *)probe, (xmlChar *)base);
+	if (!result)
+		return NULL;
+	len = strlen((char *)result);
+	if (len < probe_len || strcmp((char *)result + len - probe_len, probe) != 0) {
+		xmlFree(result);
+		return NULL;
+	}
+	result[len - probe_len] = '\0';
+	return (char *)result;
+}
+
+/**
+ * Prepare a resolver for the base url of the context, once it's final
+ */
+static void init_url_resolver(struct url_resolver *res, const struct rdr_context *ctx)
+{
+	memset(res, 0, sizeof(*res));
+	res->ctx = ctx;
+	res->scheme = get_base_prefix(ctx->base_url, "//x");
+	/* A relative base gets the whole url normalized, so it needs libxml2 */
+	if (res->scheme && !*res->scheme) {
+		xmlFree(res->scheme);
+		res->scheme = NULL;
+	}
+	if (!res->scheme)
+		return;
+	res->root = get_base_prefix(ctx->base_url, "/x");
+	res->dir = get_base_prefix(ctx->base_url, "x");
+}
+
+/**
+ * Free all memory held by a resolver
+ */
+static void clean_url_resolver(struct url_resolver *res)
+{
+	xmlFree(res->scheme);
+	xmlFree(res->root);
+	xmlFree(res->dir);
+	free(res->buf);
+	memset(res, 0, sizeof(*res));
+}
+
+/**
+ * Append a string of the given length to the buffer of the resolver, and keep
+ * it null-terminated
+ */
+static void append_to_url_buf(struct url_resolver *res, const char *str, size_t len)
+{
+	if (res->len + len + 1 > res->size) {
+		res->size = MAX(2 * res->size, res->len + len + 1);
+		res->buf = realloc(res->buf, res->size);
+		if (!res->buf)
+			fatal_errno();
+	}
+	memcpy(res->buf + res->len, str, len);
+	res->len += len;
+	res->buf[res->len] = '\0';
+}
+
+/**
+ * Is this character always copied as it is by xmlBuildURI()? Percent escapes
+ * are not, they may get decoded.
+ */
+static bool is_plain_url_char(char c)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+		return true;
+	return c && strchr("!$&'()*+,-./;=@_~", c);
+}
+
+/**
+ * Does the path segment get normalized? That happens to dot segments, and to
+ * empty segments other than the last.
+ */
+static bool is_special_segment(const char *seg)
+{
+	size_t len = strcspn(seg, "/?#");
+
+	if (!len)
+		return seg[0] == '/';
+	return (len == 1 && seg[0] == '.') || (len == 2 && seg[0] == '.' && seg[1] == '.');
+}
+
+/**
+ * Get the part of the base that a url only needs appended to become absolute,
+ * or NULL if it's not that simple. The urls that libxml2 leaves alone in any
+ * case get an empty prefix.
+ */
+static const char *get_url_prefix(const struct url_resolver *res, const char *url)
+{
+	const char *prefix, *pos;
+	bool empty_ok = false; /* Can the first segment be empty? */
+
+	/* A scheme, or an invalid url; either way, xmlBuildURI() won't touch it */
+	for (pos = url; *pos && !strchr("/?#", *pos); ++pos) {
+		if (*pos == ':')
+			return "";
+	}
+
+	if (url[0] == '/' && url[1] == '/') {
+		/* Only a plain host name, userinfo and ports have their quirks */
+		for (pos = url + 2; *pos && !strchr("/?#", *pos); ++pos) {
+			if (!is_plain_url_char(*pos) || strchr("!$&'()*+,;=@", *pos))
+				return NULL;
+		}
+		prefix = res->scheme;
+		pos = url + 2;
+	} else if (url[0] == '/') {
+		prefix = res->root;
+		pos = url + 1;
+		empty_ok = true;
+	} else {
+		prefix = res->dir;
+		pos = url;
+	}
+	/* No host, or nothing at all before the query or fragment */
+	if (!empty_ok && (!*pos || strchr("/?#", *pos)))
+		return NULL;
+
+	/* The path must go untouched, segment by segment */
+	while (true) {
+		if (is_special_segment(pos))
+			return NULL;
+		for (; *pos && !strchr("/?#", *pos); ++pos) {
+			if (!is_plain_url_char(*pos))
+				return NULL;
+		}
+		if (*pos != '/')
+			break;
+		++pos;
+	}
+
+	/* The query and the fragment are not normalized at all */
+	if (*pos == '?') {
+		for (++pos; *pos && *pos != '#'; ++pos) {
+			if (!is_plain_url_char(*pos) && *pos != '?')
+				return NULL;
+		}
+	}
+	if (*pos == '#') {
+		for (++pos; *pos; ++pos) {
+			if (!is_plain_url_char(*pos) && *pos != '?')
+				return NULL;
+		}
+	}
+	return prefix;
+}
+
+/**
+ * Append to the buffer of the resolver the absolute version of a url, which is
+ * only changed while it's being read
+ */
+static void append_resolved_url(struct url_resolver *res, char *url)
+{
+	const struct rdr_context *ctx = res->ctx;
+	const char *prefix;
+	xmlChar *result = NULL;
+	size_t len = strlen(url);
+	char saved;
+
+	/* fx: Leave hash links alone if the base URI matches the document URI */
+	if (!(ctx->flags & OPT_URL_OVERRIDE) && url[0] == '#') {
+		append_to_url_buf(res, url, len);
+		return;
+	}
+
+	/* Trailing whitespace in the URL seems to confuse libxml2 */
+	while (len && isspace((unsigned char)url[len - 1]))
+		--len;
+	saved = url[len];
+	url[len] = '\0';
+
+	prefix = get_url_prefix(res, url);
+	if (prefix) {
+		append_to_url_buf(res, prefix, strlen(prefix));
+		append_to_url_buf(res, url, len);
+	} else {
+		result = xmlBuildURI((xmlChar *)url, (xmlChar *)ctx->base_url);
+		if (result)
+			append_to_url_buf(res, (char *)result, strlen((char *)result));
+		else
+			append_to_url_buf(res, url, len);
+	}
+	url[len] = saved;
+	xmlFree(result);
+}
+
 /**
  * Remove a node but preserve its children in the same location; return a
  * pointer to this new node.
@@ -1415,13 +1908,12 @@ static htmlNodePtr remove_but_preserve_content(htmlNodePtr node)
 	new = xmlNewNode(NULL, (xmlChar *)"span");
 	for (child = node->children; child; child = next) {
 		next = child->next;
-		xmlUnlinkNode(child);
-		if (!xmlAddChild(new, child))
-			fatal();
+		unlink_node(child);
+		append_child(new, child);
 	}
 
 replace:
-	xmlReplaceNode(node, new);
+	replace_node(node, new);
 	free_node(node);
 	return new;
 }
@@ -1430,11 +1922,12 @@ replace:
  * If the node is a link, get rid of any relative or javascript URLs. If this
  * involves replacing the node altogether, return the new node in its location.
  */
-static htmlNodePtr fix_non_absolute_link(htmlNodePtr node)
+static htmlNodePtr fix_non_absolute_link(htmlNodePtr node, void *data)
 {
+	struct url_resolver *res = data;
 	xmlChar *href = NULL;
 
-	if (!node_has_tag(node, "a"))
+	if (!node_has_tag(node, TAG_A))
 		goto out;
 	href = xmlGetProp(node, (xmlChar *)"href");
 	if (!href)
@@ -1446,207 +1939,103 @@ static htmlNodePtr fix_non_absolute_link(htmlNodePtr node)
 		goto out;
 	}
 
-	to_absolute_url(&href);
-	xmlSetProp(node, (xmlChar *)"href", href);
+	res->len = 0;
+	append_resolved_url(res, (char *)href);
+	if (strcmp(res->buf, (char *)href) != 0)
+		xmlSetProp(node, (xmlChar *)"href", (xmlChar *)res->buf);
 
 out:
 	xmlFree(href);
 	return node;
 }
 
-struct srcset_entry {
-	char *url;
-	char *size;
-};
-
 /**
- * Parse a single item from a srcset into the url and size buffers; return the
- * length of the item, or 0 on failure.
+ * Convert all relative URLs in a srcset to absolute URLs, and leave the new
+ * srcset in the buffer of the resolver. The string is only changed while it's
+ * being read.
  */
-static int parse_srcset_item(const char *srcset, char *url, char *size)
+static void resolve_srcset(struct url_resolver *res, char *srcset)
 {
-	const char *start = srcset;
-	int i;
-
-	url[0] = size[0] = '\0';
-
-	for (; isspace(*srcset); ++srcset);
-
-	for (i = 0; *srcset && !isspace(*srcset); ++srcset, ++i)
-		url[i] = *srcset;
-	if (i == 0)
-		return 0;
-
-	if (url[i - 1] == ',') {
-		url[i - 1] = '\0';
-		return srcset - start;
-	}
-	url[i] = '\0';
-
-	for (; isspace(*srcset); ++srcset);
+	bool first = true;
 
-	/* If a srcset item has a size, it doesn't need a space after the comma */
-	for (i = 0; *srcset && *srcset != ','; ++srcset, ++i)
-		size[i] = *srcset;
-	size[i] = '\0';
-	if (*srcset == ',')
-		++srcset;
-
-	return srcset - start;
-}
-
-/**
- * Parse a srcset property into an array of srcset_entry structs
- */
-static struct srcset_entry *parse_srcset(const char *srcset)
-{
-	size_t len = strlen(srcset) + 1;
-	struct srcset_entry *ents;
-	int url_bound, i;
+	res->len = 0;
+	append_to_url_buf(res, "", 0);
+	while (true) {
+		char *url, *url_end, *size = NULL;
+		size_t sizelen = 0;
+		char saved;
 
-	/* Only an upper bound, because there might be commas inside the URLs */
-	url_bound = char_count(srcset, ',') + 1;
-	/* The extra NULL entry at the end acts as a terminator */
-	ents = calloc(url_bound + 1, sizeof(*ents));
-
-	for (i = 0; i < url_bound; ++i) {
-		char *url, *size;
-		int ret;
-
-		/* Again, extremely coarse upper bounds */
-		url = malloc(len);
-		size = malloc(len);
-		if (!url || !size)
-			fatal();
-
-		ret = parse_srcset_item(srcset, url, size);
-		if (!ret) {
-			free(url);
-			free(size);
+		for (; isspace((unsigned char)*srcset); ++srcset);
+		url = srcset;
+		for (; *srcset && !isspace((unsigned char)*srcset); ++srcset);
+		if (srcset == url)
 			break;
-		}
-		ents[i].url = url;
-		ents[i].size = size;
-		srcset += ret;
-	}
-	return ents;
-}
+		url_end = srcset;
 
-/**
- * Replace relative with absolute URLs in an array of srcset_entry structs
- */
-static void to_absolute_srcset_entries(struct srcset_entry *ents)
-{
-	while (ents->url) {
-		to_absolute_url((xmlChar **)&ents->url);
-		++ents;
-	}
-}
-
-/**
- * Assemble a srcset property from an array of srcset_entry structs
- */
-static char *build_srcset(struct srcset_entry *ents)
-{
-	struct srcset_entry *curr;
-	char *srcset;
-	size_t len = 0;
-
-	/* Find the length for the new srcset */
-	curr = ents;
-	while (curr->url) {
-		size_t url_len, sizelen;
-
-		url_len = strlen(curr->url);
-		sizelen = curr->size ? strlen(curr->size) : 0;
-		if (url_len > 4096 || sizelen > 4096)
-			break;
-		len += url_len + sizelen + 3; /* Two spaces and a comma */
-		++curr;
-	}
-	len += 1; /* The null termination */
+		if (url_end[-1] == ',') {
+			--url_end;
+		} else {
+			for (; isspace((unsigned char)*srcset); ++srcset);
+			/* If a srcset item has a size, it doesn't need a space after the comma */
+			size = srcset;
+			for (; *srcset && *srcset != ','; ++srcset);
+			sizelen = srcset - size;
+			if (*srcset == ',')
+				++srcset;
+		}
 
-	srcset = malloc(len);
-	if (!srcset)
-		fatal_errno();
-	srcset[0] = '\0';
-
-	/* Now get it assembled */
-	curr = ents;
-	while (curr->url) {
-		if (curr != ents)
-			strcat(srcset, ", ");
-		strcat(srcset, curr->url);
-		if (*curr->size) {
-			strcat(srcset, " ");
-			strcat(srcset, curr->size);
+		if (!first)
+			append_to_url_buf(res, ", ", 2);
+		first = false;
+		saved = *url_end;
+		*url_end = '\0';
+		append_resolved_url(res, url);
+		*url_end = saved;
+		if (sizelen) {
+			append_to_url_buf(res, " ", 1);
+			append_to_url_buf(res, size, sizelen);
 		}
-		++curr;
 	}
-	return srcset;
 }
 
-/**
- * Clean up an array of srcset_entry structs
- */
-static void free_srcset(struct srcset_entry *ents)
-{
-	struct srcset_entry *curr = ents;
-
-	while (curr->url) {
-		free(curr->url);
-		free(curr->size);
-		++curr;
-	}
-	free(ents);
-}
+static const bool MEDIA_ELEMS[TAG_COUNT] = {
+	[TAG_IMG] = true, [TAG_PICTURE] = true, [TAG_FIGURE] = true,
+	[TAG_VIDEO] = true, [TAG_AUDIO] = true, [TAG_SOURCE] = true,
+};
 
 /**
- * Convert all relative URLs in a srcset to absolute URLs
+ * Make the url in an attribute of the node absolute. The attribute is only set
+ * again if it changed, which is rare for media urls.
  */
-static void to_absolute_srcset(xmlChar **srcset_p)
+static void fix_url_attr(struct url_resolver *res, htmlNodePtr node, const char *name)
 {
-	struct srcset_entry *ents;
+	xmlChar *url;
 
-	ents = parse_srcset((char *)*srcset_p);
-	to_absolute_srcset_entries(ents);
-	xmlFree(*srcset_p);
-	*srcset_p = (xmlChar *)build_srcset(ents);
-	free_srcset(ents);
+	url = xmlGetProp(node, (xmlChar *)name);
+	if (!url)
+		return;
+	if (strcmp(name, "srcset") == 0) {
+		resolve_srcset(res, (char *)url);
+	} else {
+		res->len = 0;
+		append_resolved_url(res, (char *)url);
+	}
+	if (strcmp(res->buf, (char *)url) != 0)
+		xmlSetProp(node, (xmlChar *)name, (xmlChar *)res->buf);
+	xmlFree(url);
 }
 
-static const char * const MEDIA_ELEMS[] = {
-	"img", "picture", "figure", "video", "audio", "source",
-};
-
 /**
  * If the node is a media element, convert it to an absolute URL
  */
-static htmlNodePtr fix_relative_media(htmlNodePtr node)
+static htmlNodePtr fix_relative_media(htmlNodePtr node, void *res)
 {
-	xmlChar *urls;
-
-	if (!node_has_tag_array(node, ARRAY_SIZE(MEDIA_ELEMS), MEDIA_ELEMS))
+	if (!node_has_tag_in(node, MEDIA_ELEMS))
 		return node;
 
-	urls = xmlGetProp(node, (xmlChar *)"src");
-	if (urls) {
-		to_absolute_url(&urls);
-		xmlSetProp(node, (xmlChar *)"src", urls);
-		xmlFree(urls);
-	}
-	urls = xmlGetProp(node, (xmlChar *)"poster");
-	if (urls) {
-		to_absolute_url(&urls);
-		xmlSetProp(node, (xmlChar *)"poster", urls);
-		xmlFree(urls);
-	}
-	urls = xmlGetProp(node, (xmlChar *)"srcset");
-	if (urls) {
-		to_absolute_srcset(&urls);
-		xmlSetProp(node, (xmlChar *)"srcset", urls);
-		xmlFree(urls);
-	}
+	fix_url_attr(res, node, "src");
+	fix_url_attr(res, node, "poster");
+	fix_url_attr(res, node, "srcset");
 	return node;
 }
 
@@ -1656,10 +2045,14 @@ static htmlNodePtr fix_relative_media(htmlNodePtr node)
  *
  * TODO: add a cli option to preserve the relative URLs
  */
-static void fix_all_relative_urls(htmlNodePtr article)
+static void fix_all_relative_urls(struct rdr_context *ctx, htmlNodePtr article)
 {
-	change_descendants(article, fix_non_absolute_link);
-	change_descendants(article, fix_relative_media);
+	struct url_resolver res;
+
+	init_url_resolver(&res, ctx);
+	change_descendants_with_data(article, fix_non_absolute_link, &res);
+	change_descendants_with_data(article, fix_relative_media, &res);
+	clean_url_resolver(&res);
 }
 
 /**
@@ -1669,17 +2062,17 @@ static void fix_all_relative_urls(htmlNodePtr article)
 static htmlNodePtr clean_classes(htmlNodePtr node)
 {
 	xmlChar *class_list;
-	char *class;
+	char *class, *saveptr;
 
 	class_list = xmlGetProp(node, (xmlChar *)"class");
 	if (!class_list)
 		return node;
 
-	class = strtok((char *)class_list, " ");
+	class = strtok_r((char *)class_list, " ", &saveptr);
 	while (class) {
 		if (strcmp((char *)class, "page") == 0) /* Set by ourselves */
 			break;
-		class = strtok(NULL, " ");
+		class = strtok_r(NULL, " ", &saveptr);
 	}
 	if (class) /* The node has the page class */
 		xmlSetProp(node, (xmlChar *)"class", (xmlChar *)"page");
@@ -1699,35 +2092,36 @@ static htmlNodePtr clean_if_text_node(htmlNodePtr node)
 	 * libxml2 will indent tags even inside preformatted blocks, so get
 	 * rid of the inner tag entirely.
 	 */
-	if (node_has_tag(node, "code") && node_has_tag(node->parent, "pre")) {
+	if (node_has_tag(node, TAG_CODE) && node_has_tag(node->parent, TAG_PRE)) {
 		htmlNodePtr parent = node->parent;
 
-		xmlReplaceNode(parent, node);
+		replace_node(parent, node);
 		free_node(parent);
-		xmlNodeSetName(node, (xmlChar *)"pre");
+		set_node_name(node, "pre");
 	} else if (xmlNodeIsText(node)) {
-		xmlChar *content = node_get_normalized_or_preformatted(node);
-
-		xmlNodeSetContent(node, content);
-		xmlFree(content);
+		/* Respect the whitespace for preformatted text */
+		if (!has_ancestor_tag(node, TAG_CODE) && !has_ancestor_tag(node, TAG_PRE))
+			set_node_content(node, (char *)scratch_normalized_content(node));
 	}
 	return node;
 }
 
 /**
- * If the document provides a base URL, set it in the global options
+ * If the document provides a base URL, set it in the context
  */
-void set_base_url_from_doc(htmlDocPtr doc)
+static void set_base_url_from_doc(struct rdr_context *ctx, htmlDocPtr doc)
 {
 	xmlChar *meta_url;
 
-	meta_url = xmlGetProp(first_node_with_tag(doc, "base"), (xmlChar *)"href");
+	meta_url = xmlGetProp(first_node_with_tag(doc, TAG_BASE), (xmlChar *)"href");
 	if (!meta_url)
 		return;
 
-	to_absolute_url(&meta_url);
-	options.base_url = (char *)meta_url;
-	options.flags |= OPT_URL_OVERRIDE;
+	to_absolute_url(ctx, &meta_url);
+	xmlFree(ctx->doc_base_url);
+	ctx->doc_base_url = (char *)meta_url;
+	ctx->base_url = ctx->doc_base_url;
+	ctx->flags |= OPT_URL_OVERRIDE;
 }
 
 /**
@@ -1747,8 +2141,8 @@ static bool is_comment(htmlNodePtr node)
  */
 static htmlNodePtr fill_if_not_self_closing(htmlNodePtr node)
 {
-	if (node_has_tag(node, "iframe", "em", "a") && !node->children)
-		xmlNodeSetContent(node, (xmlChar *)" ");
+	if (node_has_tag(node, TAG_IFRAME, TAG_EM, TAG_A) && !node->children)
+		set_node_content(node, " ");
 	return node;
 }
 
@@ -1763,11 +2157,11 @@ static void remove_root_siblings(htmlDocPtr doc)
 	assert(root);
 
 	for (sib = root->next; sib; sib = root->next) {
-		xmlUnlinkNode(sib);
+		unlink_node(sib);
 		free_node(sib);
 	}
 	for (sib = root->prev; sib; sib = root->prev) {
-		xmlUnlinkNode(sib);
+		unlink_node(sib);
 		free_node(sib);
 	}
 }
@@ -1777,7 +2171,7 @@ static void remove_root_siblings(htmlDocPtr doc)
  */
 static char *first_paragraph_content(htmlNodePtr article)
 {
-	htmlNodePtr node = first_descendant_with_tag(article, "p");
+	htmlNodePtr node = first_descendant_with_tag(article, TAG_P);
 
 	return (char *)node_get_normalized_content(node);
 }
@@ -1785,12 +2179,67 @@ static char *first_paragraph_content(htmlNodePtr article)
 /**
  * Clean up the extracted metadata for presentation
  */
-static void clean_metadata(void)
+static void clean_metadata(struct metadata *metadata)
 {
-	trim_and_unescape(&metadata.title);
-	trim_and_unescape(&metadata.byline);
-	trim_and_unescape(&metadata.excerpt);
-	trim_and_unescape(&metadata.site_name);
+	trim_and_unescape(&metadata->title);
+	trim_and_unescape(&metadata->byline);
+	trim_and_unescape(&metadata->excerpt);
+	trim_and_unescape(&metadata->site_name);
+}
+
+/**
+ * Count the nodes in a tree, the root included
+ */
+static unsigned long count_nodes(htmlNodePtr root)
+{
+	unsigned long count = 0;
+	htmlNodePtr node = root;
+
+	while (node) {
+		++count;
+		if (node->children) {
+			node = node->children;
+			continue;
+		}
+		while (node != root && !node->next)
+			node = node->parent;
+		node = node == root ? NULL : node->next;
+	}
+	return count;
+}
+
+/**
+ * Prepare a context for the extraction of a new document. The flags are those
+ * of the options struct, and the base url is used for all relative links
+ * unless the document overrides it; it must remain valid until the context
+ * is cleaned.
+ */
+void init_context(struct rdr_context *ctx, unsigned int flags, const char *base_url)
+{
+	init_regexes();
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->flags = flags;
+	ctx->base_url = base_url;
+	ctx->best_title_i = UINT_MAX;
+	ctx->best_byline_i = UINT_MAX;
+	ctx->best_excerpt_i = UINT_MAX;
+	ctx->class_cache = new_class_cache();
+}
+
+/**
+ * Free all memory held by a context, including the metadata fields
+ */
+void clean_context(struct rdr_context *ctx)
+{
+	free(ctx->metadata.title);
+	free(ctx->metadata.byline);
+	free(ctx->metadata.excerpt);
+	free(ctx->metadata.site_name);
+	free(ctx->metadata.direction);
+	xmlFree(ctx->doc_base_url);
+	free_class_cache(ctx->class_cache);
+	free_arena(&ctx->arena);
+	memset(ctx, 0, sizeof(*ctx));
 }
 
 /**
@@ -1802,43 +2251,162 @@ static void clean_metadata(void)
  *  3. Grab the article content from the current dom tree.
  *  4. Replace the current DOM tree with the new one.
  *  5. Read peacefully.
+ *
+ * The context must be initialized, and the extracted metadata is saved there.
+ * Release the returned article with free_node(), and the doc with free_doc();
+ * for library users, those are just xmlFreeNode() and xmlFreeDoc().
+ * The info structs attached to their nodes go away with the context. If the
+ * context has a node limit and the document goes over it, NULL is returned.
  */
-htmlNodePtr parse(htmlDocPtr doc)
+htmlNodePtr parse(struct rdr_context *ctx, htmlDocPtr doc)
 {
-	htmlNodePtr article, content;
+	htmlNodePtr article, content = NULL;
+	struct phase_time start;
+	unsigned long infos = node_infos_allocated();
+	unsigned long nodes = 0;
+	struct arena *prev;
 
 	if (!xmlDocGetRootElement(doc))
 		return NULL;
+	prev = use_arena(&ctx->arena);
+	if (ctx->stats || ctx->max_nodes)
+		nodes = count_nodes((htmlNodePtr)doc) - 1;
+	if (ctx->stats)
+		ctx->stats->nodes_before += nodes;
+	if (ctx->max_nodes && nodes > ctx->max_nodes) {
+		ctx->too_many_nodes = true;
+		goto out;
+	}
 
 	/* Do this early to prevent problems when traversing the tree */
 	remove_root_siblings(doc);
 
-	set_base_url_from_doc(doc);
+	set_base_url_from_doc(ctx, doc);
 
 	remove_nodes_if(doc, is_comment);
 	unwrap_noscript_images(doc);
 	remove_nodes_if(doc, is_script_or_noscript);
+	start_phase(ctx->stats, &start);
 	prep_document(doc);
-	get_article_metadata(doc);
+	end_phase(ctx->stats, PHASE_PREP_DOCUMENT, &start);
+	get_article_metadata(ctx, doc);
 
-	article = grab_article(doc);
+	start_phase(ctx->stats, &start);
+	scan_document_attrs(ctx->class_cache, doc);
+	article = grab_article(ctx, doc);
+	end_phase(ctx->stats, PHASE_GRAB_ARTICLE, &start);
 	if (!article)
-		return NULL;
+		goto out;
 
-	fix_all_relative_urls(article);
-	if (!(options.flags & OPT_PRESERVE_CLASSES))
+	start_phase(ctx->stats, &start);
+	fix_all_relative_urls(ctx, article);
+	end_phase(ctx->stats, PHASE_FIX_URLS, &start);
+	if (!(ctx->flags & OPT_PRESERVE_CLASSES))
 		change_descendants(article, clean_classes);
 	change_descendants(article, clean_if_text_node);
 	/* We wouldn't need this if we could print/save a single node as html */
 	change_descendants(article, fill_if_not_self_closing);
 
-	if (!metadata.excerpt)
-		metadata.excerpt = first_paragraph_content(article);
-	clean_metadata();
+	if (!ctx->metadata.excerpt)
+		ctx->metadata.excerpt = first_paragraph_content(article);
+	clean_metadata(&ctx->metadata);
 
 	/* Discard the wrapping div */
 	content = article->children;
-	xmlUnlinkNode(content);
+	unlink_node(content);
 	free_node(article);
+	if (ctx->stats)
+		ctx->stats->nodes_after += count_nodes(content);
+out:
+	if (ctx->stats)
+		ctx->stats->node_infos += node_infos_allocated() - infos;
+	use_arena(prev);
 	return content;
 }
+
+/**
+ * Would the title from the title tag depend on the headings in the body? See
+ * get_article_title() for the details.
+ */
+static bool title_needs_headings(htmlNodePtr titlenode)
+{
+	char *title = (char *)node_get_normalized_content(titlenode);
+	bool ret;
+
+	ret = !find_last_separator(title) && strchr(title, ':');
+	free(title);
+	return ret;
+}
+
+/**
+ * Get the metadata from a document that was only parsed up to the end of the
+ * head; return false if some field may still depend on the body. That is the
+ * excerpt and the byline, which would otherwise be taken from the article, and
+ * the title if it has to be checked against the headings. The direction is
+ * left out: it comes from the ancestors of the article, and any of them could
+ * override the one from the root element.
+ */
+static bool get_head_metadata(struct rdr_context *ctx, htmlDocPtr doc)
+{
+	struct metadata *metadata = &ctx->metadata;
+	htmlNodePtr titlenode;
+
+	titlenode = run_on_nodes_with_data(doc, node_extract_metadata, ctx);
+	if (!metadata->excerpt || !metadata->byline)
+		return false;
+	if (!metadata->title && titlenode) {
+		if (title_needs_headings(titlenode))
+			return false;
+		metadata->title = get_article_title(doc, titlenode);
+	}
+	clean_metadata(metadata);
+	return true;
+}
+
+/**
+ * SAX handler for the end of an element during a head check. Once the head is
+ * complete, see if its metadata is enough, and stop the parser if it is.
+ */
+static void head_check_end_element(void *data, const xmlChar *name)
+{
+	htmlParserCtxtPtr parser = data;
+	struct head_check *check = parser->_private;
+	htmlNodePtr node = parser->node;
+	struct arena *prev;
+
+	check->end_element(data, name);
+	if (check->head_done || !node || node->type != XML_ELEMENT_NODE)
+		return;
+	if (xmlStrcasecmp(node->name, name) || xmlStrcasecmp(name, BAD_CAST "head"))
+		return;
+
+	check->head_done = true;
+	prev = use_arena(&check->ctx.arena);
+	check->passed = get_head_metadata(&check->ctx, parser->myDoc);
+	use_arena(prev);
+	if (check->passed)
+		xmlStopParser(parser);
+}
+
+/**
+ * Look for the metadata in the head of a document as the parser builds it,
+ * so that the parsing can stop as soon as the head is over, if that's enough.
+ * Otherwise the whole document is left for parse().
+ */
+void start_head_check(struct head_check *check, htmlParserCtxtPtr parser)
+{
+	memset(check, 0, sizeof(*check));
+	init_context(&check->ctx, 0, NULL);
+	check->end_element = parser->sax->endElement;
+	parser->sax->endElement = head_check_end_element;
+	parser->_private = check;
+}
+
+/**
+ * Free all memory used by a head check, including the metadata
+ */
+void end_head_check(struct head_check *check)
+{
+	clean_context(&check->ctx);
+	check->passed = false;
+}
@@ -34,19 +34,22 @@
  */
 static bool is_node_paragraph_in_list(htmlNodePtr node)
 {
-	return node_has_tag(node, "p") && has_ancestor_tag(node, "li");
+	return node_has_tag(node, TAG_P) && has_ancestor_tag(node, TAG_LI);
 }
 
 /**
  * Assign a readability score to a node
  */
-static double node_score(htmlNodePtr node)
+static double node_score(struct class_cache *cache, htmlNodePtr node)
 {
+	const struct node_attrs *attrs;
+	struct node_attrs buf;
 	int length;
 
-	if (!is_node_visible(node))
+	attrs = get_node_attrs(cache, node, &buf);
+	if (attrs->flags & ATTR_HIDDEN)
 		return 0;
-	if (node_has_unlikely_class_id(node))
+	if (has_unlikely_class_id(attrs))
 		return 0;
 	if (is_node_paragraph_in_list(node))
 		return 0;
@@ -55,14 +58,22 @@ static double node_score(htmlNodePtr node)
 	return length < 140 ? 0 : sqrt(length - 140);
 }
 
+/* Score that a document needs to be considered readerable */
+#define READERABLE_MIN_SCORE 20
+
 /**
  * fx: Decides whether or not the document is reader-able without parsing the
  * whole thing.
  */
 bool is_probably_readerable(htmlDocPtr doc)
 {
+	struct class_cache *cache;
 	htmlNodePtr node;
 	double score = 0;
+	bool readerable = false;
+
+	init_regexes();
+	cache = new_class_cache();
 
 	/*
 	 * Consider all <p> and <pre> nodes.
@@ -78,11 +89,11 @@ bool is_probably_readerable(htmlDocPtr doc)
 	while (node) {
 		htmlNodePtr parent = node->parent;
 
-		if (node_has_tag(node, "p", "pre")) {
-			score += node_score(node);
+		if (node_has_tag(node, TAG_P, TAG_PRE)) {
+			score += node_score(cache, node);
 			node = following_node(node);
-		} else if (node_has_tag(node, "br") && node_has_tag(parent, "div")) {
-			score += node_score(parent);
+		} else if (node_has_tag(node, TAG_BR) && node_has_tag(parent, TAG_DIV)) {
+			score += node_score(cache, parent);
 			/* We measured the whole parent, so skip its other children */
 			node = skip_node_descendants(parent);
 		} else {
@@ -90,8 +101,121 @@ bool is_probably_readerable(htmlDocPtr doc)
 			continue;
 		}
 
-		if (score > 20)
-			return true;
+		if (score > READERABLE_MIN_SCORE) {
+			readerable = true;
+			break;
+		}
+	}
+	free_class_cache(cache);
+	return readerable;
+}
+
+/**
+ * Add the score of a node that was fully parsed, and stop the parser if that's
+ * enough to decide
+ */
+static void add_check_score(htmlParserCtxtPtr parser, htmlNodePtr node)
+{
+	struct readerable_check *check = parser->_private;
+
+	check->score += node_score(check->cache, node);
+	if (readerable_check_passed(check))
+		xmlStopParser(parser);
+}
+
+/**
+ * Remember an open <div> that was found to have a <br> child
+ */
+static void push_div(struct readerable_check *check, htmlNodePtr div)
+{
+	if (check->div_count && check->divs[check->div_count - 1] == div)
+		return; /* Not the first <br> */
+
+	if (check->div_count == check->div_size) {
+		size_t size = check->div_size ? 2 * check->div_size : 16;
+		htmlNodePtr *divs;
+
+		divs = realloc(check->divs, size * sizeof(*divs));
+		if (!divs)
+			fatal_errno();
+		check->divs = divs;
+		check->div_size = size;
+	}
+	check->divs[check->div_count++] = div;
+}
+
+/**
+ * SAX handler for the start of an element during a readerability check
+ */
+static void check_start_element(void *ctx, const xmlChar *name, const xmlChar **atts)
+{
+	htmlParserCtxtPtr parser = ctx;
+	struct readerable_check *check = parser->_private;
+	htmlNodePtr parent = parser->node; /* The new element goes here */
+
+	if (parent && node_has_tag(parent, TAG_DIV) && !xmlStrcasecmp(name, (xmlChar *)"br"))
+		push_div(check, parent);
+	check->start_element(ctx, name, atts);
+}
+
+/**
+ * SAX handler for the end of an element during a readerability check. This
+ * scores the same nodes as is_probably_readerable(), once they are complete.
+ */
+static void check_end_element(void *ctx, const xmlChar *name)
+{
+	htmlParserCtxtPtr parser = ctx;
+	struct readerable_check *check = parser->_private;
+	htmlNodePtr node = parser->node;
+
+	check->end_element(ctx, name);
+	if (!node || node->type != XML_ELEMENT_NODE || xmlStrcasecmp(node->name, name))
+		return;
+
+	/*
+	 * The nodes that come after the first <br> inside a <div> are skipped,
+	 * because the whole <div> gets measured.
+	 */
+	if (check->div_count && check->divs[check->div_count - 1] == node) {
+		--check->div_count;
+		if (!check->div_count)
+			add_check_score(parser, node);
+	} else if (!check->div_count && node_has_tag(node, TAG_P, TAG_PRE)) {
+		add_check_score(parser, node);
 	}
-	return false;
+}
+
+/**
+ * Run is_probably_readerable() on a document as the parser builds it, so that
+ * the parsing can stop as soon as the check passes
+ */
+void start_readerable_check(struct readerable_check *check, htmlParserCtxtPtr parser)
+{
+	memset(check, 0, sizeof(*check));
+	check->cache = new_class_cache();
+	check->start_element = parser->sax->startElement;
+	check->end_element = parser->sax->endElement;
+	parser->sax->startElement = check_start_element;
+	parser->sax->endElement = check_end_element;
+	parser->_private = check;
+}
+
+/**
+ * Has the document been found readerable yet?
+ */
+bool readerable_check_passed(const struct readerable_check *check)
+{
+	return check->score > READERABLE_MIN_SCORE;
+}
+
+/**
+ * Free all memory used by a readerability check, but keep the result
+ */
+void end_readerable_check(struct readerable_check *check)
+{
+	free_class_cache(check->cache);
+	check->cache = NULL;
+	free(check->divs);
+	check->divs = NULL;
+	check->div_count = check->div_size = 0;
 }
@@ -22,6 +22,9 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
+#include <pthread.h>
+#include <string.h>
 #include "rdrview.h"
 
 /*
@@ -80,51 +83,481 @@
 	"\\.com|(archive|upload\\.wikimedia)\\.org|player\\.twitch\\.tv)"
 
 #define SHARE_RE "(^|[[:space:]]|_)(share|sharedaddy)($|[[:space:]]|_)"
+/* Same as SHARE_RE, but as whole words for the keyword matcher */
+#define SHARE_WORDS "^share$|^sharedaddy$"
+#define SHARE_DELIMS " \t\n\v\f\r_"
 
 #define ABSOLUTE_RE "^([[:alpha:]]+:)?//"
 
 
-/* These are the compiled regexes that will actually get exported */
-regex_t unlikely_re, candidate_re, byline_re, property_re, name_re, imgext_re;
-regex_t hascontent_re, negative_re, positive_re, sentence_dot_re;
-regex_t b64_dataurl_re, srcset_re, src_re, videos_re, share_re, absolute_re;
+/* These are the compiled patterns that will actually get exported */
+struct pattern unlikely_re, candidate_re, byline_re, property_re, name_re;
+struct pattern imgext_re, hascontent_re, negative_re, positive_re;
+struct pattern sentence_dot_re, b64_dataurl_re, srcset_re, src_re, videos_re;
+struct pattern share_re, absolute_re;
 
 /* List of all literal regexes */
 static const char * const REGEXES[] = {
-	UNLIKELY_RE, CANDIDATE_RE, BYLINE_RE, PROPERTY_RE, NAME_RE, IMGEXT_RE,
-	HASCONTENT_RE, NEGATIVE_RE, POSITIVE_RE, SENTENCE_DOT_RE, B64_DATAURL_RE,
-	SRCSET_RE, SRC_RE, VIDEOS_RE, SHARE_RE, ABSOLUTE_RE,
+	PROPERTY_RE, NAME_RE, IMGEXT_RE, HASCONTENT_RE, SENTENCE_DOT_RE,
+	B64_DATAURL_RE, SRCSET_RE, SRC_RE, VIDEOS_RE, ABSOLUTE_RE,
 };
 
 /* List of pointers to all compiled regexes, in the same order as above */
-static regex_t * const PREGS[] = {
-	&unlikely_re, &candidate_re, &byline_re, &property_re, &name_re,
-	&imgext_re, &hascontent_re, &negative_re, &positive_re, &sentence_dot_re,
-	&b64_dataurl_re, &srcset_re, &src_re, &videos_re, &share_re, &absolute_re,
+static struct pattern * const PREGS[] = {
+	&property_re, &name_re, &imgext_re, &hascontent_re, &sentence_dot_re,
+	&b64_dataurl_re, &srcset_re, &src_re, &videos_re, &absolute_re,
 };
 
+/*
+ * The regexes that get checked against the class and id of almost every node
+ * are just lists of alternatives, so they are matched with an Aho-Corasick
+ * automaton instead. An alternative may be anchored with '^' and '$', which
+ * then also match next to any of the delimiters given for the list.
+ */
+static const char * const KEYWORD_LISTS[] = {
+	UNLIKELY_RE, CANDIDATE_RE, BYLINE_RE, NEGATIVE_RE, POSITIVE_RE,
+	SHARE_WORDS,
+};
+
+/* Delimiters for the anchored keywords of each list, in the same order */
+static const char * const KEYWORD_DELIMS[] = {
+	"", "", "", "", "", SHARE_DELIMS,
+};
+
+/* List of pointers to all keyword patterns, in the same order as above */
+static struct pattern * const KEYWORD_PATS[] = {
+	&unlikely_re, &candidate_re, &byline_re, &negative_re, &positive_re,
+	&share_re,
+};
+
+/* A single keyword to match */
+struct keyword {
+	char *str;
+	int len;
+	bool at_start; /* Must be at the start of the string or word */
+	bool at_end; /* Must be at the end of the string or word */
+};
+
+/* A state of the automaton */
+struct kw_state {
+	int fail; /* State for the longest proper suffix that is in the trie */
+	int word; /* Index of the anchored keyword that ends here, or -1 */
+	bool match; /* Some unanchored keyword is a suffix of this state */
+	bool anchored; /* Same, for anchored keywords */
+};
+
+/* A compiled list of keywords, matched as case-insensitive substrings */
+struct keywords {
+	unsigned char classes[256]; /* Alphabet classes for each byte */
+	int class_count; /* Class 0 is for the bytes in no keyword */
+	int *go; /* Transitions, class_count for each state */
+	struct kw_state *states;
+	int state_count;
+	struct keyword *words;
+	int word_count;
+	const char *delims;
+};
+
+/**
+ * Split a list of keyword alternatives into its words
+ */
+static void parse_keywords(struct keywords *kw, const char *list)
+{
+	const char *start = list;
+	int i, j;
+
+	kw->word_count = char_count(list, '|') + 1;
+	kw->words = calloc(kw->word_count, sizeof(*kw->words));
+	if (!kw->words)
+		fatal_errno();
+
+	for (i = 0; i < kw->word_count; ++i) {
+		struct keyword *word = &kw->words[i];
+		const char *end = strchr(start, '|');
+		int len = end ? end - start : (int)strlen(start);
+
+		if (*start == '^') {
+			word->at_start = true;
+			++start;
+			--len;
+		}
+		if (len && start[len - 1] == '$') {
+			word->at_end = true;
+			--len;
+		}
+		assert(len > 0 && strcspn(start, "^$.[]()*+?{}\\") >= (size_t)len);
+
+		word->str = strndup(start, len);
+		if (!word->str)
+			fatal_errno();
+		for (j = 0; j < len; ++j)
+			word->str[j] = tolower(word->str[j]);
+		word->len = len;
+		start += len + (word->at_end ? 1 : 0) + 1;
+	}
+}
+
+/**
+ * Add a new state to the automaton and return its index
+ */
+static int new_kw_state(struct keywords *kw)
+{
+	int size = kw->state_count + 1;
+	int state = kw->state_count;
+
+	kw->states = realloc(kw->states, size * sizeof(*kw->states));
+	kw->go = realloc(kw->go, size * kw->class_count * sizeof(*kw->go));
+	if (!kw->states || !kw->go)
+		fatal_errno();
+	memset(&kw->states[state], 0, sizeof(*kw->states));
+	kw->states[state].word = -1;
+	memset(&kw->go[state * kw->class_count], 0, kw->class_count * sizeof(*kw->go));
+	kw->state_count = size;
+	return state;
+}
+
+/**
+ * Build the Aho-Corasick automaton for a list of keyword alternatives
+ */
+static struct keywords *compile_keywords(const char *list, const char *delims)
+{
+	struct keywords *kw;
+	int *queue;
+	int head, tail, i, j, c;
+
+	kw = calloc(1, sizeof(*kw));
+	if (!kw)
+		fatal_errno();
+	kw->delims = delims;
+	parse_keywords(kw, list);
+
+	/* Give a class to each character in the keywords, for both cases */
+	kw->class_count = 1;
+	for (i = 0; i < kw->word_count; ++i) {
+		for (j = 0; j < kw->words[i].len; ++j) {
+			unsigned char lower = kw->words[i].str[j];
+
+			if (kw->classes[lower])
+				continue;
+			kw->classes[lower] = kw->class_count;
+			kw->classes[toupper(lower)] = kw->class_count;
+			++kw->class_count;
+		}
+	}
+
+	/* Build the trie, with the root as state 0 */
+	new_kw_state(kw);
+	for (i = 0; i < kw->word_count; ++i) {
+		struct keyword *word = &kw->words[i];
+		int state = 0;
+
+		for (j = 0; j < word->len; ++j) {
+			int cls = kw->classes[(unsigned char)word->str[j]];
+			int next = kw->go[state * kw->class_count + cls];
+
+			if (!next) {
+				next = new_kw_state(kw); /* This may move kw->go */
+				kw->go[state * kw->class_count + cls] = next;
+			}
+			state = next;
+		}
+		if (!word->at_start && !word->at_end) {
+			kw->states[state].match = true;
+		} else {
+			assert(kw->states[state].word < 0); /* No repeated keywords */
+			kw->states[state].word = i;
+			kw->states[state].anchored = true;
+		}
+	}
+
+	/* Go breadth-first to set the failure links and complete the transitions */
+	queue = malloc(kw->state_count * sizeof(*queue));
+	if (!queue)
+		fatal_errno();
+	head = tail = 0;
+	for (c = 0; c < kw->class_count; ++c) {
+		if (kw->go[c])
+			queue[tail++] = kw->go[c];
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		struct kw_state *st = &kw->states[state];
+
+		st->match |= kw->states[st->fail].match;
+		st->anchored |= kw->states[st->fail].anchored;
+
+		for (c = 0; c < kw->class_count; ++c) {
+			int *next = &kw->go[state * kw->class_count + c];
+			int fail_next = kw->go[st->fail * kw->class_count + c];
+
+			if (*next) {
+				kw->states[*next].fail = fail_next;
+				queue[tail++] = *next;
+			} else {
+				*next = fail_next;
+			}
+		}
+	}
+	free(queue);
+	return kw;
+}
+
+/**
+ * Is this character a delimiter for the anchored keywords?
+ */
+static inline bool is_kw_delim(const struct keywords *kw, xmlChar c)
+{
+	return c && strchr(kw->delims, c);
+}
+
+/**
+ * Check the anchored keywords that end in this state, at the given position
+ * of the string
+ */
+static bool anchored_match(const struct keywords *kw, int state, const xmlChar *str, int end)
+{
+	for (; state; state = kw->states[state].fail) {
+		const struct keyword *word;
+		int start;
+
+		if (kw->states[state].word < 0)
+			continue;
+		word = &kw->words[kw->states[state].word];
+		start = end - word->len;
+
+		if (word->at_start && start && !is_kw_delim(kw, str[start - 1]))
+			continue;
+		if (word->at_end && str[end] && !is_kw_delim(kw, str[end]))
+			continue;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Check if any of the keywords is found in the string
+ */
+static bool keywords_match(const struct keywords *kw, const xmlChar *str)
+{
+	int state = 0;
+	int i;
+
+	for (i = 0; str[i]; ++i) {
+		state = kw->go[state * kw->class_count + kw->classes[str[i]]];
+		if (kw->states[state].match)
+			return true;
+		if (kw->states[state].anchored && anchored_match(kw, state, str, i + 1))
+			return true;
+	}
+	return false;
+}
+
 /**
  * Compile all regexes to be used
  */
-void init_regexes(void)
+static void compile_regexes(void)
 {
 	int cflags = REG_EXTENDED | REG_ICASE | REG_NOSUB;
 	unsigned int i;
 
 	assert(ARRAY_SIZE(REGEXES) == ARRAY_SIZE(PREGS));
+	assert(ARRAY_SIZE(KEYWORD_LISTS) == ARRAY_SIZE(KEYWORD_PATS));
+	assert(ARRAY_SIZE(KEYWORD_DELIMS) == ARRAY_SIZE(KEYWORD_PATS));
 
 	for (i = 0; i < ARRAY_SIZE(REGEXES); ++i) {
-		if (regcomp(PREGS[i], REGEXES[i], cflags))
+		if (regcomp(&PREGS[i]->regex, REGEXES[i], cflags))
 			fatal();
 	}
+	for (i = 0; i < ARRAY_SIZE(KEYWORD_LISTS); ++i)
+		KEYWORD_PATS[i]->keywords = compile_keywords(KEYWORD_LISTS[i], KEYWORD_DELIMS[i]);
 }
 
 /**
- * Check if a string matches a precompiled regular expression
+ * Compile all regexes to be used, unless that was done already. The library
+ * entry points call this, so users don't need to know about it.
  */
-bool regex_matches(const regex_t *preg, const xmlChar *string)
+void init_regexes(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	if (pthread_once(&once, compile_regexes))
+		fatal();
+}
+
+/**
+ * Check if a string matches a precompiled pattern
+ */
+bool regex_matches(const struct pattern *pat, const xmlChar *string)
 {
 	if (!string)
 		return false;
-	return !regexec(preg, (char *)string, 0, NULL, 0);
+	if (pat->keywords)
+		return keywords_match(pat->keywords, string);
+	return !regexec(&pat->regex, (char *)string, 0, NULL, 0);
+}
+
+/* A class or id string, with the patterns that it matches */
+struct class_entry {
+	xmlChar *str; /* NULL if the entry is free */
+	unsigned int hash;
+	unsigned int flags;
+};
+
+/*
+ * Pages repeat the same few class strings all over, so remember the patterns
+ * matched by each of them. This is a hash table with linear probing.
+ */
+struct class_cache {
+	struct class_entry *entries;
+	size_t size; /* Always a power of two */
+	size_t count;
+	bool frozen; /* Can be shared between threads, so no more entries */
+};
+
+/**
+ * Allocate a new empty cache of classes and ids
+ */
+struct class_cache *new_class_cache(void)
+{
+	struct class_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		fatal_errno();
+	cache->size = 256;
+	cache->entries = calloc(cache->size, sizeof(*cache->entries));
+	if (!cache->entries)
+		fatal_errno();
+	return cache;
+}
+
+/**
+ * Stop making changes to the cache, so that it can be used by several threads
+ */
+void freeze_class_cache(struct class_cache *cache)
+{
+	cache->frozen = true;
+}
+
+/**
+ * Free a cache of classes and ids, and all its entries
+ */
+void free_class_cache(struct class_cache *cache)
+{
+	size_t i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < cache->size; ++i)
+		xmlFree(cache->entries[i].str);
+	free(cache->entries);
+	free(cache);
+}
+
+/**
+ * FNV-1a hash for a string
+ */
+static unsigned int hash_str(const xmlChar *str)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *str; ++str) {
+		hash ^= *str;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Find the slot for a string in the hash table; it may be a free one
+ */
+static struct class_entry *find_class_slot(struct class_entry *entries, size_t size,
+					   const xmlChar *str, unsigned int hash)
+{
+	size_t i = hash & (size - 1);
+
+	while (entries[i].str) {
+		if (entries[i].hash == hash && xmlStrEqual(entries[i].str, str))
+			break;
+		i = (i + 1) & (size - 1);
+	}
+	return &entries[i];
+}
+
+/**
+ * Double the size of the hash table for the cache
+ */
+static void grow_class_cache(struct class_cache *cache)
+{
+	size_t size = 2 * cache->size;
+	struct class_entry *entries;
+	size_t i;
+
+	entries = calloc(size, sizeof(*entries));
+	if (!entries)
+		fatal_errno();
+	for (i = 0; i < cache->size; ++i) {
+		struct class_entry *old = &cache->entries[i];
+
+		if (old->str)
+			*find_class_slot(entries, size, old->str, old->hash) = *old;
+	}
+	free(cache->entries);
+	cache->entries = entries;
+	cache->size = size;
+}
+
+/**
+ * Run all patterns of interest on a class or id string
+ */
+static unsigned int match_class_patterns(const xmlChar *str)
+{
+	unsigned int flags = 0;
+
+	if (regex_matches(&unlikely_re, str))
+		flags |= CLASS_UNLIKELY;
+	if (regex_matches(&candidate_re, str))
+		flags |= CLASS_CANDIDATE;
+	if (regex_matches(&negative_re, str))
+		flags |= CLASS_NEGATIVE;
+	if (regex_matches(&positive_re, str))
+		flags |= CLASS_POSITIVE;
+	if (regex_matches(&byline_re, str))
+		flags |= CLASS_BYLINE;
+	return flags;
+}
+
+/**
+ * Return the CLASS_* flags for all the patterns matched by a class or id
+ * string. The cache may be NULL.
+ */
+unsigned int classify_class_id(struct class_cache *cache, const xmlChar *str)
+{
+	struct class_entry *entry;
+	unsigned int hash;
+
+	if (!str || !*str)
+		return 0;
+	if (!cache)
+		return match_class_patterns(str);
+
+	hash = hash_str(str);
+	entry = find_class_slot(cache->entries, cache->size, str, hash);
+	if (entry->str)
+		return entry->flags;
+	if (cache->frozen)
+		return match_class_patterns(str);
+
+	entry->str = xmlStrdup(str);
+	if (!entry->str)
+		fatal();
+	entry->hash = hash;
+	entry->flags = match_class_patterns(str);
+	if (2 * ++cache->count > cache->size) {
+		unsigned int flags = entry->flags;
+
+		grow_class_cache(cache);
+		return flags;
+	}
+	return entry->flags;
 }
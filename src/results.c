@@ -0,0 +1,307 @@
+/*
+ * Cache for the results of the documents in a batch, so that repeated inputs
+ * are only processed once
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "rdrview.h"
+
+/* A cached result, in the hash table and in the list ordered by last use */
+struct result {
+	struct result_key key;
+	char *output;
+	size_t len;
+	struct result *hash_next; /* Next one in the same bucket */
+	struct result *newer; /* Towards the most recently used one */
+	struct result *older; /* Towards the least recently used one */
+};
+
+struct result_cache {
+	struct result **buckets;
+	size_t bucket_count; /* Always a power of two */
+	size_t count;
+	size_t size; /* Total length of the outputs */
+	size_t max_size;
+	struct result *newest;
+	struct result *oldest;
+};
+
+/**
+ * Rotate the bits of a 64-bit integer to the left
+ */
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * The finalization mix for MurmurHash3, to spread the bits of a hash
+ */
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/**
+ * Hash a buffer with the 128-bit MurmurHash3 for x64, starting from the given
+ * key instead of a single seed, so that several buffers can be chained
+ */
+static void murmur3_128(struct result_key *key, const void *data, size_t len)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	const unsigned char *tail;
+	const unsigned char *pos = data;
+	uint64_t h1 = key->hi, h2 = key->lo;
+	uint64_t k1 = 0, k2 = 0;
+	size_t i;
+
+	for (i = 0; i < len / 16; ++i, pos += 16) {
+		memcpy(&k1, pos, 8);
+		memcpy(&k2, pos + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	tail = pos;
+	k1 = k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+	case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+	case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+	case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+	case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+	case 10: k2 ^= (uint64_t)tail[9] << 8; /* fall through */
+	case 9:
+		k2 ^= (uint64_t)tail[8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		/* fall through */
+	case 8: k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+	case 7: k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+	case 6: k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+	case 5: k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+	case 4: k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+	case 3: k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+	case 2: k1 ^= (uint64_t)tail[1] << 8; /* fall through */
+	case 1:
+		k1 ^= (uint64_t)tail[0];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	key->hi = h1;
+	key->lo = h2;
+}
+
+/**
+ * Work out the key for a document in the cache, from its html and a string
+ * that describes every other setting that affects the result
+ */
+void get_result_key(struct result_key *key, const char *input, size_t len, const char *settings)
+{
+	memset(key, 0, sizeof(*key));
+	murmur3_128(key, input, len);
+	murmur3_128(key, settings, strlen(settings));
+}
+
+/**
+ * Create a new cache, that holds results up to the given total size
+ */
+struct result_cache *new_result_cache(size_t max_size)
+{
+	struct result_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		fatal_errno();
+	cache->bucket_count = 64;
+	cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+	if (!cache->buckets)
+		fatal_errno();
+	cache->max_size = max_size;
+	return cache;
+}
+
+/**
+ * Get the bucket of the hash table for a key
+ */
+static struct result **get_bucket(struct result_cache *cache, const struct result_key *key)
+{
+	return &cache->buckets[key->lo & (cache->bucket_count - 1)];
+}
+
+/**
+ * Take a result out of the list ordered by use
+ */
+static void unlink_result(struct result_cache *cache, struct result *res)
+{
+	if (res->newer)
+		res->newer->older = res->older;
+	else
+		cache->newest = res->older;
+	if (res->older)
+		res->older->newer = res->newer;
+	else
+		cache->oldest = res->newer;
+	res->newer = res->older = NULL;
+}
+
+/**
+ * Put a result at the head of the list ordered by use
+ */
+static void make_newest(struct result_cache *cache, struct result *res)
+{
+	res->older = cache->newest;
+	res->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = res;
+	else
+		cache->oldest = res;
+	cache->newest = res;
+}
+
+/**
+ * Look up the result for a key; if found, return its output and set its
+ * length, and remember that it was just used. Return NULL otherwise.
+ */
+const char *find_result(struct result_cache *cache, const struct result_key *key, size_t *len)
+{
+	struct result *res;
+
+	for (res = *get_bucket(cache, key); res; res = res->hash_next) {
+		if (res->key.hi == key->hi && res->key.lo == key->lo)
+			break;
+	}
+	if (!res)
+		return NULL;
+
+	unlink_result(cache, res);
+	make_newest(cache, res);
+	*len = res->len;
+	return res->output;
+}
+
+/**
+ * Remove the least recently used result from the cache
+ */
+static void evict_oldest(struct result_cache *cache)
+{
+	struct result *res = cache->oldest;
+	struct result **link;
+
+	for (link = get_bucket(cache, &res->key); *link != res; link = &(*link)->hash_next);
+	*link = res->hash_next;
+	unlink_result(cache, res);
+	cache->size -= res->len;
+	--cache->count;
+	free(res->output);
+	free(res);
+}
+
+/**
+ * Double the number of buckets in the hash table, once it gets too full
+ */
+static void grow_buckets(struct result_cache *cache)
+{
+	struct result **old = cache->buckets;
+	size_t old_count = cache->bucket_count;
+	size_t i;
+
+	cache->bucket_count *= 2;
+	cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+	if (!cache->buckets)
+		fatal_errno();
+	for (i = 0; i < old_count; ++i) {
+		struct result *res, *next;
+
+		for (res = old[i]; res; res = next) {
+			struct result **bucket = get_bucket(cache, &res->key);
+
+			next = res->hash_next;
+			res->hash_next = *bucket;
+			*bucket = res;
+		}
+	}
+	free(old);
+}
+
+/**
+ * Save a copy of the output for a key, evicting the least recently used
+ * results as needed to keep under the size limit. Outputs that wouldn't fit
+ * on their own are not saved.
+ */
+void save_result(struct result_cache *cache, const struct result_key *key,
+		 const char *output, size_t len)
+{
+	struct result *res;
+	struct result **bucket;
+	size_t old_len;
+
+	if (len > cache->max_size)
+		return;
+	if (find_result(cache, key, &old_len)) /* Nothing new to save */
+		return;
+	while (cache->size + len > cache->max_size)
+		evict_oldest(cache);
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		fatal_errno();
+	res->output = malloc(len ? len : 1);
+	if (!res->output)
+		fatal_errno();
+	if (len)
+		memcpy(res->output, output, len);
+	res->len = len;
+	res->key = *key;
+
+	if (cache->count >= cache->bucket_count)
+		grow_buckets(cache);
+	bucket = get_bucket(cache, key);
+	res->hash_next = *bucket;
+	*bucket = res;
+	make_newest(cache, res);
+	cache->size += len;
+	++cache->count;
+}
+
+/**
+ * Free the cache and all the results it holds
+ */
+void free_result_cache(struct result_cache *cache)
+{
+	while (cache->oldest)
+		evict_oldest(cache);
+	free(cache->buckets);
+	free(cache);
+}
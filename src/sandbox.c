@@ -21,11 +21,73 @@
 
 #if defined(__linux__)
 
+#include <linux/sched.h> /* For CLONE_THREAD */
+#include <sys/mman.h>
 #include <seccomp.h>
 
-#ifdef __ANDROID__
-#include <sys/mman.h>
+/**
+ * Add the rules needed to start and stop the threads for the extraction
+ * attempts; return true on failure.
+ */
+static bool allow_threads(scmp_filter_ctx ctx)
+{
+	bool fail = false;
+	int rseq;
+
+	/* Only threads, not new processes */
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clone), 1,
+	                         SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_THREAD, CLONE_THREAD));
+	/* The flags for clone3() can't be filtered, so make libc fall back */
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3), 0);
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(set_robust_list), 0);
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(rt_sigprocmask), 0);
+	/* Recent versions of glibc register every thread for this syscall */
+	rseq = seccomp_syscall_resolve_name("rseq");
+	if (rseq != __NR_SCMP_ERROR)
+		fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, rseq, 0);
+#ifndef __ANDROID__ /* These are always allowed on Android */
+	/* Stack guard pages, and their release when the thread exits */
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(mprotect), 1,
+	                         SCMP_A2(SCMP_CMP_MASKED_EQ, PROT_EXEC, 0));
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(madvise), 1,
+	                         SCMP_A2(SCMP_CMP_EQ, MADV_DONTNEED, 0));
 #endif
+	return fail;
+}
+
+/**
+ * Add the rules needed to read the clocks, for the stats or for a deadline;
+ * return true on failure.
+ */
+static bool allow_clocks(scmp_filter_ctx ctx)
+{
+	bool fail = false;
+	int clock_gettime64;
+
+	/*
+	 * The cpu clocks are not in the vdso, so they need the actual syscall;
+	 * the monotonic clock may need it too, if the vdso is not available.
+	 */
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clock_gettime), 0);
+	/* 32-bit systems may use this one instead */
+	clock_gettime64 = seccomp_syscall_resolve_name("clock_gettime64");
+	if (clock_gettime64 != __NR_SCMP_ERROR)
+		fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, clock_gettime64, 0);
+	return fail;
+}
+
+/**
+ * Add the rules needed to measure the cpu time and the memory used for the
+ * stats; return true on failure.
+ */
+static bool allow_stats(scmp_filter_ctx ctx)
+{
+	bool fail = false;
+
+	fail |= allow_clocks(ctx);
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getrusage), 0);
+	return fail;
+}
 
 static void do_start_sandbox(void)
 {
@@ -37,6 +99,7 @@ static void do_start_sandbox(void)
 		fatal_msg("failed to start the sandbox");
 
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(brk), 0);
+	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(read), 0); /* Streamed input and batch jobs */
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(write), 0);
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(writev), 0);
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(dup), 0);
@@ -50,6 +113,12 @@ static void do_start_sandbox(void)
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(munmap), 0);
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(futex), 0);
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(fstat), 0);
+	if (options.flags & OPT_PARALLEL_ATTEMPTS)
+		fail |= allow_threads(ctx);
+	if (options.flags & OPT_STATS)
+		fail |= allow_stats(ctx);
+	else if (options.deadline)
+		fail |= allow_clocks(ctx);
 #ifdef __ANDROID__
 	fail |= seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(madvise), 1,
 	                         SCMP_A2_32(SCMP_CMP_EQ, MADV_DONTNEED, 0));
@@ -0,0 +1,321 @@
+/*
+ * Removal of the script content from the raw HTML, before it's parsed
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "rdrview.h"
+
+/**
+ * Find the first occurrence of a character between two pointers, or return
+ * NULL if there is none
+ */
+static char *find_char(char *str, const char *end, char c)
+{
+#if defined(__SSE2__)
+	const __m128i needle = _mm_set1_epi8(c);
+
+	for (; end - str >= 16; str += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)str);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+		if (mask)
+			return str + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t needle = vdupq_n_u8(c);
+
+	for (; end - str >= 16; str += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)str), needle);
+		/* Narrow the comparison to four bits for each character */
+		uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+
+		if (mask)
+			return str + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; str < end; ++str) {
+		if (*str == c)
+			return str;
+	}
+	return NULL;
+}
+
+/**
+ * Check if the string between two pointers starts with the given head, which
+ * must be in lowercase; the letters are compared as ascii, ignoring case.
+ */
+static bool has_head_nocase(const char *str, const char *end, const char *head)
+{
+	for (; *head; ++str, ++head) {
+		if (str == end)
+			return false;
+		/* Setting the case bit is only harmless because head is lowercase */
+		if (*str != *head && (*head < 'a' || *head > 'z' || (*str | 0x20) != *head))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Find the first tag that starts with the given head, or return NULL if there
+ * is none. The head must begin with '<'.
+ */
+static char *find_tag(char *str, const char *end, const char *head)
+{
+	while ((str = find_char(str, end, '<'))) {
+		if (has_head_nocase(str, end, head))
+			return str;
+		++str;
+	}
+	return NULL;
+}
+
+/**
+ * Overwrite text between script tags with X's; this gets rid of any closing
+ * tags, which would terminate the CDATA section and cause libxml2 to choke.
+ *
+ * We search through the text as ascii, which will fail for some encodings,
+ * but is not likely to corrupt the page because the "<script" ascii string
+ * would have to randomly show up somewhere. As always, the text ends at the
+ * first null, and the last character of the buffer is not considered.
+ */
+void invalidate_script_cdata(char *map, size_t size)
+{
+	const char *end;
+	char *opentag;
+
+	if (!size)
+		fatal();
+	end = map + strnlen(map, size - 1);
+
+	opentag = find_tag(map, end, "<script");
+	while (opentag) {
+		char *gt;
+		char *closetag;
+
+		gt = find_char(opentag + strlen("<script"), end, '>');
+		if (!gt)
+			break; /* Malformed html, just ignore it for now and move on */
+		if (*(gt - 1) == '/') { /* No closing tag for this node */
+			opentag = find_tag(gt, end, "<script");
+			continue;
+		}
+		closetag = find_tag(gt, end, "</script>");
+		if (!closetag)
+			break; /* Malformed html, just ignore it for now and move on */
+		memset(gt + 1, 'X', closetag - (gt + 1));
+		opentag = find_tag(closetag + strlen("</script>"), end, "<script");
+	}
+}
+
+/* States for a script scrubber */
+#define SCRUB_OPEN 0 /* Looking for the next <script */
+#define SCRUB_GT 1 /* Looking for the end of the <script tag */
+#define SCRUB_CLOSE 2 /* Looking for the </script> for the current script */
+#define SCRUB_PASS 3 /* Done, just pass everything on */
+
+/**
+ * Set up a scrubber for a document that will be received in chunks. The
+ * scrubbed text gets passed to the emit function, in order.
+ */
+void init_scrubber(struct script_scrubber *scrub, chunk_fn emit, void *data)
+{
+	memset(scrub, 0, sizeof(*scrub));
+	scrub->state = SCRUB_OPEN;
+	scrub->emit = emit;
+	scrub->data = data;
+}
+
+/**
+ * Mark the next bytes of the scrubber's buffer as ready to pass on. They only
+ * go out with flush_scrubber(), so that each chunk costs a single move of the
+ * buffer, no matter how many scripts it has.
+ */
+static void release_bytes(struct script_scrubber *scrub, size_t count)
+{
+	scrub->pos += count;
+}
+
+/**
+ * Pass on the bytes of the scrubber's buffer that are ready, and discard them
+ */
+static void flush_scrubber(struct script_scrubber *scrub)
+{
+	if (!scrub->pos)
+		return;
+	scrub->emit(scrub->data, scrub->buf, scrub->pos);
+	scrub->len -= scrub->pos;
+	memmove(scrub->buf, scrub->buf + scrub->pos, scrub->len);
+	scrub->pos = 0;
+}
+
+/**
+ * Pass on everything in the scrubber's buffer
+ */
+static void release_all(struct script_scrubber *scrub)
+{
+	scrub->pos = scrub->len;
+	flush_scrubber(scrub);
+	scrub->scan = 0;
+}
+
+/**
+ * Work through the buffer of the scrubber as far as possible, the same way
+ * invalidate_script_cdata() would. Keep only the bytes that may still change,
+ * or that may be part of a tag that hasn't been fully received.
+ */
+static void run_scrubber(struct script_scrubber *scrub)
+{
+	for (;;) {
+		char *start = scrub->buf + scrub->pos;
+		char *end = scrub->buf + scrub->len;
+		size_t len = end - start;
+		char *found;
+
+		switch (scrub->state) {
+		case SCRUB_OPEN:
+			found = find_tag(start + scrub->scan, end, "<script");
+			if (!found) {
+				/* Keep whatever could still become the start of a tag */
+				size_t keep = MIN(len, strlen("<script") - 1);
+
+				release_bytes(scrub, len - keep);
+				scrub->scan = 0;
+				return;
+			}
+			release_bytes(scrub, found - start);
+			scrub->scan = strlen("<script");
+			scrub->state = SCRUB_GT;
+			break;
+		case SCRUB_GT:
+			found = find_char(start + scrub->scan, end, '>');
+			if (!found) {
+				/* Only the last byte is needed to check for a '/' */
+				release_bytes(scrub, len - 1);
+				scrub->scan = 1;
+				return;
+			}
+			if (*(found - 1) == '/') { /* No closing tag for this node */
+				scrub->scan = found - start;
+				scrub->state = SCRUB_OPEN;
+				break;
+			}
+			release_bytes(scrub, found + 1 - start);
+			scrub->scan = 0;
+			scrub->state = SCRUB_CLOSE;
+			break;
+		case SCRUB_CLOSE:
+			found = find_tag(start + scrub->scan, end, "</script>");
+			if (!found) {
+				/* Nothing can be passed on until we know about the tag */
+				if (len >= strlen("</script>"))
+					scrub->scan = len - strlen("</script>") + 1;
+				return;
+			}
+			memset(start, 'X', found - start);
+			release_bytes(scrub, found + strlen("</script>") - start);
+			scrub->scan = 0;
+			scrub->state = SCRUB_OPEN;
+			break;
+		case SCRUB_PASS:
+			release_all(scrub);
+			return;
+		}
+	}
+}
+
+/**
+ * Add bytes to the scrubber's buffer and run it on them. These bytes are known
+ * not to be the last of the document.
+ */
+static void feed_scrubber(struct script_scrubber *scrub, const char *bytes, size_t len)
+{
+	const char *null;
+	size_t count;
+
+	if (scrub->state == SCRUB_PASS) {
+		if (len)
+			scrub->emit(scrub->data, bytes, len);
+		return;
+	}
+
+	/* The text ends at the first null, so nothing else will be scrubbed */
+	null = memchr(bytes, '\0', len);
+	count = null ? (size_t)(null - bytes) : len;
+
+	if (count) {
+		if (scrub->len + count > scrub->size) {
+			size_t size = MAX(2 * scrub->size, scrub->len + count);
+			char *buf;
+
+			buf = realloc(scrub->buf, size);
+			if (!buf)
+				fatal_errno();
+			scrub->buf = buf;
+			scrub->size = size;
+		}
+		memcpy(scrub->buf + scrub->len, bytes, count);
+		scrub->len += count;
+		run_scrubber(scrub);
+		flush_scrubber(scrub);
+	}
+
+	if (null) {
+		scrub->state = SCRUB_PASS;
+		release_all(scrub);
+		scrub->emit(scrub->data, null, len - count);
+	}
+}
+
+/**
+ * Scrub the next chunk of the document
+ */
+void scrub_chunk(struct script_scrubber *scrub, const char *chunk, size_t len)
+{
+	if (!len)
+		return;
+
+	/* The last byte of the document is never scrubbed, so hold it back */
+	if (scrub->held)
+		feed_scrubber(scrub, &scrub->last, 1);
+	feed_scrubber(scrub, chunk, len - 1);
+	scrub->held = true;
+	scrub->last = chunk[len - 1];
+}
+
+/**
+ * The whole document has been received, so pass on any bytes left, as they
+ * are, and free the scrubber's buffer
+ */
+void finish_scrubber(struct script_scrubber *scrub)
+{
+	scrub->state = SCRUB_PASS;
+	release_all(scrub);
+	if (scrub->held)
+		scrub->emit(scrub->data, &scrub->last, 1);
+	scrub->held = false;
+	free(scrub->buf);
+	scrub->buf = NULL;
+	scrub->size = 0;
+}
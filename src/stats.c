@@ -0,0 +1,136 @@
+/*
+ * Timing and counters for the processing of a document, for --stats
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <sys/resource.h>
+#include "rdrview.h"
+
+/**
+ * Get the seconds on a clock, for measuring intervals
+ */
+static double clock_seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts))
+		fatal_errno();
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Get the seconds on the monotonic clock, to check against a deadline
+ */
+double monotonic_seconds(void)
+{
+	return clock_seconds(CLOCK_MONOTONIC);
+}
+
+/**
+ * Save the current wall clock and cpu time of this thread, as the start of a
+ * phase. Nothing is done without stats, so callers need not check.
+ */
+void start_phase(const struct rdr_stats *stats, struct phase_time *start)
+{
+	if (!stats)
+		return;
+	start->wall = clock_seconds(CLOCK_MONOTONIC);
+	start->cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/**
+ * Get the time elapsed since the start of a phase
+ */
+static struct phase_time time_since(const struct phase_time *start)
+{
+	struct phase_time elapsed;
+
+	elapsed.wall = clock_seconds(CLOCK_MONOTONIC) - start->wall;
+	elapsed.cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - start->cpu;
+	return elapsed;
+}
+
+/**
+ * Add the time elapsed since the start to the total for the phase
+ */
+void end_phase(struct rdr_stats *stats, enum stats_phase phase, const struct phase_time *start)
+{
+	struct phase_time elapsed;
+
+	if (!stats)
+		return;
+	elapsed = time_since(start);
+	stats->phases[phase].wall += elapsed.wall;
+	stats->phases[phase].cpu += elapsed.cpu;
+}
+
+/**
+ * Log an extraction attempt with the given flags, which started at the given
+ * time and just ended
+ */
+void end_attempt(struct rdr_stats *stats, unsigned int flags, const struct phase_time *start)
+{
+	struct attempt_stats *attempt;
+
+	if (!stats)
+		return;
+	if (stats->attempt_count < (int)ARRAY_SIZE(stats->attempts)) {
+		attempt = &stats->attempts[stats->attempt_count];
+		attempt->flags = flags;
+		attempt->time = time_since(start);
+	}
+	++stats->attempt_count;
+}
+
+/**
+ * Add all the stats from one struct to another. The attempts are appended for
+ * as long as there is room, the counters are added up, and the peak memory is
+ * the highest of the two.
+ */
+void add_stats(struct rdr_stats *dest, const struct rdr_stats *src)
+{
+	int i;
+
+	for (i = 0; i < PHASE_COUNT; ++i) {
+		dest->phases[i].wall += src->phases[i].wall;
+		dest->phases[i].cpu += src->phases[i].cpu;
+	}
+	for (i = 0; i < src->attempt_count && i < (int)ARRAY_SIZE(src->attempts); ++i) {
+		if (dest->attempt_count + i >= (int)ARRAY_SIZE(dest->attempts))
+			break;
+		dest->attempts[dest->attempt_count + i] = src->attempts[i];
+	}
+	dest->attempt_count += src->attempt_count;
+	dest->nodes_before += src->nodes_before;
+	dest->nodes_after += src->nodes_after;
+	dest->node_infos += src->node_infos;
+	dest->peak_rss = MAX(dest->peak_rss, src->peak_rss);
+}
+
+/**
+ * Save the peak memory usage of the process so far
+ */
+void record_peak_rss(struct rdr_stats *stats)
+{
+	struct rusage usage;
+
+	if (!stats)
+		return;
+	if (getrusage(RUSAGE_SELF, &usage))
+		fatal_errno();
+	stats->peak_rss = MAX(stats->peak_rss, usage.ru_maxrss);
+}
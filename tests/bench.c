@@ -0,0 +1,360 @@
+/*
+ * Benchmark for the extraction code, run on the test pages through the library
+ *
+ * Copyright (C) 2020 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <libxml/HTMLparser.h>
+#include "rdrview.h"
+
+/* Same base url as the test script */
+#define BENCH_BASE_URL "http://fakehost/test/page.html"
+
+/* Same flags as the cli by default */
+#define BENCH_FLAGS (OPT_STRIP_UNLIKELY | OPT_WEIGHT_CLASSES | OPT_CLEAN_CONDITIONALLY)
+
+/* Results for a single test page */
+struct page {
+	char *name;
+	char *html;
+	size_t size;
+	double *times; /* Seconds for each run */
+	double median;
+	double p99;
+	double baseline; /* Median from the baseline file, or zero if missing */
+};
+
+static int runs = 20;
+
+/**
+ * Print usage information and exit
+ */
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-n runs] [-s save-file] [-c baseline-file] [-t percent] [testdir]\n", progname);
+	exit(1);
+}
+
+/**
+ * Get the current time in seconds, for measuring intervals
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal_errno();
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Comparison function for qsort() on an array of doubles
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Return the value for a percentile in a sorted array
+ */
+static double percentile(const double *sorted, size_t count, double pct)
+{
+	size_t i = pct / 100 * (count - 1) + 0.5;
+
+	return sorted[MIN(i, count - 1)];
+}
+
+/**
+ * Read a whole file into a new null-terminated buffer; return NULL if it's not
+ * there
+ */
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *file;
+	char *buf;
+	long len;
+
+	file = fopen(path, "r");
+	if (!file)
+		return NULL;
+	if (fseek(file, 0, SEEK_END) || (len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET))
+		fatal_errno();
+	buf = malloc(len + 1);
+	if (!buf)
+		fatal_errno();
+	if (fread(buf, 1, len, file) != (size_t)len)
+		fatal_msg("I/O error");
+	buf[len] = '\0';
+	fclose(file);
+	*size = len;
+	return buf;
+}
+
+/**
+ * Load all the test pages in a directory, sorted by name; return their count
+ */
+static size_t load_pages(const char *testdir, struct page **pages)
+{
+	struct dirent **entries;
+	size_t count = 0;
+	int n, i;
+
+	n = scandir(testdir, &entries, NULL, alphasort);
+	if (n < 0)
+		fatal_errno();
+	*pages = calloc(n, sizeof(**pages));
+	if (!*pages)
+		fatal_errno();
+
+	for (i = 0; i < n; ++i) {
+		struct page *page = &(*pages)[count];
+		size_t len = strlen(testdir) + strlen(entries[i]->d_name) + sizeof("//source.html");
+		char *path;
+
+		path = malloc(len);
+		if (!path)
+			fatal_errno();
+		snprintf(path, len, "%s/%s/source.html", testdir, entries[i]->d_name);
+		if (entries[i]->d_name[0] != '.')
+			page->html = read_file(path, &page->size);
+		free(path);
+
+		if (page->html) {
+			page->name = strdup(entries[i]->d_name);
+			page->times = calloc(runs, sizeof(*page->times));
+			if (!page->name || !page->times)
+				fatal_errno();
+			++count;
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	return count;
+}
+
+/**
+ * Pass a chunk of html on to the push parser
+ */
+static void push_to_parser(void *data, const char *chunk, size_t len)
+{
+	htmlParseChunk(data, chunk, len, 0 /* terminate */);
+}
+
+/**
+ * Parse a page the way the cli does for a single document: in chunks, through
+ * the script scrubber and into the push parser; return its htmlDocPtr
+ */
+static htmlDocPtr parse_page(const struct page *page)
+{
+	struct script_scrubber scrub;
+	htmlParserCtxtPtr parser;
+	htmlDocPtr doc;
+	size_t pos, len;
+
+	parser = htmlCreatePushParserCtxt(NULL, NULL, NULL, 0, BENCH_BASE_URL, XML_CHAR_ENCODING_NONE);
+	if (!parser)
+		fatal();
+	parser->charset = XML_CHAR_ENCODING_UTF8;
+	htmlCtxtUseOptions(parser, HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING);
+
+	init_scrubber(&scrub, push_to_parser, parser);
+	for (pos = 0; pos < page->size; pos += len) {
+		len = MIN(page->size - pos, STREAM_CHUNK_SIZE);
+		scrub_chunk(&scrub, page->html + pos, len);
+	}
+	finish_scrubber(&scrub);
+
+	htmlParseChunk(parser, NULL, 0, 1 /* terminate */);
+	doc = parser->myDoc;
+	parser->myDoc = NULL;
+	htmlFreeParserCtxt(parser);
+	if (!doc)
+		fatal_msg("libxml2 couldn't parse the document as HTML");
+	return doc;
+}
+
+/**
+ * Parse a page and extract its article; return the seconds it took
+ */
+static double run_page(const struct page *page)
+{
+	struct rdr_context ctx;
+	htmlDocPtr doc;
+	htmlNodePtr article;
+	double start = now();
+
+	doc = parse_page(page);
+	init_context(&ctx, BENCH_FLAGS, BENCH_BASE_URL);
+	article = parse(&ctx, doc);
+	clean_context(&ctx);
+	free_node(article);
+	free_doc(doc);
+	return now() - start;
+}
+
+/**
+ * Read the medians saved to a baseline file by an earlier run
+ */
+static void load_baseline(const char *path, struct page *pages, size_t count)
+{
+	FILE *file;
+	char name[256];
+	double median;
+	size_t i;
+
+	file = fopen(path, "r");
+	if (!file)
+		fatal_errno();
+	while (fscanf(file, "%255s %lf", name, &median) == 2) {
+		for (i = 0; i < count; ++i) {
+			if (strcmp(pages[i].name, name) == 0)
+				pages[i].baseline = median;
+		}
+	}
+	fclose(file);
+}
+
+/**
+ * Save the median times for each page, to compare other runs against
+ */
+static void save_baseline(const char *path, const struct page *pages, size_t count)
+{
+	FILE *file;
+	size_t i;
+
+	file = fopen(path, "w");
+	if (!file)
+		fatal_errno();
+	for (i = 0; i < count; ++i)
+		fprintf(file, "%s %.9f\n", pages[i].name, pages[i].median);
+	if (fclose(file))
+		fatal_errno();
+}
+
+int main(int argc, char *argv[])
+{
+	const char *testdir = "tests/firefox";
+	const char *save_path = NULL;
+	const char *baseline_path = NULL;
+	double threshold = 5;
+	struct page *pages;
+	size_t count, i;
+	double *all_times;
+	double total_time = 0, total_size = 0, log_ratios = 0;
+	size_t compared = 0;
+	struct rusage usage_stats;
+	int opt, j;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "n:s:c:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			runs = atoi(optarg);
+			if (runs <= 0)
+				usage();
+			break;
+		case 's':
+			save_path = optarg;
+			break;
+		case 'c':
+			baseline_path = optarg;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc - 1)
+		usage();
+	if (optind == argc - 1)
+		testdir = argv[optind];
+
+	/* Same as the cli */
+	if (xmlMemSetup(free, malloc, realloc, strdup))
+		fatal();
+	init_regexes();
+
+	count = load_pages(testdir, &pages);
+	if (!count)
+		fatal_msg("no test pages found");
+	if (baseline_path)
+		load_baseline(baseline_path, pages, count);
+
+	all_times = calloc(count * runs, sizeof(*all_times));
+	if (!all_times)
+		fatal_errno();
+
+	printf("%-40s %9s %9s %9s %9s %9s\n", "page", "KiB", "median ms", "p99 ms", "MB/s", "vs base");
+	for (i = 0; i < count; ++i) {
+		struct page *page = &pages[i];
+
+		run_page(page); /* Warm up the caches */
+		for (j = 0; j < runs; ++j) {
+			page->times[j] = run_page(page);
+			all_times[i * runs + j] = page->times[j];
+			total_time += page->times[j];
+		}
+		total_size += (double)page->size * runs;
+
+		qsort(page->times, runs, sizeof(*page->times), compare_doubles);
+		page->median = percentile(page->times, runs, 50);
+		page->p99 = percentile(page->times, runs, 99);
+		printf("%-40s %9.1f %9.3f %9.3f %9.1f", page->name, page->size / 1024.0,
+		       page->median * 1e3, page->p99 * 1e3, page->size / page->median / 1e6);
+		if (page->baseline) {
+			printf(" %+8.1f%%", (page->median / page->baseline - 1) * 100);
+			log_ratios += log(page->median / page->baseline);
+			++compared;
+		}
+		printf("\n");
+	}
+
+	qsort(all_times, count * runs, sizeof(*all_times), compare_doubles);
+	getrusage(RUSAGE_SELF, &usage_stats);
+	printf("\n%zu pages, %d runs each\n", count, runs);
+	printf("throughput: %.1f docs/s, %.1f MB/s\n", count * runs / total_time, total_size / total_time / 1e6);
+	printf("latency: p50 %.3f ms, p99 %.3f ms\n", percentile(all_times, count * runs, 50) * 1e3,
+	       percentile(all_times, count * runs, 99) * 1e3);
+	printf("peak rss: %ld KiB\n", usage_stats.ru_maxrss);
+
+	if (save_path)
+		save_baseline(save_path, pages, count);
+
+	if (compared) {
+		/* The geometric mean keeps the big pages from dominating */
+		double change = (exp(log_ratios / compared) - 1) * 100;
+
+		printf("change vs baseline: %+.1f%% over %zu pages\n", change, compared);
+		if (change > threshold) {
+			fprintf(stderr, "%s: slower than the baseline by more than %.1f%%\n", progname, threshold);
+			return 1;
+		}
+	}
+	return 0;
+}